@@ -132,7 +132,7 @@ static prefix_t
 }
 
 
-static prefix_t 
+prefix_t 
 *Ref_Prefix(prefix_t *prefix)
 {
 	if (prefix == NULL)
@@ -178,20 +178,22 @@ radix_tree_t
 	radix->maxbits = 128;
 	radix->head = NULL;
 	radix->num_active_node = 0;
+	radix->num_prefixes = 0;
 	return (radix);
 }
 
 /*
- * if func is supplied, it will be called as func(node->data)
- * before deleting the node
+ * Free 'head' and the nodes below it. if func is supplied, it will be
+ * called as func(node->data) before deleting the node
  */
 static void
-Clear_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
+radix_free_nodes(radix_tree_t *radix, radix_node_t *head, rdx_cb_t func,
+    void *cbctx)
 {
-	if (radix->head) {
+	if (head) {
 		radix_node_t *Xstack[RADIX_MAXBITS + 1];
 		radix_node_t **Xsp = Xstack;
-		radix_node_t *Xrn = radix->head;
+		radix_node_t *Xrn = head;
 
 		while (Xrn) {
 			radix_node_t *l = Xrn->l;
@@ -220,6 +222,12 @@ Clear_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
 	}
 }
 
+static void
+Clear_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
+{
+	radix_free_nodes(radix, radix->head, func, cbctx);
+}
+
 void
 Destroy_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
 {
@@ -328,9 +336,489 @@ radix_node_t
 	return (radix_search_best2(radix, prefix, 1));
 }
 
+/* As radix_search_best(), but never the given prefix itself */
+radix_node_t
+*radix_search_containing(radix_tree_t *radix, prefix_t *prefix)
+{
+	return (radix_search_best2(radix, prefix, 0));
+}
+
+/*
+ * Stores the nodes of all prefixes covering 'prefix', an exact match
+ * included, in 'nodes' from the longest to the shortest and returns
+ * their number. 'nodes' must have room for RADIX_MAXBITS + 1 entries.
+ */
+int
+radix_search_covering(radix_tree_t *radix, prefix_t *prefix,
+    radix_node_t **nodes)
+{
+	radix_node_t *node;
+	radix_node_t *stack[RADIX_MAXBITS + 1];
+	u_char *addr;
+	u_int bitlen;
+	int cnt = 0, n = 0;
+
+	node = radix->head;
+	addr = prefix_touchar(prefix);
+	bitlen = prefix->bitlen;
+
+	while (node != NULL && node->bit < bitlen) {
+		if (node->prefix)
+			stack[cnt++] = node;
+		if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+			node = node->r;
+		else
+			node = node->l;
+	}
+	if (node != NULL && node->prefix)
+		stack[cnt++] = node;
+
+	while (--cnt >= 0) {
+		node = stack[cnt];
+		if (comp_with_mask(prefix_touchar(node->prefix),
+		    prefix_touchar(prefix), node->prefix->bitlen) &&
+		    node->prefix->bitlen <= bitlen)
+			nodes[n++] = node;
+	}
+	return (n);
+}
+
+/* Returns the shortest prefix covering 'prefix', or NULL */
+radix_node_t
+*radix_search_worst(radix_tree_t *radix, prefix_t *prefix)
+{
+	radix_node_t *node;
+	u_char *addr;
+	u_int bitlen;
+
+	node = radix->head;
+	addr = prefix_touchar(prefix);
+	bitlen = prefix->bitlen;
+
+	while (node != NULL && node->bit <= bitlen) {
+		if (node->prefix && node->prefix->bitlen <= bitlen &&
+		    comp_with_mask(prefix_touchar(node->prefix),
+		    prefix_touchar(prefix), node->prefix->bitlen))
+			return (node);
+		if (node->bit == bitlen)
+			break;
+		if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+			node = node->r;
+		else
+			node = node->l;
+	}
+	return (NULL);
+}
 
+/*
+ * Returns the root of the subtree holding every prefix covered by (or
+ * equal to) 'prefix', or NULL if there are none. The subtree may be
+ * walked with RADIX_WALK.
+ */
 radix_node_t
-*radix_lookup(radix_tree_t *radix, prefix_t *prefix)
+*radix_search_covered(radix_tree_t *radix, prefix_t *prefix)
+{
+	radix_node_t *node;
+	u_char *addr;
+	u_int bitlen;
+
+	node = radix->head;
+	addr = prefix_touchar(prefix);
+	bitlen = prefix->bitlen;
+
+	while (node != NULL && node->bit < bitlen) {
+		if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+			node = node->r;
+		else
+			node = node->l;
+	}
+	if (node == NULL ||
+	    !comp_with_mask(prefix_touchar(radix_node_key(node)),
+	    prefix_touchar(prefix), bitlen))
+		return (NULL);
+	return (node);
+}
+
+
+/* Whether the addresses below 'node' overlap the range 'start'..'end' */
+static int
+radix_span_overlaps(radix_tree_t *radix, radix_node_t *node, u_char *start,
+    u_char *end)
+{
+	u_char lo[16], hi[16], *key, mask;
+	u_int i, len;
+
+	key = prefix_touchar(radix_node_key(node));
+	len = radix->maxbits / 8;
+	for (i = 0; i < len; i++) {
+		if (node->bit >= (i + 1) * 8)
+			mask = 0xff;
+		else if (node->bit <= i * 8)
+			mask = 0;
+		else
+			mask = 0xff << (8 - (node->bit & 0x07));
+		lo[i] = key[i] & mask;
+		hi[i] = key[i] | ~mask;
+	}
+	return (memcmp(hi, start, len) >= 0 && memcmp(lo, end, len) <= 0);
+}
+
+/*
+ * Calls func(node, cbctx) in walk order for each prefix overlapping the
+ * address range 'start'..'end' (inclusive, in network byte order), i.e.
+ * those covering, covered by or partially overlapping it. Subtrees whose
+ * addresses lie outside the range are not descended.
+ */
+void
+radix_search_range(radix_tree_t *radix, u_char *start, u_char *end,
+    rdx_cb_t func, void *cbctx)
+{
+	radix_node_t *stack[RADIX_MAXBITS + 1], **sp = stack, *node;
+
+	if ((node = radix->head) == NULL)
+		return;
+	for (;;) {
+		if (radix_span_overlaps(radix, node, start, end)) {
+			if (node->prefix != NULL)
+				func(node, cbctx);
+			if (node->l != NULL) {
+				if (node->r != NULL)
+					*sp++ = node->r;
+				node = node->l;
+				continue;
+			}
+			if (node->r != NULL) {
+				node = node->r;
+				continue;
+			}
+		}
+		if (sp == stack)
+			break;
+		node = *(--sp);
+	}
+}
+
+/* The first node holding a prefix in a walk of the subtree of 'node' */
+static radix_node_t
+*radix_subtree_first(radix_node_t *node)
+{
+	while (node->prefix == NULL)
+		node = node->l ? node->l : node->r;
+	return (node);
+}
+
+/* The first node holding a prefix in a walk after the subtree of 'node' */
+static radix_node_t
+*radix_skip(radix_node_t *node)
+{
+	while (node->parent != NULL &&
+	    (node == node->parent->r || node->parent->r == NULL))
+		node = node->parent;
+	if (node->parent == NULL)
+		return (NULL);
+	return (radix_subtree_first(node->parent->r));
+}
+
+/* Returns the first node of a walk, holding the least prefix */
+radix_node_t
+*radix_first(radix_tree_t *radix)
+{
+	if (radix->head == NULL)
+		return (NULL);
+	return (radix_subtree_first(radix->head));
+}
+
+/*
+ * Returns the node after 'node' in a walk (i.e. in address, masklen
+ * order) that holds a prefix, or NULL if 'node' is the last one.
+ */
+radix_node_t
+*radix_next(radix_node_t *node)
+{
+	if (node->l != NULL)
+		return (radix_subtree_first(node->l));
+	if (node->r != NULL)
+		return (radix_subtree_first(node->r));
+	return (radix_skip(node));
+}
+
+/* The last node in a walk of the subtree of 'node'; leaves hold prefixes */
+static radix_node_t
+*radix_subtree_last(radix_node_t *node)
+{
+	while (node->l || node->r)
+		node = node->r ? node->r : node->l;
+	return (node);
+}
+
+/*
+ * Returns the node before 'node' in a walk that holds a prefix, or NULL
+ * if 'node' is the first one.
+ */
+radix_node_t
+*radix_prev(radix_node_t *node)
+{
+	radix_node_t *parent;
+
+	while ((parent = node->parent) != NULL) {
+		if (node == parent->r && parent->l != NULL)
+			return (radix_subtree_last(parent->l));
+		if (parent->prefix != NULL)
+			return (parent);
+		node = parent;
+	}
+	return (NULL);
+}
+
+/*
+ * Returns the number of prefixes in the tree that sort before 'prefix',
+ * which is its index if it is in the tree. Takes O(depth) using the
+ * subtree counts.
+ */
+u_int
+radix_rank(radix_tree_t *radix, prefix_t *prefix)
+{
+	radix_node_t *node, *parent;
+	u_int rank = 0;
+
+	if ((node = radix_ceiling(radix, prefix)) == NULL)
+		return (radix->num_prefixes);
+	for (; (parent = node->parent) != NULL; node = parent) {
+		if (parent->prefix != NULL)
+			rank++;
+		if (node == parent->r && parent->l != NULL)
+			rank += parent->l->count;
+	}
+	return (rank);
+}
+
+/* Returns the node holding the k'th (from 0) prefix, or NULL */
+radix_node_t
+*radix_select(radix_tree_t *radix, u_int k)
+{
+	radix_node_t *node;
+
+	if (k >= (u_int)radix->num_prefixes)
+		return (NULL);
+	node = radix->head;
+	for (;;) {
+		if (node->prefix != NULL) {
+			if (k == 0)
+				return (node);
+			k--;
+		}
+		if (node->l != NULL) {
+			if (k < node->l->count) {
+				node = node->l;
+				continue;
+			}
+			k -= node->l->count;
+		}
+		node = node->r;
+	}
+}
+
+/*
+ * Returns the first node holding a prefix greater than or equal to
+ * 'prefix' in address, masklen order, or NULL if there is none. Takes a
+ * single descent of the tree.
+ */
+radix_node_t
+*radix_ceiling(radix_tree_t *radix, prefix_t *prefix)
+{
+	radix_node_t *node;
+	u_char *addr, *key;
+	u_int bitlen, check, i, j;
+
+	if ((node = radix->head) == NULL)
+		return (NULL);
+	addr = prefix_touchar(prefix);
+	bitlen = prefix->bitlen;
+
+	for (;;) {
+		/* Compare the bits both the node and prefix have */
+		key = prefix_touchar(radix_node_key(node));
+		check = node->bit < bitlen ? node->bit : bitlen;
+		for (i = 0; i * 8 < check; i++) {
+			if (addr[i] == key[i])
+				continue;
+			for (j = 0; !((addr[i] ^ key[i]) & (0x80 >> j)); j++)
+				;
+			if (i * 8 + j >= check)
+				break;
+			/* The subtree sorts entirely before or after it */
+			if (addr[i] & (0x80 >> j))
+				return (radix_skip(node));
+			return (radix_subtree_first(node));
+		}
+		if (bitlen <= node->bit)
+			return (radix_subtree_first(node));
+
+		/* The prefix lies below the node; any own prefix is less */
+		if (BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07))) {
+			if (node->r == NULL)
+				return (radix_skip(node));
+			node = node->r;
+		} else {
+			if (node->l == NULL && node->r == NULL)
+				return (radix_skip(node));
+			if (node->l == NULL)
+				return (radix_subtree_first(node->r));
+			node = node->l;
+		}
+	}
+}
+
+/*
+ * As radix_ceiling(), for prefixes arriving in ascending order. '*hint'
+ * caches the previous result; it and its successor are tried before a
+ * fresh descent, so a run of nearby prefixes costs O(1) each. Start with
+ * '*hint' set to NULL and reset it to NULL after modifying the tree.
+ */
+radix_node_t
+*radix_ceiling_sorted(radix_tree_t *radix, prefix_t *prefix,
+    radix_node_t **hint)
+{
+	radix_node_t *node;
+
+	if ((node = *hint) != NULL && prefix_cmp(node->prefix, prefix) < 0)
+		node = radix_next(node);
+	if (node == NULL || prefix_cmp(node->prefix, prefix) < 0)
+		node = radix_ceiling(radix, prefix);
+	*hint = node;
+	return (node);
+}
+
+/*
+ * Add 'delta' to the prefix counts of 'node' and all its ancestors. The
+ * subtree hashes of all of them become stale.
+ */
+static void
+radix_count_add(radix_tree_t *radix, radix_node_t *node, int delta)
+{
+	radix->num_prefixes += delta;
+	for (; node != NULL; node = node->parent) {
+		node->count += delta;
+		node->hash = 0;
+	}
+}
+
+/*
+ * Free space for the allocator. Each node keeps a mask of the lengths of
+ * the maximal free aligned blocks below it, those holding no prefix and
+ * covered by none; its own prefix is not counted, so that the node of a
+ * pool describes the space in it. Bit L - 1 stands for length L.
+ */
+#define RADIX_FAMILY_BITS(prefix)	((prefix)->family == AF_INET ? 32 : 128)
+
+#define FREE_SET(m, len)	((m)[((len) - 1) >> 6] |= \
+				    (u_int64_t)1 << (((len) - 1) & 63))
+#define FREE_TEST(m, len)	((m)[((len) - 1) >> 6] & \
+				    (u_int64_t)1 << (((len) - 1) & 63))
+
+/* Add the free blocks of a region of length 'start' holding 'child' */
+static void
+radix_free_side(u_int start, radix_node_t *child, u_int64_t *m)
+{
+	u_int j;
+
+	if (child == NULL) {
+		FREE_SET(m, start);
+		return;
+	}
+	/* The siblings of the levels the child skips */
+	for (j = start; j < child->bit; j++)
+		FREE_SET(m, j + 1);
+	if (child->prefix == NULL) {
+		m[0] |= child->free[0];
+		m[1] |= child->free[1];
+	}
+}
+
+/*
+ * Address coverage. Counts of covered addresses may reach 2^128, so a
+ * node keeps the number of addresses in its block that no prefix covers
+ * instead, as a 128-bit number in two words, most significant first. A
+ * node holding a prefix has none; a glue node has fewer than 2^128.
+ */
+static void
+u128_pow2(u_int64_t *v, u_int k)
+{
+	v[0] = k >= 64 ? (u_int64_t)1 << (k - 64) : 0;
+	v[1] = k >= 64 ? 0 : (u_int64_t)1 << k;
+}
+
+static void
+u128_add(u_int64_t *a, const u_int64_t *b)
+{
+	u_int64_t lo = a[1] + b[1];
+
+	a[0] += b[0] + (lo < a[1]);
+	a[1] = lo;
+}
+
+static void
+u128_sub(u_int64_t *a, const u_int64_t *b)
+{
+	u_int64_t lo = a[1] - b[1];
+
+	a[0] -= b[0] + (lo > a[1]);
+	a[1] = lo;
+}
+
+/* Add the uncovered addresses of a region of length 'start' */
+static void
+radix_uncovered_side(u_int start, radix_node_t *child, u_int maxbits,
+    u_int64_t *v)
+{
+	u_int64_t n[2], t[2];
+
+	u128_pow2(n, maxbits - start);
+	if (child != NULL) {
+		u128_pow2(t, maxbits - child->bit);
+		u128_sub(n, t);
+		u128_add(n, child->uncovered);
+	}
+	u128_add(v, n);
+}
+
+/*
+ * Recompute the free mask and uncovered count of 'node' from its
+ * children, in a tree of 'maxbits' bit addresses.
+ */
+static void
+radix_augment_node(radix_node_t *node, u_int maxbits)
+{
+	node->free[0] = node->free[1] = 0;
+	node->uncovered[0] = node->uncovered[1] = 0;
+	if (node->bit >= maxbits)
+		return;
+	radix_free_side(node->bit + 1, node->l, node->free);
+	radix_free_side(node->bit + 1, node->r, node->free);
+	if (node->prefix != NULL)
+		return;
+	radix_uncovered_side(node->bit + 1, node->l, maxbits,
+	    node->uncovered);
+	radix_uncovered_side(node->bit + 1, node->r, maxbits,
+	    node->uncovered);
+}
+
+/* As radix_augment_node(), for 'node' and its ancestors */
+static void
+radix_augment(radix_node_t *node, u_int maxbits)
+{
+	for (; node != NULL; node = node->parent)
+		radix_augment_node(node, maxbits);
+}
+
+/*
+ * If 'hint' is supplied, the descent from the head is skipped and the
+ * first differing bit is computed against hint's prefix instead. This is
+ * only valid when 'hint' holds the greatest prefix in the tree (in
+ * address, masklen order) and 'prefix' sorts after it.
+ */
+static radix_node_t
+*radix_lookup2(radix_tree_t *radix, prefix_t *prefix, radix_node_t *hint)
 {
 	radix_node_t *node, *new_node, *parent, *glue;
 	u_char *addr, *test_addr;
@@ -342,17 +830,20 @@ radix_node_t
 			return (NULL);
 		memset(node, '\0', sizeof(*node));
 		node->bit = prefix->bitlen;
+		node->count = 1;
 		node->prefix = Ref_Prefix(prefix);
 		node->parent = NULL;
 		node->l = node->r = NULL;
 		node->data = NULL;
 		radix->head = node;
 		radix->num_active_node++;
+		radix->num_prefixes++;
+		radix_augment(node, RADIX_FAMILY_BITS(prefix));
 		return (node);
 	}
 	addr = prefix_touchar(prefix);
 	bitlen = prefix->bitlen;
-	node = radix->head;
+	node = hint != NULL ? hint : radix->head;
 
 	while (node->bit < bitlen || node->prefix == NULL) {
 		if (node->bit < radix->maxbits && BIT_TEST(addr[node->bit >> 3],
@@ -395,8 +886,11 @@ radix_node_t
 	}
 
 	if (differ_bit == bitlen && node->bit == bitlen) {
-		if (node->prefix == NULL)
+		if (node->prefix == NULL) {
 			node->prefix = Ref_Prefix(prefix);
+			radix_count_add(radix, node, 1);
+			radix_augment(node, RADIX_FAMILY_BITS(prefix));
+		}
 		return (node);
 	}
 	if ((new_node = PyMem_Malloc(sizeof(*new_node))) == NULL)
@@ -417,9 +911,12 @@ radix_node_t
 		else
 			node->l = new_node;
 
+		radix_count_add(radix, new_node, 1);
+		radix_augment(new_node, RADIX_FAMILY_BITS(prefix));
 		return (new_node);
 	}
 	if (bitlen == differ_bit) {
+		new_node->count = node->count;
 		if (bitlen < radix->maxbits && BIT_TEST(test_addr[bitlen >> 3],
 		    0x80 >> (bitlen & 0x07)))
 			new_node->r = node;
@@ -440,6 +937,7 @@ radix_node_t
 			return (NULL);
 		memset(glue, '\0', sizeof(*glue));
 		glue->bit = differ_bit;
+		glue->count = node->count;
 		glue->prefix = NULL;
 		glue->parent = node->parent;
 		glue->data = NULL;
@@ -464,27 +962,91 @@ radix_node_t
 
 		node->parent = glue;
 	}
+	radix_count_add(radix, new_node, 1);
+	radix_augment(new_node, RADIX_FAMILY_BITS(prefix));
 	return (new_node);
 }
 
+radix_node_t
+*radix_lookup(radix_tree_t *radix, prefix_t *prefix)
+{
+	return (radix_lookup2(radix, prefix, NULL));
+}
 
-void
-radix_remove(radix_tree_t *radix, radix_node_t *node)
+/*
+ * Glue nodes have no prefix of their own. Returns the prefix of the node
+ * or of one below it; either way its first node->bit bits are the key
+ * that leads to the node.
+ */
+prefix_t
+*radix_node_key(radix_node_t *node)
 {
-	radix_node_t *parent, *child;
+	while (node->prefix == NULL)
+		node = node->l ? node->l : node->r;
+	return (node->prefix);
+}
 
-	if (node->r && node->l) {
-		/*
-		 * this might be a placeholder node -- have to check and make
-		 * sure there is a prefix aossciated with it !
-		 */
-		if (node->prefix != NULL)
-			Deref_Prefix(node->prefix);
-		node->prefix = NULL;
+/* Returns the greatest prefix in the tree, i.e. the last one in a walk */
+radix_node_t
+*radix_last(radix_tree_t *radix)
+{
+	radix_node_t *node;
+
+	if ((node = radix->head) == NULL)
+		return (NULL);
+	return (radix_subtree_last(node));
+}
+
+/*
+ * Insert a prefix, using '*hint' to skip the descent from the head when
+ * prefixes arrive in sorted order (as produced by RADIX_WALK). '*hint'
+ * caches the greatest node of the tree; start with it set to NULL and
+ * reset it to NULL after removing nodes from the tree. Prefixes that
+ * arrive out of order fall back to a regular radix_lookup().
+ */
+radix_node_t
+*radix_lookup_sorted(radix_tree_t *radix, prefix_t *prefix,
+    radix_node_t **hint)
+{
+	radix_node_t *last, *node;
+
+	if ((last = *hint) == NULL)
+		last = radix_last(radix);
+	if (last != NULL && prefix_cmp(prefix, last->prefix) > 0) {
+		if ((node = radix_lookup2(radix, prefix, last)) != NULL)
+			*hint = node;
+		return (node);
+	}
+	if ((node = radix_lookup(radix, prefix)) != NULL)
+		*hint = last != NULL ? last : node;
+	return (node);
+}
+
+void
+radix_remove(radix_tree_t *radix, radix_node_t *node)
+{
+	radix_node_t *parent, *child;
+	u_int maxbits;
+
+	if (node->r && node->l) {
+		/*
+		 * this might be a placeholder node -- have to check and make
+		 * sure there is a prefix aossciated with it !
+		 */
+		if (node->prefix != NULL) {
+			maxbits = RADIX_FAMILY_BITS(node->prefix);
+			Deref_Prefix(node->prefix);
+			radix_count_add(radix, node, -1);
+			node->prefix = NULL;
+			radix_augment(node, maxbits);
+		}
+		node->prefix = NULL;
 		/* Also I needed to clear data pointer -- masaki */
 		node->data = NULL;
 		return;
 	}
+	maxbits = RADIX_FAMILY_BITS(node->prefix);
+	radix_count_add(radix, node, -1);
 	if (node->r == NULL && node->l == NULL) {
 		parent = node->parent;
 		Deref_Prefix(node->prefix);
@@ -503,8 +1065,10 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 			child = parent->r;
 		}
 
-		if (parent->prefix)
+		if (parent->prefix) {
+			radix_augment(parent, maxbits);
 			return;
+		}
 
 		/* we need to remove parent too */
 		if (parent->parent == NULL)
@@ -517,6 +1081,7 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 		child->parent = parent->parent;
 		PyMem_Free(parent);
 		radix->num_active_node--;
+		radix_augment(child->parent, maxbits);
 		return;
 	}
 	if (node->r)
@@ -539,6 +1104,105 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 		parent->r = child;
 	else
 		parent->l = child;
+	radix_augment(parent, maxbits);
+}
+
+/*
+ * Unlink the subtree of 'node' and free it, with every prefix in it. The
+ * data pointers of its nodes are left to the caller to deal with first.
+ */
+void
+radix_remove_subtree(radix_tree_t *radix, radix_node_t *node)
+{
+	radix_node_t *parent, *child;
+	u_int maxbits;
+
+	maxbits = RADIX_FAMILY_BITS(radix_node_key(node));
+	parent = node->parent;
+	if (parent == NULL) {
+		radix->head = NULL;
+		radix->num_prefixes -= node->count;
+	} else {
+		radix_count_add(radix, parent, -(int)node->count);
+		if (parent->r == node)
+			parent->r = NULL;
+		else
+			parent->l = NULL;
+		if (parent->prefix != NULL)
+			radix_augment(parent, maxbits);
+		else {
+			/* A glue node left with one child goes too */
+			child = parent->l != NULL ? parent->l : parent->r;
+			child->parent = parent->parent;
+			if (parent->parent == NULL)
+				radix->head = child;
+			else if (parent->parent->r == parent)
+				parent->parent->r = child;
+			else
+				parent->parent->l = child;
+			PyMem_Free(parent);
+			radix->num_active_node--;
+			radix_augment(child->parent, maxbits);
+		}
+	}
+	node->parent = NULL;
+	radix_free_nodes(radix, node, NULL, NULL);
+}
+
+/*
+ * Put the tree back in order after prefixes were cleared from nodes:
+ * nodes without a prefix and with fewer than two children are removed
+ * and the counts of the others recomputed, in a post-order walk. Only
+ * the subtrees whose hashes are stale can have changed. Returns the node
+ * that takes the place of 'node'.
+ */
+static radix_node_t
+*radix_compact(radix_tree_t *radix, radix_node_t *node, u_int maxbits)
+{
+	radix_node_t *l, *r;
+
+	if (node == NULL || node->hash != 0)
+		return (node);
+	if ((l = node->l = radix_compact(radix, node->l, maxbits)) != NULL)
+		l->parent = node;
+	if ((r = node->r = radix_compact(radix, node->r, maxbits)) != NULL)
+		r->parent = node;
+	if (node->prefix == NULL && (l == NULL || r == NULL)) {
+		PyMem_Free(node);
+		radix->num_active_node--;
+		return (l != NULL ? l : r);
+	}
+	node->count = (node->prefix != NULL) + (l != NULL ? l->count : 0) +
+	    (r != NULL ? r->count : 0);
+	radix_augment_node(node, maxbits);
+	return (node);
+}
+
+/*
+ * Remove the prefixes of the 'n' nodes 'nodes' from the tree, with one
+ * clean-up walk at the end rather than one per prefix. As with
+ * radix_remove(), the data pointers are left to the caller.
+ */
+void
+radix_remove_many(radix_tree_t *radix, radix_node_t **nodes, size_t n)
+{
+	u_int maxbits;
+	size_t i;
+
+	if (n == 0)
+		return;
+	maxbits = RADIX_FAMILY_BITS(nodes[0]->prefix);
+	for (i = 0; i < n; i++) {
+		/* The hashes on the path mark where the walk must look */
+		radix_hash_invalidate(nodes[i]);
+		nodes[i]->hash = 0;
+		Deref_Prefix(nodes[i]->prefix);
+		nodes[i]->prefix = NULL;
+		nodes[i]->data = NULL;
+	}
+	radix->num_prefixes -= n;
+	if ((radix->head = radix_compact(radix, radix->head, maxbits)) != NULL)
+		radix->head->parent = NULL;
 }
 
 /* Local additions */
@@ -556,17 +1220,21 @@ sanitise_mask(u_char *addr, u_int masklen, u_int maskbits)
 		addr[i] = 0;
 }
 
+/*
+ * Parse 'string' into the caller's 'prefix' storage, which is returned
+ * with a zero reference count (Ref_Prefix() copies it when it is put in
+ * a tree).
+ */
 prefix_t
-*prefix_pton(const char *string, long len, const char **errmsg)
+*prefix_pton2(const char *string, long len, prefix_t *prefix,
+    const char **errmsg)
 {
 	char save[256], *cp, *ep;
 	struct addrinfo hints, *ai;
-	void *addr;
-	prefix_t *ret;
+	u_char addr[16];
 	size_t slen;
-	int r;
-
-	ret = NULL;
+	long maxbits;
+	int family, r;
 
 	/* Copy the string to parse, because we modify it */
 	if ((slen = strlen(string) + 1) > sizeof(save)) {
@@ -588,52 +1256,69 @@ prefix_t
 		}
 		/* More checks below */
 	}
-	memset(&hints, '\0', sizeof(hints));
-	hints.ai_flags = AI_NUMERICHOST;
 
-	if ((r = getaddrinfo(save, NULL, &hints, &ai)) != 0) {
-		*errmsg = gai_strerror(r);
-		return NULL;
-	}
-	if (ai == NULL || ai->ai_addr == NULL) {
-		*errmsg = "getaddrinfo returned no result";
-		goto out;
-	}
-	switch (ai->ai_addr->sa_family) {
-	case AF_INET:
-		if (len == -1)
-			len = 32;
-		else if (len < 0 || len > 32) {
-			*errmsg = "invalid prefix length";
-			goto out;
+#if !defined(_MSC_VER)
+	/* Plain numeric addresses don't need the resolver */
+	if (inet_pton(AF_INET, save, addr) == 1)
+		family = AF_INET;
+	else if (inet_pton(AF_INET6, save, addr) == 1)
+		family = AF_INET6;
+	else
+#endif
+	{
+		memset(&hints, '\0', sizeof(hints));
+		hints.ai_flags = AI_NUMERICHOST;
+
+		if ((r = getaddrinfo(save, NULL, &hints, &ai)) != 0) {
+			*errmsg = gai_strerror(r);
+			return (NULL);
 		}
-		addr = &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
-		sanitise_mask(addr, len, 32);
-		break;
-	case AF_INET6:
-		if (len == -1)
-			len = 128;
-		else if (len < 0 || len > 128) {
-			*errmsg = "invalid prefix length";
-			goto out;
+		if (ai == NULL || ai->ai_addr == NULL) {
+			*errmsg = "getaddrinfo returned no result";
+			if (ai != NULL)
+				freeaddrinfo(ai);
+			return (NULL);
 		}
-		addr = &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
-		sanitise_mask(addr, len, 128);
-		break;
-	default:
-		goto out;
+		family = ai->ai_addr->sa_family;
+		if (family == AF_INET) {
+			memcpy(addr,
+			    &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+		} else if (family == AF_INET6) {
+			memcpy(addr,
+			    &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 16);
+		}
+		freeaddrinfo(ai);
+		if (family != AF_INET && family != AF_INET6)
+			return (NULL);
 	}
 
-	ret = New_Prefix2(ai->ai_addr->sa_family, addr, len, NULL);
+	maxbits = family == AF_INET ? 32 : 128;
+	if (len == -1)
+		len = maxbits;
+	else if (len < 0 || len > maxbits) {
+		*errmsg = "invalid prefix length";
+		return (NULL);
+	}
+	sanitise_mask(addr, len, maxbits);
+	return (New_Prefix2(family, addr, len, prefix));
+}
+
+prefix_t
+*prefix_pton(const char *string, long len, const char **errmsg)
+{
+	prefix_t prefix, *ret;
+
+	if (prefix_pton2(string, len, &prefix, errmsg) == NULL)
+		return (NULL);
+	ret = New_Prefix2(prefix.family, &prefix.add, prefix.bitlen, NULL);
 	if (ret == NULL)
 		*errmsg = "New_Prefix2 failed";
-out:
-	freeaddrinfo(ai);
 	return (ret);
 }
 
+/* As prefix_from_blob(), but into the caller's 'prefix' storage */
 prefix_t
-*prefix_from_blob(u_char *blob, int len, int prefixlen)
+*prefix_from_blob2(u_char *blob, int len, int prefixlen, prefix_t *prefix)
 {
 	int family, maxprefix;
 
@@ -656,7 +1341,13 @@ prefix_t
 		prefixlen = maxprefix;
 	if (prefixlen < 0 || prefixlen > maxprefix)
 		return NULL;
-	return (New_Prefix2(family, blob, prefixlen, NULL));
+	return (New_Prefix2(family, blob, prefixlen, prefix));
+}
+
+prefix_t
+*prefix_from_blob(u_char *blob, int len, int prefixlen)
+{
+	return (prefix_from_blob2(blob, len, prefixlen, NULL));
 }
 
 const char *
@@ -676,3 +1367,871 @@ prefix_ntop(prefix_t *prefix, char *buf, size_t len)
 
 	return (buf);
 }
+
+/*
+ * Store in 'out' the prefix of length 'bitlen' (at most that of 'prefix')
+ * that covers 'prefix'.
+ */
+prefix_t
+*prefix_supernet(prefix_t *prefix, u_int bitlen, prefix_t *out)
+{
+	u_char addr[16];
+	u_int maxbits = prefix->family == AF_INET ? 32 : 128;
+
+	memcpy(addr, &prefix->add, maxbits / 8);
+	sanitise_mask(addr, bitlen, maxbits);
+	return (New_Prefix2(prefix->family, addr, bitlen, out));
+}
+
+/* Compare two prefixes of the same family in (address, masklen) order */
+int
+prefix_cmp(prefix_t *a, prefix_t *b)
+{
+	int r;
+
+	if (a->family != b->family)
+		return (a->family == AF_INET ? -1 : 1);
+	r = memcmp(&a->add, &b->add, a->family == AF_INET ? 4 : 16);
+	if (r != 0)
+		return (r);
+	if (a->bitlen != b->bitlen)
+		return (a->bitlen < b->bitlen ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Packed prefix records: one byte of address family (4 or 6, never the
+ * platform's AF_* value), one byte of masklen and then the 4 or 16 byte
+ * address. 'buf' must have room for PREFIX_PACKED_MAX bytes.
+ */
+size_t
+prefix_pack(prefix_t *prefix, u_char *buf)
+{
+	size_t alen = prefix->family == AF_INET ? 4 : 16;
+
+	buf[0] = prefix->family == AF_INET ? 4 : 6;
+	buf[1] = prefix->bitlen;
+	memcpy(buf + 2, &prefix->add, alen);
+	return (alen + 2);
+}
+
+/*
+ * Parse one packed record into caller-supplied storage. Returns the
+ * number of bytes consumed, or 0 if the record is truncated or invalid.
+ */
+size_t
+prefix_unpack(const u_char *buf, size_t len, prefix_t *prefix)
+{
+	u_char addr[16];
+	size_t alen;
+	int family;
+	u_int maxbits;
+
+	if (len < 2)
+		return (0);
+	switch (buf[0]) {
+	case 4:
+		family = AF_INET;
+		alen = 4;
+		maxbits = 32;
+		break;
+	case 6:
+		family = AF_INET6;
+		alen = 16;
+		maxbits = 128;
+		break;
+	default:
+		return (0);
+	}
+	if (len < alen + 2 || buf[1] > maxbits)
+		return (0);
+	memcpy(addr, buf + 2, alen);
+	sanitise_mask(addr, buf[1], maxbits);
+	if (New_Prefix2(family, addr, buf[1], prefix) == NULL)
+		return (0);
+	return (alen + 2);
+}
+
+/*
+ * Address ranges: lists of disjoint, non-adjacent inclusive ranges of
+ * addresses in ascending order, for operations on the address space a
+ * tree covers rather than on its prefixes.
+ */
+
+void
+radix_ranges_init(radix_ranges_t *list, int family)
+{
+	list->family = family;
+	list->len = family == AF_INET ? 4 : 16;
+	list->n = list->max = 0;
+	list->ranges = NULL;
+}
+
+void
+radix_ranges_free(radix_ranges_t *list)
+{
+	PyMem_Free(list->ranges);
+	list->ranges = NULL;
+	list->n = list->max = 0;
+}
+
+/* Add one to an address; returns non-zero if it wrapped around */
+static int
+addr_inc(u_char *addr, u_int len)
+{
+	while (len-- > 0) {
+		if (++addr[len] != 0)
+			return (0);
+	}
+	return (1);
+}
+
+/* Subtract one from an address; returns non-zero if it wrapped around */
+static int
+addr_dec(u_char *addr, u_int len)
+{
+	while (len-- > 0) {
+		if (addr[len]-- != 0)
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Append the range 'lo'..'hi', which must not start before the last one,
+ * merging it with the last one if they overlap or are adjacent.
+ */
+int
+radix_ranges_append(radix_ranges_t *list, const u_char *lo, const u_char *hi)
+{
+	radix_range_t *last, *tmp;
+	u_char next[16];
+	size_t max;
+
+	if (list->n > 0) {
+		last = &list->ranges[list->n - 1];
+		memcpy(next, last->hi, list->len);
+		if (addr_inc(next, list->len) ||
+		    memcmp(lo, next, list->len) <= 0) {
+			if (memcmp(hi, last->hi, list->len) > 0)
+				memcpy(last->hi, hi, list->len);
+			return (0);
+		}
+	}
+	if (list->n == list->max) {
+		max = list->max == 0 ? 64 : list->max * 2;
+		if ((tmp = PyMem_Realloc(list->ranges,
+		    max * sizeof(*tmp))) == NULL)
+			return (-1);
+		list->ranges = tmp;
+		list->max = max;
+	}
+	memcpy(list->ranges[list->n].lo, lo, list->len);
+	memcpy(list->ranges[list->n].hi, hi, list->len);
+	list->n++;
+	return (0);
+}
+
+/* Append the addresses of 'prefix' */
+int
+radix_ranges_append_prefix(radix_ranges_t *list, prefix_t *prefix)
+{
+	u_char lo[16], hi[16];
+	u_int i, bits;
+
+	memcpy(lo, &prefix->add, list->len);
+	memcpy(hi, &prefix->add, list->len);
+	for (i = 0; i < list->len; i++) {
+		bits = i * 8;
+		if (prefix->bitlen >= bits + 8)
+			continue;
+		if (prefix->bitlen <= bits) {
+			lo[i] = 0;
+			hi[i] = 0xff;
+		} else {
+			lo[i] &= 0xff << (8 - (prefix->bitlen - bits));
+			hi[i] |= 0xff >> (prefix->bitlen - bits);
+		}
+	}
+	return (radix_ranges_append(list, lo, hi));
+}
+
+/*
+ * Collect the addresses covered by the prefixes of 'radix'. The subtree
+ * below each prefix is skipped, since its addresses are already covered.
+ */
+int
+radix_ranges_from_tree(radix_ranges_t *list, radix_tree_t *radix)
+{
+	radix_node_t *node;
+
+	for (node = radix_first(radix); node != NULL;
+	    node = radix_skip(node)) {
+		if (radix_ranges_append_prefix(list, node->prefix) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/* Merge two lists of ranges into 'out' */
+static int
+radix_ranges_union(radix_ranges_t *a, radix_ranges_t *b,
+    radix_ranges_t *out)
+{
+	radix_range_t *r;
+	size_t i = 0, j = 0;
+
+	while (i < a->n || j < b->n) {
+		if (j == b->n || (i < a->n && memcmp(a->ranges[i].lo,
+		    b->ranges[j].lo, out->len) <= 0))
+			r = &a->ranges[i++];
+		else
+			r = &b->ranges[j++];
+		if (radix_ranges_append(out, r->lo, r->hi) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+static int
+radix_ranges_intersection(radix_ranges_t *a, radix_ranges_t *b,
+    radix_ranges_t *out)
+{
+	u_char *lo, *hi;
+	size_t i = 0, j = 0;
+	u_int len = out->len;
+
+	while (i < a->n && j < b->n) {
+		lo = memcmp(a->ranges[i].lo, b->ranges[j].lo, len) > 0 ?
+		    a->ranges[i].lo : b->ranges[j].lo;
+		hi = memcmp(a->ranges[i].hi, b->ranges[j].hi, len) < 0 ?
+		    a->ranges[i].hi : b->ranges[j].hi;
+		if (memcmp(lo, hi, len) <= 0 &&
+		    radix_ranges_append(out, lo, hi) != 0)
+			return (-1);
+		if (hi == a->ranges[i].hi)
+			i++;
+		else
+			j++;
+	}
+	return (0);
+}
+
+static int
+radix_ranges_difference(radix_ranges_t *a, radix_ranges_t *b,
+    radix_ranges_t *out)
+{
+	u_char cur[16], end[16];
+	size_t i, j = 0, k;
+	u_int len = out->len;
+	int done;
+
+	for (i = 0; i < a->n; i++) {
+		memcpy(cur, a->ranges[i].lo, len);
+		while (j < b->n && memcmp(b->ranges[j].hi, cur, len) < 0)
+			j++;
+		done = 0;
+		for (k = j; !done && k < b->n &&
+		    memcmp(b->ranges[k].lo, a->ranges[i].hi, len) <= 0; k++) {
+			if (memcmp(b->ranges[k].lo, cur, len) > 0) {
+				memcpy(end, b->ranges[k].lo, len);
+				addr_dec(end, len);
+				if (radix_ranges_append(out, cur, end) != 0)
+					return (-1);
+			}
+			if (memcmp(b->ranges[k].hi, a->ranges[i].hi, len) >= 0)
+				done = 1;
+			else {
+				memcpy(cur, b->ranges[k].hi, len);
+				addr_inc(cur, len);
+			}
+		}
+		if (!done && radix_ranges_append(out, cur,
+		    a->ranges[i].hi) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/* Compute 'a' op 'b' into 'out', which must be empty */
+int
+radix_ranges_op(int op, radix_ranges_t *a, radix_ranges_t *b,
+    radix_ranges_t *out)
+{
+	radix_ranges_t ab, ba;
+	int r;
+
+	switch (op) {
+	case RADIX_SET_UNION:
+		return (radix_ranges_union(a, b, out));
+	case RADIX_SET_INTERSECTION:
+		return (radix_ranges_intersection(a, b, out));
+	case RADIX_SET_DIFFERENCE:
+		return (radix_ranges_difference(a, b, out));
+	default:
+		radix_ranges_init(&ab, out->family);
+		radix_ranges_init(&ba, out->family);
+		r = -1;
+		if (radix_ranges_difference(a, b, &ab) == 0 &&
+		    radix_ranges_difference(b, a, &ba) == 0)
+			r = radix_ranges_union(&ab, &ba, out);
+		radix_ranges_free(&ab);
+		radix_ranges_free(&ba);
+		return (r);
+	}
+}
+
+/* Addresses as 128-bit numbers, in two words as for the coverage counts */
+static void
+addr_to_u128(const u_char *addr, u_int len, u_int64_t *v)
+{
+	u_int i;
+
+	v[0] = v[1] = 0;
+	for (i = 0; i < len; i++) {
+		v[0] = (v[0] << 8) | (v[1] >> 56);
+		v[1] = (v[1] << 8) | addr[i];
+	}
+}
+
+static void
+u128_to_addr(const u_int64_t *v, u_int len, u_char *addr)
+{
+	u_int i;
+
+	for (i = 0; i < len; i++) {
+		addr[len - 1 - i] = (i < 8 ? v[1] >> (i * 8) :
+		    v[0] >> ((i - 8) * 8)) & 0xff;
+	}
+}
+
+static u_int
+u64_ctz(u_int64_t v)
+{
+#if defined(__GNUC__)
+	return (__builtin_ctzll(v));
+#else
+	u_int n = 0;
+
+	for (; (v & 1) == 0; v >>= 1)
+		n++;
+	return (n);
+#endif
+}
+
+static u_int
+u64_bitlen(u_int64_t v)
+{
+#if defined(__GNUC__)
+	return (v == 0 ? 0 : 64 - __builtin_clzll(v));
+#else
+	u_int n = 0;
+
+	for (; v != 0; v >>= 1)
+		n++;
+	return (n);
+#endif
+}
+
+/*
+ * Call func(prefix, cbctx) for each prefix of the shortest list of
+ * prefixes covering exactly the addresses 'lo'..'hi', in ascending order.
+ * Each prefix is the largest block that is aligned at the next address
+ * and ends within the range, found with word operations. Returns the
+ * first non-zero value func returns, or 0.
+ */
+int
+radix_range_prefixes(int family, const u_char *lo, const u_char *hi,
+    rdx_prefix_cb_t func, void *cbctx)
+{
+	static const u_int64_t one[2] = { 0, 1 };
+	prefix_t prefix;
+	u_int64_t cur[2], end[2], n[2];
+	u_char addr[16];
+	u_int len, maxbits, k, tz;
+	int r;
+
+	len = family == AF_INET ? 4 : 16;
+	maxbits = len * 8;
+	addr_to_u128(lo, len, cur);
+	addr_to_u128(hi, len, end);
+	for (;;) {
+		/* The largest k with 2^k <= end - cur + 1 */
+		n[0] = end[0];
+		n[1] = end[1];
+		u128_sub(n, cur);
+		u128_add(n, one);
+		if (n[0] == 0 && n[1] == 0)
+			k = 128;
+		else if (n[0] != 0)
+			k = 64 + u64_bitlen(n[0]) - 1;
+		else
+			k = u64_bitlen(n[1]) - 1;
+		/* ... and 'cur' aligned to 2^k */
+		if (cur[1] != 0)
+			tz = u64_ctz(cur[1]);
+		else if (cur[0] != 0)
+			tz = 64 + u64_ctz(cur[0]);
+		else
+			tz = maxbits;
+		if (k > tz)
+			k = tz;
+		if (k > maxbits)
+			k = maxbits;
+		u128_to_addr(cur, len, addr);
+		if (New_Prefix2(family, addr, maxbits - k, &prefix) == NULL)
+			return (-1);
+		if ((r = func(&prefix, cbctx)) != 0)
+			return (r);
+		if (k == 128)
+			return (0);
+		u128_pow2(n, k);
+		u128_add(cur, n);
+		/* Done when the block ended at 'end', i.e. cur is past it */
+		n[0] = end[0];
+		n[1] = end[1];
+		u128_add(n, one);
+		if (cur[0] == n[0] && cur[1] == n[1])
+			return (0);
+	}
+}
+
+/* Emit the block of length 'bit' + 1 whose first 'bit' bits are 'key's */
+static int
+radix_complement_emit(int family, const u_char *key, u_int bit, int set,
+    rdx_prefix_cb_t func, void *cbctx)
+{
+	prefix_t prefix;
+	u_char addr[16];
+	u_int len;
+
+	len = family == AF_INET ? 4 : 16;
+	memcpy(addr, key, len);
+	sanitise_mask(addr, bit, len * 8);
+	if (set)
+		addr[bit >> 3] |= 0x80 >> (bit & 0x07);
+	if (New_Prefix2(family, addr, bit + 1, &prefix) == NULL)
+		return (-1);
+	return (func(&prefix, cbctx));
+}
+
+/*
+ * Emit the gaps in the block of length 'bitlen' holding the subtree of
+ * 'node': the siblings of the levels the node skips, and below a glue
+ * node those of its children. A node holding a prefix leaves no gaps.
+ */
+static int
+radix_complement_walk(radix_node_t *node, u_int bitlen, rdx_prefix_cb_t func,
+    void *cbctx)
+{
+	prefix_t *key;
+	u_char *addr;
+	u_int i;
+	int r, s;
+
+	key = radix_node_key(node);
+	addr = prefix_touchar(key);
+	/* Siblings before the node, from the largest, then after it */
+	for (i = bitlen; i < node->bit; i++) {
+		if (BIT_TEST(addr[i >> 3], 0x80 >> (i & 0x07)) &&
+		    (r = radix_complement_emit(key->family, addr, i, 0,
+		    func, cbctx)) != 0)
+			return (r);
+	}
+	if (node->prefix == NULL) {
+		for (s = 0; s < 2; s++) {
+			if ((s ? node->r : node->l) == NULL)
+				r = radix_complement_emit(key->family, addr,
+				    node->bit, s, func, cbctx);
+			else
+				r = radix_complement_walk(s ? node->r : node->l,
+				    node->bit + 1, func, cbctx);
+			if (r != 0)
+				return (r);
+		}
+	}
+	for (i = node->bit; i-- > bitlen; ) {
+		if (!BIT_TEST(addr[i >> 3], 0x80 >> (i & 0x07)) &&
+		    (r = radix_complement_emit(key->family, addr, i, 1,
+		    func, cbctx)) != 0)
+			return (r);
+	}
+	return (0);
+}
+
+/*
+ * Call func(prefix, cbctx) for each prefix of the shortest list of
+ * prefixes covering the addresses in 'within' that no prefix in the tree
+ * covers, in ascending order. Takes a single walk of the subtree under
+ * 'within'. Returns the first non-zero value func returns, or 0.
+ */
+int
+radix_complement(radix_tree_t *radix, prefix_t *within, rdx_prefix_cb_t func,
+    void *cbctx)
+{
+	radix_node_t *node;
+	prefix_t block;
+
+	block = *within;
+	sanitise_mask(prefix_touchar(&block), block.bitlen,
+	    RADIX_FAMILY_BITS(&block));
+	if (radix_search_best(radix, &block) != NULL)
+		return (0);
+	if ((node = radix_search_covered(radix, &block)) == NULL)
+		return (func(&block, cbctx));
+	return (radix_complement_walk(node, block.bitlen, func, cbctx));
+}
+
+/*
+ * Count the addresses in 'within', or in the whole address space of the
+ * tree if it is NULL, that prefixes in the tree cover. As there may be
+ * 2^128 of them, the count is 2^(maxbits - *bitlen) less 'uncovered'.
+ * Returns 0 if there are none and 1 otherwise. Takes O(depth).
+ */
+int
+radix_coverage(radix_tree_t *radix, prefix_t *within, u_int *bitlen,
+    u_int64_t *uncovered)
+{
+	radix_node_t *node;
+	prefix_t block;
+
+	uncovered[0] = uncovered[1] = 0;
+	if (within == NULL)
+		node = radix->head;
+	else {
+		block = *within;
+		sanitise_mask(prefix_touchar(&block), block.bitlen,
+		    RADIX_FAMILY_BITS(&block));
+		if (radix_search_best(radix, &block) != NULL) {
+			*bitlen = block.bitlen;
+			return (1);
+		}
+		node = radix_search_covered(radix, &block);
+	}
+	if (node == NULL)
+		return (0);
+	*bitlen = node->bit;
+	if (node->prefix == NULL) {
+		uncovered[0] = node->uncovered[0];
+		uncovered[1] = node->uncovered[1];
+	}
+	return (1);
+}
+
+/* Whether 'm' has a length from 'lo' to 'hi' */
+static int
+radix_free_any(const u_int64_t *m, u_int lo, u_int hi)
+{
+	u_int len;
+
+	for (len = lo; len <= hi; len++) {
+		if (FREE_TEST(m, len))
+			return (1);
+	}
+	return (0);
+}
+
+/* The block of length 'bit' + 1 whose first 'bit' bits are 'key's */
+static void
+radix_free_block(const u_char *key, u_int len, u_int bit, int set,
+    u_char *addr)
+{
+	memcpy(addr, key, len);
+	sanitise_mask(addr, bit, len * 8);
+	if (set)
+		addr[bit >> 3] |= 0x80 >> (bit & 0x07);
+}
+
+static int radix_alloc_inner(radix_node_t *node, u_int lo, u_int hi,
+    u_char *addr, u_int *found);
+
+/*
+ * Find the first maximal free block with a length from 'lo' to 'hi' in
+ * the region of length 'start' holding 'child', in address order.
+ */
+static int
+radix_alloc_side(u_int start, radix_node_t *child, u_int lo, u_int hi,
+    u_char *addr, u_int *found)
+{
+	prefix_t *key;
+	u_char *cp;
+	u_int j, len;
+
+	key = radix_node_key(child);
+	cp = prefix_touchar(key);
+	len = key->family == AF_INET ? 4 : 16;
+	/* Skipped levels whose free sibling comes before the child */
+	for (j = start; j < child->bit; j++) {
+		if (BIT_TEST(cp[j >> 3], 0x80 >> (j & 0x07)) &&
+		    j + 1 >= lo && j + 1 <= hi) {
+			radix_free_block(cp, len, j, 0, addr);
+			*found = j + 1;
+			return (0);
+		}
+	}
+	if (child->prefix == NULL && radix_free_any(child->free, lo, hi))
+		return (radix_alloc_inner(child, lo, hi, addr, found));
+	/* Then those after it, the nearest first */
+	for (j = child->bit; j-- > start; ) {
+		if (!BIT_TEST(cp[j >> 3], 0x80 >> (j & 0x07)) &&
+		    j + 1 >= lo && j + 1 <= hi) {
+			radix_free_block(cp, len, j, 1, addr);
+			*found = j + 1;
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+/* As radix_alloc_side(), below 'node' disregarding its own prefix */
+static int
+radix_alloc_inner(radix_node_t *node, u_int lo, u_int hi, u_char *addr,
+    u_int *found)
+{
+	radix_node_t *child;
+	u_int64_t m[2];
+	prefix_t *key;
+	int s;
+
+	for (s = 0; s < 2; s++) {
+		child = s ? node->r : node->l;
+		m[0] = m[1] = 0;
+		radix_free_side(node->bit + 1, child, m);
+		if (!radix_free_any(m, lo, hi))
+			continue;
+		if (child != NULL)
+			return (radix_alloc_side(node->bit + 1, child, lo, hi,
+			    addr, found));
+		key = radix_node_key(node);
+		radix_free_block(prefix_touchar(key),
+		    key->family == AF_INET ? 4 : 16, node->bit, s, addr);
+		*found = node->bit + 1;
+		return (0);
+	}
+	return (-1);
+}
+
+/*
+ * Find a free block of length 'bitlen' in 'pool': one holding no prefix
+ * and covered by none longer than the pool. It is the first one, or with
+ * 'best_fit' the first one in the smallest maximal free block it fits
+ * in, so that large blocks are kept whole. Takes O(depth) using the free
+ * masks. Stores the block in 'out' and returns 0, or returns -1 if the
+ * pool is full.
+ */
+int
+radix_allocate(radix_tree_t *radix, prefix_t *pool, u_int bitlen,
+    int best_fit, prefix_t *out)
+{
+	radix_node_t *node;
+	prefix_t block;
+	u_int64_t m[2];
+	u_char addr[16];
+	u_int p, lo, hi, found;
+	int r;
+
+	block = *pool;
+	p = block.bitlen;
+	sanitise_mask(prefix_touchar(&block), p, RADIX_FAMILY_BITS(&block));
+	node = radix_search_covered(radix, &block);
+	if (node == NULL) {
+		/*
+		 * The whole pool is free, its first block will do. A pool of
+		 * length 0 has no bit in the masks for it.
+		 */
+		memcpy(addr, prefix_touchar(&block), 16);
+		return (New_Prefix2(block.family, addr, bitlen, out) == NULL ?
+		    -1 : 0);
+	}
+	m[0] = m[1] = 0;
+	if (node->bit == p) {
+		m[0] = node->free[0];
+		m[1] = node->free[1];
+	} else
+		radix_free_side(p, node, m);
+	lo = 1;
+	hi = bitlen;
+	if (best_fit) {
+		for (lo = bitlen; lo >= 1 && !FREE_TEST(m, lo); lo--)
+			;
+		hi = lo;
+	}
+	if (lo == 0 || !radix_free_any(m, lo, hi))
+		return (-1);
+	if (node->bit == p)
+		r = radix_alloc_inner(node, lo, hi, addr, &found);
+	else
+		r = radix_alloc_side(p, node, lo, hi, addr, &found);
+	if (r != 0)
+		return (-1);
+	if (New_Prefix2(block.family, addr, bitlen, out) == NULL)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Merkle hashes. Each node caches a hash over its prefix, the digest of
+ * its payload and the hashes of its children, so that trees holding the
+ * same prefixes and payloads hash the same whatever order they were
+ * built in. A hash of 0 is stale; changes to the tree clear the hashes
+ * on the path to the head, so a stale node only has stale ancestors and
+ * only stale nodes need recomputing.
+ */
+
+/* 64-bit FNV-1a, with a final avalanche so that every bit counts */
+u_int64_t
+radix_hash_bytes(const void *buf, size_t len)
+{
+	const u_char *cp = buf;
+	u_int64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= cp[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h != 0 ? h : 1);
+}
+
+/* Store 'v' little-endian, so that hashes agree between hosts */
+static u_char
+*hash_put64(u_char *cp, u_int64_t v)
+{
+	u_int i;
+
+	for (i = 0; i < 8; i++, v >>= 8)
+		*cp++ = v & 0xff;
+	return (cp);
+}
+
+static int
+radix_hash_node(radix_node_t *node, rdx_hash_cb_t func, void *cbctx)
+{
+	u_char buf[64], *cp;
+	u_int64_t digest;
+	u_int len;
+
+	if (node->hash != 0)
+		return (0);
+	if ((node->l != NULL && radix_hash_node(node->l, func, cbctx) != 0) ||
+	    (node->r != NULL && radix_hash_node(node->r, func, cbctx) != 0))
+		return (-1);
+	cp = buf;
+	if (node->prefix != NULL) {
+		len = node->prefix->family == AF_INET ? 4 : 16;
+		*cp++ = 1;
+		*cp++ = len == 4 ? 4 : 6;
+		*cp++ = node->prefix->bitlen;
+		memcpy(cp, prefix_touchar(node->prefix), len);
+		cp += len;
+		if (func(node, &digest, cbctx) != 0)
+			return (-1);
+		cp = hash_put64(cp, digest);
+	} else
+		*cp++ = 0;
+	cp = hash_put64(cp, node->l != NULL ? node->l->hash : 0);
+	cp = hash_put64(cp, node->r != NULL ? node->r->hash : 0);
+	node->hash = radix_hash_bytes(buf, cp - buf);
+	return (0);
+}
+
+/*
+ * Bring the hashes of the subtree of 'node' (which may be NULL, hashing
+ * to 0) up to date. func(node, &digest, cbctx) supplies the digest of the
+ * payload of each node holding a prefix whose hash is recomputed.
+ */
+int
+radix_hash(radix_node_t *node, rdx_hash_cb_t func, void *cbctx,
+    u_int64_t *hash)
+{
+	*hash = 0;
+	if (node == NULL)
+		return (0);
+	if (radix_hash_node(node, func, cbctx) != 0)
+		return (-1);
+	*hash = node->hash;
+	return (0);
+}
+
+/* Mark the hash of 'node' stale, after a change to its payload */
+void
+radix_hash_invalidate(radix_node_t *node)
+{
+	for (; node != NULL && node->hash != 0; node = node->parent)
+		node->hash = 0;
+}
+
+/* Mark every hash in the tree stale */
+void
+radix_hash_clear(radix_tree_t *radix)
+{
+	radix_node_t *stack[RADIX_MAXBITS + 1], **sp = stack;
+	radix_node_t *node = radix->head;
+
+	while (node != NULL) {
+		node->hash = 0;
+		if (node->l) {
+			if (node->r)
+				*sp++ = node->r;
+			node = node->l;
+		} else if (node->r)
+			node = node->r;
+		else if (sp != stack)
+			node = *(--sp);
+		else
+			node = NULL;
+	}
+}
+
+/*
+ * The subtrees of a node holding a prefix that start with that prefix in
+ * a walk: the node itself and the glue nodes it is leftmost below.
+ */
+static radix_node_t
+*hash_skip_up(radix_node_t *node)
+{
+	radix_node_t *parent = node->parent;
+
+	if (parent == NULL || parent->prefix != NULL || parent->l != node)
+		return (NULL);
+	return (parent);
+}
+
+/*
+ * 'a' and 'b' are nodes of two trees with up to date hashes, holding the
+ * same prefix. Finds the largest subtrees starting at them that cover
+ * the same addresses and hash the same, and so hold the same prefixes and
+ * payloads. If there are any, advances '*a' and '*b' to the nodes after
+ * them in a walk and returns 1; otherwise returns 0.
+ */
+int
+radix_hash_skip(radix_node_t **a, radix_node_t **b)
+{
+	radix_node_t *x = *a, *y = *b, *sx = NULL, *sy = NULL;
+
+	while (x != NULL && y != NULL) {
+		if (x->bit > y->bit)
+			x = hash_skip_up(x);
+		else if (x->bit < y->bit)
+			y = hash_skip_up(y);
+		else {
+			/* Subtrees over a block differ if any sub-block does */
+			if (x->hash == 0 || x->hash != y->hash)
+				break;
+			sx = x;
+			sy = y;
+			x = hash_skip_up(x);
+			y = hash_skip_up(y);
+		}
+	}
+	if (sx == NULL)
+		return (0);
+	*a = radix_skip(sx);
+	*b = radix_skip(sy);
+	return (1);
+}
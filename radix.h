@@ -76,6 +76,7 @@
 typedef unsigned __int8		u_int8_t;
 typedef unsigned __int16	u_int16_t;
 typedef unsigned __int32	u_int32_t;
+typedef unsigned __int64	u_int64_t;
 const char *inet_ntop(int af, const void *src, char *dst, size_t size);
 size_t strlcpy(char *dst, const char *src, size_t size);
 #endif
@@ -94,6 +95,7 @@ typedef struct _prefix_t {
 	} add;
 } prefix_t;
 
+prefix_t *Ref_Prefix(prefix_t *prefix);
 void Deref_Prefix(prefix_t *prefix);
 
 /*
@@ -102,16 +104,29 @@ void Deref_Prefix(prefix_t *prefix);
  */
 typedef struct _radix_node_t {
 	u_int bit;			/* flag if this node used */
+	u_int count;			/* prefixes in this subtree */
 	prefix_t *prefix;		/* who we are in radix tree */
 	struct _radix_node_t *l, *r;	/* left and right children */
 	struct _radix_node_t *parent;	/* may be used */
 	void *data;			/* pointer to data */
+	/*
+	 * Kept in every tree, whether or not it is ever hashed or used by
+	 * the allocator or coverage(). This takes the node from 48 to 88
+	 * bytes on LP64 systems. Hashes are cleared, and the free masks and
+	 * uncovered counts recomputed, on the walk that already updates the
+	 * counts; making them optional would mean a different node size per
+	 * tree.
+	 */
+	u_int64_t hash;			/* subtree hash, 0 if stale */
+	u_int64_t free[2];		/* lengths of free blocks below */
+	u_int64_t uncovered[2];		/* addresses below in no prefix */
 } radix_node_t;
 
 typedef struct _radix_tree_t {
 	radix_node_t *head;
 	u_int maxbits;			/* for IP, 32 bit addresses */
 	int num_active_node;		/* for debug purpose */
+	int num_prefixes;		/* nodes holding a prefix */
 } radix_tree_t;
 
 /* Type of callback function */
@@ -121,10 +136,43 @@ radix_tree_t *New_Radix(void);
 void Destroy_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
 radix_node_t *radix_lookup(radix_tree_t *radix, prefix_t *prefix);
 void radix_remove(radix_tree_t *radix, radix_node_t *node);
+void radix_remove_subtree(radix_tree_t *radix, radix_node_t *node);
+void radix_remove_many(radix_tree_t *radix, radix_node_t **nodes, size_t n);
 radix_node_t *radix_search_exact(radix_tree_t *radix, prefix_t *prefix);
 radix_node_t *radix_search_best(radix_tree_t *radix, prefix_t *prefix);
+radix_node_t *radix_search_containing(radix_tree_t *radix, prefix_t *prefix);
+int radix_search_covering(radix_tree_t *radix, prefix_t *prefix,
+    radix_node_t **nodes);
+radix_node_t *radix_search_worst(radix_tree_t *radix, prefix_t *prefix);
+radix_node_t *radix_search_covered(radix_tree_t *radix, prefix_t *prefix);
+void radix_search_range(radix_tree_t *radix, u_char *start, u_char *end,
+    rdx_cb_t func, void *cbctx);
+prefix_t *radix_node_key(radix_node_t *node);
+radix_node_t *radix_last(radix_tree_t *radix);
+radix_node_t *radix_first(radix_tree_t *radix);
+radix_node_t *radix_next(radix_node_t *node);
+radix_node_t *radix_prev(radix_node_t *node);
+u_int radix_rank(radix_tree_t *radix, prefix_t *prefix);
+radix_node_t *radix_select(radix_tree_t *radix, u_int k);
+radix_node_t *radix_ceiling(radix_tree_t *radix, prefix_t *prefix);
+radix_node_t *radix_ceiling_sorted(radix_tree_t *radix, prefix_t *prefix,
+    radix_node_t **hint);
+radix_node_t *radix_lookup_sorted(radix_tree_t *radix, prefix_t *prefix,
+    radix_node_t **hint);
+int radix_allocate(radix_tree_t *radix, prefix_t *pool, u_int bitlen,
+    int best_fit, prefix_t *out);
 void radix_process(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
 
+/* Type of payload digest callback, return non-zero on error */
+typedef int (*rdx_hash_cb_t)(radix_node_t *, u_int64_t *, void *);
+
+u_int64_t radix_hash_bytes(const void *buf, size_t len);
+int radix_hash(radix_node_t *node, rdx_hash_cb_t func, void *cbctx,
+    u_int64_t *hash);
+void radix_hash_invalidate(radix_node_t *node);
+void radix_hash_clear(radix_tree_t *radix);
+int radix_hash_skip(radix_node_t **a, radix_node_t **b);
+
 #define RADIX_MAXBITS 128
 
 #define RADIX_WALK(Xhead, Xnode) \
@@ -154,8 +202,58 @@ void radix_process(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
 /* Local additions */
 
 prefix_t *prefix_pton(const char *string, long len, const char **errmsg);
+prefix_t *prefix_pton2(const char *string, long len, prefix_t *prefix,
+    const char **errmsg);
 prefix_t *prefix_from_blob(u_char *blob, int len, int prefixlen);
+prefix_t *prefix_from_blob2(u_char *blob, int len, int prefixlen,
+    prefix_t *prefix);
 const char *prefix_addr_ntop(prefix_t *prefix, char *buf, size_t len);
 const char *prefix_ntop(prefix_t *prefix, char *buf, size_t len);
+int prefix_cmp(prefix_t *a, prefix_t *b);
+prefix_t *prefix_supernet(prefix_t *prefix, u_int bitlen, prefix_t *out);
+
+#define PREFIX_PACKED_MAX	18	/* family, masklen, IPv6 address */
+
+size_t prefix_pack(prefix_t *prefix, u_char *buf);
+size_t prefix_unpack(const u_char *buf, size_t len, prefix_t *prefix);
+
+/*
+ * Lists of disjoint address ranges in ascending order. Each range runs
+ * from 'lo' to 'hi' inclusive; addresses are in network byte order and
+ * only the first 'len' bytes are used.
+ */
+typedef struct _radix_range_t {
+	u_char lo[16], hi[16];
+} radix_range_t;
+
+typedef struct _radix_ranges_t {
+	int family;
+	u_int len;
+	size_t n, max;
+	radix_range_t *ranges;
+} radix_ranges_t;
+
+#define RADIX_SET_UNION			1
+#define RADIX_SET_INTERSECTION		2
+#define RADIX_SET_DIFFERENCE		3
+#define RADIX_SET_SYMMETRIC_DIFFERENCE	4
+
+/* Type of prefix callback, return non-zero to stop */
+typedef int (*rdx_prefix_cb_t)(prefix_t *, void *);
+
+void radix_ranges_init(radix_ranges_t *list, int family);
+void radix_ranges_free(radix_ranges_t *list);
+int radix_ranges_append(radix_ranges_t *list, const u_char *lo,
+    const u_char *hi);
+int radix_ranges_append_prefix(radix_ranges_t *list, prefix_t *prefix);
+int radix_ranges_from_tree(radix_ranges_t *list, radix_tree_t *radix);
+int radix_ranges_op(int op, radix_ranges_t *a, radix_ranges_t *b,
+    radix_ranges_t *out);
+int radix_range_prefixes(int family, const u_char *lo, const u_char *hi,
+    rdx_prefix_cb_t func, void *cbctx);
+int radix_complement(radix_tree_t *radix, prefix_t *within,
+    rdx_prefix_cb_t func, void *cbctx);
+int radix_coverage(radix_tree_t *radix, prefix_t *within, u_int *bitlen,
+    u_int64_t *uncovered);
 
 #endif /* _RADIX_H */
@@ -0,0 +1,976 @@
+/*
+ * Copyright (c) 2004 Damien Miller <djm@mindrot.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Python.h"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+# include <io.h>
+# define fsync(fd)	_commit(fd)
+# define fileno(f)	_fileno(f)
+# define ftruncate(fd, len)	_chsize(fd, len)
+#else
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#include "radix_disk.h"
+
+/* $Id$ */
+
+/*
+ * File layout: page 0 holds the file header, every other page starts
+ * with a page header in slot 0 followed by DISK_NODES_PER_PAGE - 1 node
+ * slots. A node index encodes its page and slot, index 0 means "none".
+ * New nodes are placed on the page of the node they hang off when it
+ * has room, so that a descent touches as few pages as possible.
+ */
+#define DISK_MAGIC		"PYRADIXD"
+#define DISK_VERSION		1
+#define DISK_PAGE_SIZE		4096
+#define DISK_NODE_SIZE		40
+#define DISK_NODES_PER_PAGE	(DISK_PAGE_SIZE / DISK_NODE_SIZE)
+#define DISK_GROW_MAX		(64 * 1024 * 1024)
+
+struct disk_header {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t page_size;
+	u_int32_t node_size;
+	u_int32_t npages;		/* pages in use, including this one */
+	u_int32_t head[2];		/* IPv4 and IPv6 tree heads */
+	u_int32_t nprefixes;
+	u_int32_t nnodes;
+	u_int32_t cur_page;		/* page to allocate from by default */
+};
+
+struct disk_page {
+	u_int32_t free_head;		/* first free node slot on this page */
+	u_int32_t nfree;
+	u_int32_t next_unused;		/* slots from here on were never used */
+};
+
+struct disk_node {
+	u_int32_t l, r, parent;
+	u_int8_t bit;
+	u_int8_t has_prefix;
+	u_int8_t pad[2];
+	u_int8_t addr[16];
+	u_int64_t value;
+};
+
+struct _radix_disk_t {
+	int fd;
+	u_char *base;			/* mapping of the whole file */
+	size_t maplen;
+	int corrupt;			/* a bad index was found */
+};
+
+#define BIT_TEST(f, b)		((f) & (b))
+#define DHDR(d)			((struct disk_header *)(d)->base)
+#define DPAGE(d, p)		((struct disk_page *)((d)->base + \
+				    (size_t)(p) * DISK_PAGE_SIZE))
+#define DNODE(d, i)		((struct disk_node *)((d)->base + \
+				    (size_t)((i) / DISK_NODES_PER_PAGE) * \
+				    DISK_PAGE_SIZE + \
+				    ((i) % DISK_NODES_PER_PAGE) * DISK_NODE_SIZE))
+#define DINDEX_OK(d, i)		((i) >= DISK_NODES_PER_PAGE && \
+				    (i) % DISK_NODES_PER_PAGE != 0 && \
+				    (i) / DISK_NODES_PER_PAGE < DHDR(d)->npages)
+#define DFAMILY(prefix)		((prefix)->family == AF_INET6 ? 1 : 0)
+#define DMAXBITS(prefix)	((prefix)->family == AF_INET6 ? 128 : 32)
+#define DADDRLEN(prefix)	((prefix)->family == AF_INET6 ? 16 : 4)
+
+#if defined(_MSC_VER)
+
+radix_disk_t
+*radix_disk_open(const char *path, const char **errmsg)
+{
+	*errmsg = "disk-backed trees are not supported on this platform";
+	return (NULL);
+}
+
+void radix_disk_close(radix_disk_t *disk) {}
+int radix_disk_sync(radix_disk_t *disk) { return (-1); }
+u_int radix_disk_count(radix_disk_t *disk) { return (0); }
+int radix_disk_corrupt(radix_disk_t *disk) { return (0); }
+int radix_disk_add(radix_disk_t *disk, prefix_t *prefix, u_int64_t value)
+    { return (-1); }
+int radix_disk_delete(radix_disk_t *disk, prefix_t *prefix) { return (-1); }
+int radix_disk_search_exact(radix_disk_t *disk, prefix_t *prefix,
+    prefix_t *found, u_int64_t *value) { return (-1); }
+int radix_disk_search_best(radix_disk_t *disk, prefix_t *prefix,
+    prefix_t *found, u_int64_t *value) { return (-1); }
+int radix_disk_process(radix_disk_t *disk, rdx_disk_cb_t func, void *cbctx)
+    { return (-1); }
+
+#else
+
+static int
+disk_map(radix_disk_t *disk, size_t len)
+{
+	void *base;
+
+	/* Keep the old mapping until the new one is known to work */
+	base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, disk->fd, 0);
+	if (base == MAP_FAILED)
+		return (-1);
+#ifdef MADV_RANDOM
+	madvise(base, len, MADV_RANDOM);
+#endif
+	if (disk->base != NULL)
+		munmap(disk->base, disk->maplen);
+	disk->base = base;
+	disk->maplen = len;
+	return (0);
+}
+
+radix_disk_t
+*radix_disk_open(const char *path, const char **errmsg)
+{
+	radix_disk_t *disk;
+	struct disk_header *hdr;
+	struct stat st;
+
+	if ((disk = PyMem_Malloc(sizeof(*disk))) == NULL) {
+		*errmsg = "out of memory";
+		return (NULL);
+	}
+	memset(disk, '\0', sizeof(*disk));
+	if ((disk->fd = open(path, O_RDWR|O_CREAT, 0644)) == -1) {
+		*errmsg = "could not open tree file";
+		goto fail;
+	}
+	if (fstat(disk->fd, &st) == -1) {
+		*errmsg = "could not stat tree file";
+		goto fail;
+	}
+	if (st.st_size == 0) {
+		/* New file: just the header page */
+		if (ftruncate(disk->fd, DISK_PAGE_SIZE) == -1) {
+			*errmsg = "could not extend tree file";
+			goto fail;
+		}
+		if (disk_map(disk, DISK_PAGE_SIZE) == -1) {
+			*errmsg = "could not map tree file";
+			goto fail;
+		}
+		hdr = DHDR(disk);
+		memcpy(hdr->magic, DISK_MAGIC, sizeof(hdr->magic));
+		hdr->version = DISK_VERSION;
+		hdr->page_size = DISK_PAGE_SIZE;
+		hdr->node_size = DISK_NODE_SIZE;
+		hdr->npages = 1;
+		return (disk);
+	}
+	if (st.st_size < DISK_PAGE_SIZE || st.st_size % DISK_PAGE_SIZE != 0) {
+		*errmsg = "not a radix tree file";
+		goto fail;
+	}
+	if (disk_map(disk, st.st_size) == -1) {
+		*errmsg = "could not map tree file";
+		goto fail;
+	}
+	hdr = DHDR(disk);
+	if (memcmp(hdr->magic, DISK_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != DISK_VERSION || hdr->page_size != DISK_PAGE_SIZE ||
+	    hdr->node_size != DISK_NODE_SIZE || hdr->npages == 0 ||
+	    (size_t)hdr->npages * DISK_PAGE_SIZE > disk->maplen ||
+	    (hdr->head[0] != 0 && !DINDEX_OK(disk, hdr->head[0])) ||
+	    (hdr->head[1] != 0 && !DINDEX_OK(disk, hdr->head[1])) ||
+	    hdr->cur_page >= hdr->npages) {
+		*errmsg = "not a radix tree file";
+		goto fail;
+	}
+	return (disk);
+ fail:
+	radix_disk_close(disk);
+	return (NULL);
+}
+
+void
+radix_disk_close(radix_disk_t *disk)
+{
+	if (disk->base != NULL) {
+		/* Drop the unused tail preallocated by disk_new_page() */
+		msync(disk->base, disk->maplen, MS_SYNC);
+		if (ftruncate(disk->fd,
+		    (off_t)DHDR(disk)->npages * DISK_PAGE_SIZE) == -1)
+			; /* harmless, the tail is reused on the next open */
+		munmap(disk->base, disk->maplen);
+	}
+	if (disk->fd != -1)
+		close(disk->fd);
+	PyMem_Free(disk);
+}
+
+int
+radix_disk_sync(radix_disk_t *disk)
+{
+	return (msync(disk->base, disk->maplen, MS_SYNC));
+}
+
+u_int
+radix_disk_count(radix_disk_t *disk)
+{
+	return (DHDR(disk)->nprefixes);
+}
+
+int
+radix_disk_corrupt(radix_disk_t *disk)
+{
+	return (disk->corrupt);
+}
+
+/*
+ * Returns node 'idx' if it is a valid index and the node tests a bit in
+ * [minbit, maxbit]. Bits strictly increase down the tree, so checking
+ * them also stops a corrupt file from sending a walk round in circles.
+ * Otherwise the tree is marked corrupt and NULL is returned.
+ */
+static struct disk_node *
+disk_node(radix_disk_t *disk, u_int32_t idx, int minbit, int maxbit)
+{
+	struct disk_node *n;
+
+	if (DINDEX_OK(disk, idx)) {
+		n = DNODE(disk, idx);
+		if (n->bit >= minbit && n->bit <= maxbit)
+			return (n);
+	}
+	disk->corrupt = 1;
+	return (NULL);
+}
+
+/* Append a page, growing the file and the mapping geometrically */
+static u_int32_t
+disk_new_page(radix_disk_t *disk)
+{
+	struct disk_page *pg;
+	size_t need, len;
+	u_int32_t p;
+
+	p = DHDR(disk)->npages;
+	need = ((size_t)p + 1) * DISK_PAGE_SIZE;
+	if (need > disk->maplen) {
+		len = disk->maplen + (disk->maplen < DISK_GROW_MAX ?
+		    disk->maplen : DISK_GROW_MAX);
+		if (ftruncate(disk->fd, (off_t)len) == -1)
+			return (0);
+		if (disk_map(disk, len) == -1)
+			return (0);
+	}
+	DHDR(disk)->npages++;
+	pg = DPAGE(disk, p);
+	pg->free_head = 0;
+	pg->nfree = DISK_NODES_PER_PAGE - 1;
+	pg->next_unused = 1;
+	return (p);
+}
+
+/*
+ * Allocate a node, preferably on the same page as 'near'. May remap the
+ * file, so callers must not hold node pointers across this call.
+ */
+static u_int32_t
+disk_alloc(radix_disk_t *disk, u_int32_t near)
+{
+	struct disk_header *hdr = DHDR(disk);
+	struct disk_page *pg;
+	u_int32_t p, idx;
+
+	p = near / DISK_NODES_PER_PAGE;
+	if (p == 0 || DPAGE(disk, p)->nfree == 0) {
+		p = hdr->cur_page;
+		if (p == 0 || DPAGE(disk, p)->nfree == 0) {
+			if ((p = disk_new_page(disk)) == 0)
+				return (0);
+			hdr = DHDR(disk);
+			hdr->cur_page = p;
+		}
+	}
+	pg = DPAGE(disk, p);
+	if (pg->free_head != 0) {
+		idx = pg->free_head;
+		if (!DINDEX_OK(disk, idx) || idx / DISK_NODES_PER_PAGE != p)
+			goto corrupt;
+		pg->free_head = DNODE(disk, idx)->l;
+	} else if (pg->next_unused != 0 &&
+	    pg->next_unused < DISK_NODES_PER_PAGE)
+		idx = p * DISK_NODES_PER_PAGE + pg->next_unused++;
+	else
+		goto corrupt;
+	pg->nfree--;
+	hdr->nnodes++;
+	memset(DNODE(disk, idx), '\0', DISK_NODE_SIZE);
+	return (idx);
+ corrupt:
+	disk->corrupt = 1;
+	return (0);
+}
+
+static void
+disk_free(radix_disk_t *disk, u_int32_t idx)
+{
+	struct disk_header *hdr = DHDR(disk);
+	struct disk_page *pg;
+	u_int32_t p;
+
+	p = idx / DISK_NODES_PER_PAGE;
+	pg = DPAGE(disk, p);
+	DNODE(disk, idx)->l = pg->free_head;
+	pg->free_head = idx;
+	pg->nfree++;
+	hdr->nnodes--;
+	if (hdr->cur_page == 0 || DPAGE(disk, hdr->cur_page)->nfree == 0)
+		hdr->cur_page = p;
+}
+
+static void
+disk_set_prefix(radix_disk_t *disk, u_int32_t idx, prefix_t *prefix,
+    u_int64_t value)
+{
+	struct disk_node *node = DNODE(disk, idx);
+
+	memcpy(node->addr, &prefix->add, DADDRLEN(prefix));
+	node->has_prefix = 1;
+	node->value = value;
+	DHDR(disk)->nprefixes++;
+}
+
+/* Replace the link to 'old' in its parent (or the head) with 'new' */
+static void
+disk_relink(radix_disk_t *disk, int fam, u_int32_t parent, u_int32_t old,
+    u_int32_t new)
+{
+	struct disk_node *pn;
+
+	if (parent == 0) {
+		DHDR(disk)->head[fam] = new;
+		return;
+	}
+	pn = DNODE(disk, parent);
+	if (pn->r == old)
+		pn->r = new;
+	else
+		pn->l = new;
+}
+
+/* Same algorithm as radix_lookup(), but on node indices */
+int
+radix_disk_add(radix_disk_t *disk, prefix_t *prefix, u_int64_t value)
+{
+	struct disk_node *n, *pn;
+	u_int32_t node, new_node, parent, glue;
+	u_char *addr, test_addr[16];
+	u_int bitlen, maxbits, check_bit, differ_bit;
+	u_int i, j, r;
+	int fam = DFAMILY(prefix), need_glue;
+
+	addr = (u_char *)&prefix->add;
+	bitlen = prefix->bitlen;
+	maxbits = DMAXBITS(prefix);
+
+	if ((node = DHDR(disk)->head[fam]) == 0) {
+		if ((node = disk_alloc(disk, 0)) == 0)
+			return (-1);
+		DNODE(disk, node)->bit = bitlen;
+		disk_set_prefix(disk, node, prefix, value);
+		DHDR(disk)->head[fam] = node;
+		return (0);
+	}
+
+	if ((n = disk_node(disk, node, 0, maxbits)) == NULL)
+		return (-1);
+	while (n->bit < bitlen || !n->has_prefix) {
+		if (n->bit < maxbits && BIT_TEST(addr[n->bit >> 3],
+		    0x80 >> (n->bit & 0x07))) {
+			if (n->r == 0)
+				break;
+			node = n->r;
+		} else {
+			if (n->l == 0)
+				break;
+			node = n->l;
+		}
+		if ((n = disk_node(disk, node, n->bit + 1, maxbits)) == NULL)
+			return (-1);
+	}
+
+	memcpy(test_addr, n->addr, sizeof(test_addr));
+	check_bit = (n->bit < bitlen) ? n->bit : bitlen;
+	differ_bit = 0;
+	for (i = 0; i * 8 < check_bit; i++) {
+		if ((r = (addr[i] ^ test_addr[i])) == 0) {
+			differ_bit = (i + 1) * 8;
+			continue;
+		}
+		for (j = 0; j < 8; j++) {
+			if (BIT_TEST(r, (0x80 >> j)))
+				break;
+		}
+		differ_bit = i * 8 + j;
+		break;
+	}
+	if (differ_bit > check_bit)
+		differ_bit = check_bit;
+
+	parent = n->parent;
+	while (parent != 0) {
+		if ((pn = disk_node(disk, parent, 0, n->bit - 1)) == NULL)
+			return (-1);
+		if (pn->bit < differ_bit)
+			break;
+		node = parent;
+		n = pn;
+		parent = n->parent;
+	}
+
+	if (differ_bit == bitlen && n->bit == bitlen) {
+		if (n->has_prefix)
+			n->value = value;
+		else
+			disk_set_prefix(disk, node, prefix, value);
+		return (0);
+	}
+
+	/* Allocate everything before changing the tree */
+	need_glue = n->bit != differ_bit && bitlen != differ_bit;
+	glue = 0;
+	if ((new_node = disk_alloc(disk, node)) == 0)
+		return (-1);
+	if (need_glue && (glue = disk_alloc(disk, node)) == 0) {
+		disk_free(disk, new_node);
+		return (-1);
+	}
+	DNODE(disk, new_node)->bit = bitlen;
+	disk_set_prefix(disk, new_node, prefix, value);
+
+	n = DNODE(disk, node);
+	if (n->bit == differ_bit) {
+		DNODE(disk, new_node)->parent = node;
+		if (n->bit < maxbits && BIT_TEST(addr[n->bit >> 3],
+		    0x80 >> (n->bit & 0x07)))
+			n->r = new_node;
+		else
+			n->l = new_node;
+		return (0);
+	}
+	if (bitlen == differ_bit) {
+		if (bitlen < maxbits && BIT_TEST(test_addr[bitlen >> 3],
+		    0x80 >> (bitlen & 0x07)))
+			DNODE(disk, new_node)->r = node;
+		else
+			DNODE(disk, new_node)->l = node;
+		DNODE(disk, new_node)->parent = n->parent;
+		disk_relink(disk, fam, n->parent, node, new_node);
+		DNODE(disk, node)->parent = new_node;
+		return (0);
+	}
+
+	DNODE(disk, glue)->bit = differ_bit;
+	DNODE(disk, glue)->parent = n->parent;
+	if (differ_bit < maxbits && BIT_TEST(addr[differ_bit >> 3],
+	    0x80 >> (differ_bit & 0x07))) {
+		DNODE(disk, glue)->r = new_node;
+		DNODE(disk, glue)->l = node;
+	} else {
+		DNODE(disk, glue)->r = node;
+		DNODE(disk, glue)->l = new_node;
+	}
+	DNODE(disk, new_node)->parent = glue;
+	disk_relink(disk, fam, n->parent, node, glue);
+	DNODE(disk, node)->parent = glue;
+	return (0);
+}
+
+/* Returns 0 if the prefix is not present or the tree is corrupt */
+static u_int32_t
+disk_search_exact(radix_disk_t *disk, prefix_t *prefix)
+{
+	struct disk_node *n;
+	u_int32_t node;
+	u_char *addr;
+	u_int bitlen, maxbits;
+
+	if ((node = DHDR(disk)->head[DFAMILY(prefix)]) == 0)
+		return (0);
+	addr = (u_char *)&prefix->add;
+	bitlen = prefix->bitlen;
+	maxbits = DMAXBITS(prefix);
+	if ((n = disk_node(disk, node, 0, maxbits)) == NULL)
+		return (0);
+	while (n->bit < bitlen) {
+		if (BIT_TEST(addr[n->bit >> 3], 0x80 >> (n->bit & 0x07)))
+			node = n->r;
+		else
+			node = n->l;
+		if (node == 0)
+			return (0);
+		if ((n = disk_node(disk, node, n->bit + 1, maxbits)) == NULL)
+			return (0);
+	}
+	if (n->bit > bitlen || !n->has_prefix)
+		return (0);
+	if (memcmp(n->addr, addr, DADDRLEN(prefix)) != 0)
+		return (0);
+	return (node);
+}
+
+static void
+disk_node_prefix(radix_disk_t *disk, u_int32_t idx, int family,
+    prefix_t *found)
+{
+	struct disk_node *n = DNODE(disk, idx);
+
+	memset(found, '\0', sizeof(*found));
+	found->family = family;
+	found->bitlen = n->bit;
+	memcpy(&found->add, n->addr, family == AF_INET6 ? 16 : 4);
+}
+
+int
+radix_disk_search_exact(radix_disk_t *disk, prefix_t *prefix,
+    prefix_t *found, u_int64_t *value)
+{
+	u_int32_t node;
+
+	if ((node = disk_search_exact(disk, prefix)) == 0)
+		return (disk->corrupt ? -1 : 0);
+	disk_node_prefix(disk, node, prefix->family, found);
+	*value = DNODE(disk, node)->value;
+	return (1);
+}
+
+/* Same as radix_search_best2(), inclusive */
+int
+radix_disk_search_best(radix_disk_t *disk, prefix_t *prefix,
+    prefix_t *found, u_int64_t *value)
+{
+	struct disk_node *n;
+	u_int32_t node, stack[RADIX_MAXBITS + 1];
+	u_char *addr;
+	u_int bitlen, maxbits, mask, nbytes;
+	int cnt = 0, minbit = 0;
+
+	if ((node = DHDR(disk)->head[DFAMILY(prefix)]) == 0)
+		return (0);
+	addr = (u_char *)&prefix->add;
+	bitlen = prefix->bitlen;
+	maxbits = DMAXBITS(prefix);
+	while (node != 0) {
+		if ((n = disk_node(disk, node, minbit, maxbits)) == NULL)
+			return (-1);
+		minbit = n->bit + 1;
+		if (n->bit > bitlen)
+			break;
+		if (n->has_prefix)
+			stack[cnt++] = node;
+		if (n->bit == bitlen)
+			break;
+		if (BIT_TEST(addr[n->bit >> 3], 0x80 >> (n->bit & 0x07)))
+			node = n->r;
+		else
+			node = n->l;
+	}
+	while (--cnt >= 0) {
+		n = DNODE(disk, stack[cnt]);
+		nbytes = n->bit / 8;
+		if (memcmp(n->addr, addr, nbytes) != 0)
+			continue;
+		mask = (n->bit % 8) ? (0xff << (8 - n->bit % 8)) & 0xff : 0;
+		if (mask && ((n->addr[nbytes] ^ addr[nbytes]) & mask) != 0)
+			continue;
+		disk_node_prefix(disk, stack[cnt], prefix->family, found);
+		*value = n->value;
+		return (1);
+	}
+	return (0);
+}
+
+/* Same as radix_remove(), returns 0 if the prefix is not present */
+int
+radix_disk_delete(radix_disk_t *disk, prefix_t *prefix)
+{
+	struct disk_node *n, *pn = NULL;
+	u_int32_t node, parent, child;
+	u_int maxbits = DMAXBITS(prefix);
+	int fam = DFAMILY(prefix);
+
+	if ((node = disk_search_exact(disk, prefix)) == 0)
+		return (disk->corrupt ? -1 : 0);
+	n = DNODE(disk, node);
+
+	/* Check every node that is relinked before changing any */
+	if (n->parent != 0 &&
+	    (pn = disk_node(disk, n->parent, 0, n->bit - 1)) == NULL)
+		return (-1);
+	if ((n->l != 0 && disk_node(disk, n->l, n->bit + 1, maxbits) == NULL) ||
+	    (n->r != 0 && disk_node(disk, n->r, n->bit + 1, maxbits) == NULL))
+		return (-1);
+	if (n->r == 0 && n->l == 0 && pn != NULL && !pn->has_prefix) {
+		child = pn->r == node ? pn->l : pn->r;
+		if (disk_node(disk, child, pn->bit + 1, maxbits) == NULL ||
+		    (pn->parent != 0 &&
+		    disk_node(disk, pn->parent, 0, pn->bit - 1) == NULL))
+			return (-1);
+	}
+	DHDR(disk)->nprefixes--;
+
+	if (n->r && n->l) {
+		n->has_prefix = 0;
+		n->value = 0;
+		return (1);
+	}
+	if (n->r == 0 && n->l == 0) {
+		parent = n->parent;
+		disk_free(disk, node);
+		if (parent == 0) {
+			DHDR(disk)->head[fam] = 0;
+			return (1);
+		}
+		pn = DNODE(disk, parent);
+		if (pn->r == node) {
+			pn->r = 0;
+			child = pn->l;
+		} else {
+			pn->l = 0;
+			child = pn->r;
+		}
+		if (pn->has_prefix)
+			return (1);
+
+		/* we need to remove parent too */
+		disk_relink(disk, fam, pn->parent, parent, child);
+		DNODE(disk, child)->parent = pn->parent;
+		disk_free(disk, parent);
+		return (1);
+	}
+	child = n->r ? n->r : n->l;
+	parent = n->parent;
+	DNODE(disk, child)->parent = parent;
+	disk_free(disk, node);
+	disk_relink(disk, fam, parent, node, child);
+	return (1);
+}
+
+int
+radix_disk_process(radix_disk_t *disk, rdx_disk_cb_t func, void *cbctx)
+{
+	struct disk_node *n;
+	u_int32_t stack[RADIX_MAXBITS + 1], *sp, node;
+	prefix_t prefix;
+	u_int maxbits;
+	int fam, r;
+
+	for (fam = 0; fam < 2; fam++) {
+		sp = stack;
+		maxbits = fam ? 128 : 32;
+		node = DHDR(disk)->head[fam];
+		if (node != 0 && disk_node(disk, node, 0, maxbits) == NULL)
+			return (-1);
+		while (node != 0) {
+			n = DNODE(disk, node);
+			if (n->has_prefix) {
+				disk_node_prefix(disk, node,
+				    fam ? AF_INET6 : AF_INET, &prefix);
+				if ((r = func(&prefix, n->value, cbctx)) != 0)
+					return (r);
+				/* The callback may not modify the tree */
+				n = DNODE(disk, node);
+			}
+			if (n->l != 0 &&
+			    disk_node(disk, n->l, n->bit + 1, maxbits) == NULL)
+				return (-1);
+			if (n->r != 0 &&
+			    disk_node(disk, n->r, n->bit + 1, maxbits) == NULL)
+				return (-1);
+			if (n->l) {
+				if (n->r)
+					*sp++ = n->r;
+				node = n->l;
+			} else if (n->r)
+				node = n->r;
+			else if (sp != stack)
+				node = *(--sp);
+			else
+				node = 0;
+		}
+	}
+	return (0);
+}
+
+#endif /* _MSC_VER */
+
+/*
+ * Journal file: an 8 byte magic followed by records of one opcode byte
+ * and a prefix_pack()ed prefix. Offsets are from the start of the file.
+ * A truncated record at the end (from a crash during a write) is ignored
+ * by replay and cut off when the journal is reopened; any other invalid
+ * record is an error. Once a write fails the journal is marked failed: the
+ * buffered records are dropped and no more are accepted, since the file
+ * may now end in a partial batch.
+ */
+#define JOURNAL_MAGIC		"PYRADIXJ"
+#define JOURNAL_MAGIC_LEN	8
+#define JOURNAL_RECORD_MAX	(1 + PREFIX_PACKED_MAX)
+
+struct _radix_journal_t {
+	FILE *f;
+	u_char *buf;
+	size_t buflen;			/* bytes buffered */
+	int nbuffered;
+	int batch;
+	int failed;			/* a write failed */
+	long offset;			/* offset of the end of buf */
+};
+
+/*
+ * Returns the length of the record at 'buf', 0 if the 'len' bytes there
+ * are only the start of one or -1 if it is invalid.
+ */
+static int
+journal_record_len(const u_char *buf, size_t len)
+{
+	u_int maxbits;
+
+	if (len < 1)
+		return (0);
+	if (buf[0] != RADIX_JOURNAL_ADD && buf[0] != RADIX_JOURNAL_DELETE)
+		return (-1);
+	if (len < 2)
+		return (0);
+	if (buf[1] == 4)
+		maxbits = 32;
+	else if (buf[1] == 6)
+		maxbits = 128;
+	else
+		return (-1);
+	if (len < 3)
+		return (0);
+	if (buf[2] > maxbits)
+		return (-1);
+	if (len < 3 + maxbits / 8)
+		return (0);
+	return (3 + maxbits / 8);
+}
+
+/*
+ * Read records from the current position of 'f' to the end of the file,
+ * passing each to 'func' if it is not NULL and advancing '*end' past it.
+ */
+static int
+journal_scan(FILE *f, rdx_journal_cb_t func, void *cbctx, long *end,
+    const char **errmsg)
+{
+	u_char buf[65536], *cp;
+	size_t have = 0, n;
+	prefix_t prefix;
+	int len, r;
+
+	for (;;) {
+		n = fread(buf + have, 1, sizeof(buf) - have, f);
+		if (n == 0 && ferror(f)) {
+			*errmsg = "could not read journal file";
+			return (-1);
+		}
+		have += n;
+		cp = buf;
+		while ((len = journal_record_len(cp, have)) > 0) {
+			if (func != NULL) {
+				prefix_unpack(cp + 1, len - 1, &prefix);
+				if ((r = func(cp[0], &prefix, cbctx)) != 0) {
+					*errmsg = NULL;
+					return (r);
+				}
+			}
+			cp += len;
+			have -= len;
+			*end += len;
+		}
+		if (len < 0) {
+			*errmsg = "corrupt journal record";
+			return (-1);
+		}
+		if (n == 0)
+			return (0);	/* truncated final record, if any */
+		memmove(buf, cp, have);
+	}
+}
+
+radix_journal_t
+*radix_journal_open(const char *path, int batch, const char **errmsg)
+{
+	radix_journal_t *journal;
+	char magic[JOURNAL_MAGIC_LEN];
+	long size;
+
+	if (batch < 1)
+		batch = 1;
+	if ((journal = PyMem_Malloc(sizeof(*journal))) == NULL) {
+		*errmsg = "out of memory";
+		return (NULL);
+	}
+	memset(journal, '\0', sizeof(*journal));
+	journal->batch = batch;
+	if ((journal->buf = PyMem_Malloc(batch * JOURNAL_RECORD_MAX)) == NULL) {
+		*errmsg = "out of memory";
+		goto fail;
+	}
+	if ((journal->f = fopen(path, "ab+")) == NULL) {
+		*errmsg = "could not open journal file";
+		goto fail;
+	}
+	fseek(journal->f, 0, SEEK_END);
+	if ((size = ftell(journal->f)) == 0) {
+		if (fwrite(JOURNAL_MAGIC, JOURNAL_MAGIC_LEN, 1,
+		    journal->f) != 1 || fflush(journal->f) != 0) {
+			*errmsg = "could not write journal file";
+			goto fail;
+		}
+		journal->offset = JOURNAL_MAGIC_LEN;
+	} else {
+		fseek(journal->f, 0, SEEK_SET);
+		if (fread(magic, sizeof(magic), 1, journal->f) != 1 ||
+		    memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0) {
+			*errmsg = "not a radix journal file";
+			goto fail;
+		}
+		journal->offset = JOURNAL_MAGIC_LEN;
+		if (journal_scan(journal->f, NULL, NULL, &journal->offset,
+		    errmsg) != 0)
+			goto fail;
+		/* New records must not follow one torn by a crash */
+		if (journal->offset < size &&
+		    ftruncate(fileno(journal->f), journal->offset) != 0) {
+			*errmsg = "could not truncate journal file";
+			goto fail;
+		}
+		fseek(journal->f, 0, SEEK_END);
+	}
+	return (journal);
+ fail:
+	if (journal->f != NULL)
+		fclose(journal->f);
+	PyMem_Free(journal->buf);
+	PyMem_Free(journal);
+	return (NULL);
+}
+
+int
+radix_journal_sync(radix_journal_t *journal)
+{
+	if (journal->failed) {
+		errno = EIO;
+		return (-1);
+	}
+	if (journal->buflen > 0) {
+		if (fwrite(journal->buf, journal->buflen, 1, journal->f) != 1)
+			goto fail;
+		journal->buflen = 0;
+		journal->nbuffered = 0;
+	}
+	if (fflush(journal->f) != 0 || fsync(fileno(journal->f)) != 0)
+		goto fail;
+	return (0);
+ fail:
+	journal->failed = 1;
+	journal->buflen = 0;
+	journal->nbuffered = 0;
+	return (-1);
+}
+
+int
+radix_journal_append(radix_journal_t *journal, int op, prefix_t *prefix)
+{
+	u_char *cp;
+	size_t len;
+
+	if (journal->failed) {
+		errno = EIO;
+		return (-1);
+	}
+	if (journal->buflen + JOURNAL_RECORD_MAX >
+	    (size_t)journal->batch * JOURNAL_RECORD_MAX &&
+	    radix_journal_sync(journal) != 0)
+		return (-1);
+	cp = journal->buf + journal->buflen;
+	cp[0] = op;
+	len = 1 + prefix_pack(prefix, cp + 1);
+	journal->buflen += len;
+	journal->offset += len;
+	if (++journal->nbuffered >= journal->batch)
+		return (radix_journal_sync(journal));
+	return (0);
+}
+
+long
+radix_journal_offset(radix_journal_t *journal)
+{
+	return (journal->offset);
+}
+
+int
+radix_journal_close(radix_journal_t *journal)
+{
+	int r;
+
+	r = radix_journal_sync(journal);
+	if (fclose(journal->f) != 0)
+		r = -1;
+	PyMem_Free(journal->buf);
+	PyMem_Free(journal);
+	return (r);
+}
+
+int
+radix_journal_replay(const char *path, long offset, rdx_journal_cb_t func,
+    void *cbctx, long *end, const char **errmsg)
+{
+	FILE *f;
+	char magic[JOURNAL_MAGIC_LEN];
+	int r;
+
+	*end = offset;
+	if ((f = fopen(path, "rb")) == NULL) {
+		*errmsg = "could not open journal file";
+		return (-1);
+	}
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0) {
+		*errmsg = "not a radix journal file";
+		fclose(f);
+		return (-1);
+	}
+	if (offset < JOURNAL_MAGIC_LEN)
+		offset = JOURNAL_MAGIC_LEN;
+	if (fseek(f, offset, SEEK_SET) != 0) {
+		*errmsg = "could not seek in journal file";
+		fclose(f);
+		return (-1);
+	}
+	*end = offset;
+	r = journal_scan(f, func, cbctx, end, errmsg);
+	fclose(f);
+	return (r);
+}
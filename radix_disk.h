@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2004 Damien Miller <djm@mindrot.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* $Id$ */
+
+#ifndef _RADIX_DISK_H
+#define _RADIX_DISK_H
+
+#include "radix.h"
+
+/*
+ * Disk-backed radix tree. Nodes live in fixed-size pages of a file that
+ * is mapped into memory, so only the pages touched by lookups need to be
+ * resident. Nodes refer to each other by index rather than by pointer.
+ * Each prefix carries a 64-bit value instead of a Python object.
+ * Functions return -1 on failure; if the file turned out to hold bad
+ * node indices radix_disk_corrupt() is then true, otherwise see errno.
+ */
+typedef struct _radix_disk_t radix_disk_t;
+
+/* Type of walk callback, return non-zero to stop the walk */
+typedef int (*rdx_disk_cb_t)(prefix_t *, u_int64_t, void *);
+
+radix_disk_t *radix_disk_open(const char *path, const char **errmsg);
+void radix_disk_close(radix_disk_t *disk);
+int radix_disk_sync(radix_disk_t *disk);
+u_int radix_disk_count(radix_disk_t *disk);
+int radix_disk_corrupt(radix_disk_t *disk);
+int radix_disk_add(radix_disk_t *disk, prefix_t *prefix, u_int64_t value);
+int radix_disk_delete(radix_disk_t *disk, prefix_t *prefix);
+int radix_disk_search_exact(radix_disk_t *disk, prefix_t *prefix,
+    prefix_t *found, u_int64_t *value);
+int radix_disk_search_best(radix_disk_t *disk, prefix_t *prefix,
+    prefix_t *found, u_int64_t *value);
+int radix_disk_process(radix_disk_t *disk, rdx_disk_cb_t func, void *cbctx);
+
+/*
+ * Append-only journal of tree modifications. Records are buffered and
+ * written out 'batch' at a time with a single write and fsync (group
+ * commit), or on radix_journal_sync().
+ */
+typedef struct _radix_journal_t radix_journal_t;
+
+#define RADIX_JOURNAL_ADD	1
+#define RADIX_JOURNAL_DELETE	2
+
+/* Type of replay callback, return non-zero to stop the replay */
+typedef int (*rdx_journal_cb_t)(int, prefix_t *, void *);
+
+radix_journal_t *radix_journal_open(const char *path, int batch,
+    const char **errmsg);
+int radix_journal_append(radix_journal_t *journal, int op, prefix_t *prefix);
+int radix_journal_sync(radix_journal_t *journal);
+long radix_journal_offset(radix_journal_t *journal);
+int radix_journal_close(radix_journal_t *journal);
+int radix_journal_replay(const char *path, long offset,
+    rdx_journal_cb_t func, void *cbctx, long *end, const char **errmsg);
+
+#endif /* _RADIX_DISK_H */
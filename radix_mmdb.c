@@ -0,0 +1,1084 @@
+/*
+ * Copyright (c) 2004 Damien Miller <djm@mindrot.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include "Python.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(_MSC_VER)
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#include "radix_mmdb.h"
+
+/* $Id$ */
+
+/*
+ * See https://maxmind.github.io/MaxMind-DB/ for the format. The file is
+ * a binary search tree of node_count nodes, each holding two records of
+ * record_size bits, followed by 16 zero bytes, the data section and the
+ * metadata (a map) after a marker. A record is either the number of the
+ * next node, node_count for "no data" or node_count + 16 + the offset of
+ * a value in the data section.
+ */
+#define MMDB_MARKER		"\xab\xcd\xefMaxMind.com"
+#define MMDB_MARKER_LEN		14
+#define MMDB_META_MAX		(128 * 1024)
+#define MMDB_MAX_DEPTH		512	/* of nested maps and arrays */
+
+/* Python 2 str is written as a string, like unicode */
+#if PY_MAJOR_VERSION >= 3
+# define MMDB_TEXT_CHECK(o)	PyUnicode_Check(o)
+#else
+# define MMDB_TEXT_CHECK(o)	(PyUnicode_Check(o) || PyString_Check(o))
+#endif
+
+#define MMDB_T_EXTENDED		0
+#define MMDB_T_POINTER		1
+#define MMDB_T_STRING		2
+#define MMDB_T_DOUBLE		3
+#define MMDB_T_BYTES		4
+#define MMDB_T_UINT16		5
+#define MMDB_T_UINT32		6
+#define MMDB_T_MAP		7
+#define MMDB_T_INT32		8
+#define MMDB_T_UINT64		9
+#define MMDB_T_UINT128		10
+#define MMDB_T_ARRAY		11
+#define MMDB_T_CONTAINER	12
+#define MMDB_T_END		13
+#define MMDB_T_BOOLEAN		14
+#define MMDB_T_FLOAT		15
+
+/* ------------------------------------------------------------------------ */
+
+/* Writer */
+
+struct mmdb_buf {
+	u_char *p;
+	size_t len, size;
+};
+
+static int
+buf_put(struct mmdb_buf *b, const void *data, size_t n)
+{
+	u_char *p;
+	size_t size;
+
+	if (b->len + n > b->size) {
+		size = b->size ? b->size : 4096;
+		while (size < b->len + n)
+			size *= 2;
+		if ((p = PyMem_Realloc(b->p, size)) == NULL) {
+			PyErr_NoMemory();
+			return (-1);
+		}
+		b->p = p;
+		b->size = size;
+	}
+	memcpy(b->p + b->len, data, n);
+	b->len += n;
+	return (0);
+}
+
+static int
+put_ctrl(struct mmdb_buf *b, int type, size_t size)
+{
+	u_char c[5];
+	size_t n = 1;
+
+	if (size >= 65821 + (1 << 24)) {
+		PyErr_SetString(PyExc_ValueError,
+		    "value too large for a MaxMind DB");
+		return (-1);
+	}
+	c[0] = (type > 7 ? 0 : type) << 5;
+	if (type > 7)
+		c[n++] = type - 7;
+	if (size < 29)
+		c[0] |= size;
+	else if (size < 285) {
+		c[0] |= 29;
+		c[n++] = size - 29;
+	} else if (size < 65821) {
+		c[0] |= 30;
+		size -= 285;
+		c[n++] = size >> 8;
+		c[n++] = size;
+	} else {
+		c[0] |= 31;
+		size -= 65821;
+		c[n++] = size >> 16;
+		c[n++] = size >> 8;
+		c[n++] = size;
+	}
+	return (buf_put(b, c, n));
+}
+
+/* Unsigned integers are stored big-endian without leading zero bytes */
+static int
+put_uint(struct mmdb_buf *b, int type, u_int64_t hi, u_int64_t lo)
+{
+	u_char v[16];
+	int i, skip;
+
+	for (i = 0; i < 8; i++) {
+		v[i] = hi >> (56 - 8 * i);
+		v[i + 8] = lo >> (56 - 8 * i);
+	}
+	for (skip = 0; skip < 16 && v[skip] == 0; skip++)
+		;
+	if (put_ctrl(b, type, 16 - skip) != 0)
+		return (-1);
+	return (buf_put(b, v + skip, 16 - skip));
+}
+
+static int
+put_string(struct mmdb_buf *b, int type, const char *s, size_t len)
+{
+	if (put_ctrl(b, type, len) != 0)
+		return (-1);
+	return (buf_put(b, s, len));
+}
+
+static int
+put_long(struct mmdb_buf *b, PyObject *o)
+{
+	PyObject *shift, *hi_obj;
+	unsigned PY_LONG_LONG hi, lo;
+	PY_LONG_LONG v;
+	u_char c[4];
+	int overflow;
+
+	v = PyLong_AsLongLongAndOverflow(o, &overflow);
+	if (v == -1 && PyErr_Occurred())
+		return (-1);
+	if (overflow == 0 && v < 0) {
+		if (v < -2147483647LL - 1) {
+			PyErr_SetString(PyExc_OverflowError, "negative integer "
+			    "too small for a MaxMind DB int32");
+			return (-1);
+		}
+		c[0] = (u_int32_t)v >> 24;
+		c[1] = (u_int32_t)v >> 16;
+		c[2] = (u_int32_t)v >> 8;
+		c[3] = (u_int32_t)v;
+		if (put_ctrl(b, MMDB_T_INT32, 4) != 0)
+			return (-1);
+		return (buf_put(b, c, 4));
+	}
+	if (overflow == 0) {
+		return (put_uint(b, v <= 0xffffffffLL ? MMDB_T_UINT32 :
+		    MMDB_T_UINT64, 0, v));
+	}
+	if (overflow < 0) {
+		PyErr_SetString(PyExc_OverflowError, "negative integer "
+		    "too small for a MaxMind DB int32");
+		return (-1);
+	}
+	lo = PyLong_AsUnsignedLongLongMask(o);
+	if ((shift = PyLong_FromLong(64)) == NULL)
+		return (-1);
+	hi_obj = PyNumber_Rshift(o, shift);
+	Py_DECREF(shift);
+	if (hi_obj == NULL)
+		return (-1);
+	hi = PyLong_AsUnsignedLongLong(hi_obj);
+	Py_DECREF(hi_obj);
+	if (hi == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred())
+		return (-1);
+	return (put_uint(b, hi ? MMDB_T_UINT128 : MMDB_T_UINT64, hi, lo));
+}
+
+static int
+put_double(struct mmdb_buf *b, double d)
+{
+	u_int64_t v;
+	u_char c[8];
+	int i;
+
+	memcpy(&v, &d, sizeof(v));
+	for (i = 0; i < 8; i++)
+		c[i] = v >> (56 - 8 * i);
+	if (put_ctrl(b, MMDB_T_DOUBLE, 8) != 0)
+		return (-1);
+	return (buf_put(b, c, 8));
+}
+
+static int
+put_text(struct mmdb_buf *b, PyObject *o)
+{
+#if PY_MAJOR_VERSION >= 3
+	Py_ssize_t len;
+	const char *s;
+
+	if ((s = PyUnicode_AsUTF8AndSize(o, &len)) == NULL)
+		return (-1);
+	return (put_string(b, MMDB_T_STRING, s, len));
+#else
+	PyObject *utf8;
+	int r;
+
+	if (PyString_Check(o)) {
+		return (put_string(b, MMDB_T_STRING, PyString_AS_STRING(o),
+		    PyString_GET_SIZE(o)));
+	}
+	if ((utf8 = PyUnicode_AsUTF8String(o)) == NULL)
+		return (-1);
+	r = put_string(b, MMDB_T_STRING, PyString_AS_STRING(utf8),
+	    PyString_GET_SIZE(utf8));
+	Py_DECREF(utf8);
+	return (r);
+#endif
+}
+
+static int
+put_object(struct mmdb_buf *b, PyObject *o, int depth)
+{
+	PyObject *key, *value;
+	Py_ssize_t pos, len, i;
+
+	if (depth > MMDB_MAX_DEPTH) {
+		PyErr_SetString(PyExc_ValueError, "data nested too deeply");
+		return (-1);
+	}
+	if (PyBool_Check(o))
+		return (put_ctrl(b, MMDB_T_BOOLEAN, o == Py_True));
+	if (PyLong_Check(o)
+#if PY_MAJOR_VERSION < 3
+	    || PyInt_Check(o)
+#endif
+	    )
+		return (put_long(b, o));
+	if (PyFloat_Check(o))
+		return (put_double(b, PyFloat_AS_DOUBLE(o)));
+	if (MMDB_TEXT_CHECK(o))
+		return (put_text(b, o));
+	if (PyBytes_Check(o)) {
+		return (put_string(b, MMDB_T_BYTES, PyBytes_AS_STRING(o),
+		    PyBytes_GET_SIZE(o)));
+	}
+	if (PyDict_Check(o)) {
+		if (put_ctrl(b, MMDB_T_MAP, PyDict_Size(o)) != 0)
+			return (-1);
+		pos = 0;
+		while (PyDict_Next(o, &pos, &key, &value)) {
+			if (!MMDB_TEXT_CHECK(key)) {
+				PyErr_SetString(PyExc_TypeError,
+				    "MaxMind DB map keys must be strings");
+				return (-1);
+			}
+			if (put_object(b, key, depth + 1) != 0 ||
+			    put_object(b, value, depth + 1) != 0)
+				return (-1);
+		}
+		return (0);
+	}
+	if (PyList_Check(o) || PyTuple_Check(o)) {
+		len = PySequence_Fast_GET_SIZE(o);
+		if (put_ctrl(b, MMDB_T_ARRAY, len) != 0)
+			return (-1);
+		for (i = 0; i < len; i++) {
+			if (put_object(b, PySequence_Fast_GET_ITEM(o, i),
+			    depth + 1) != 0)
+				return (-1);
+		}
+		return (0);
+	}
+	PyErr_Format(PyExc_TypeError, "cannot store %.200s in a MaxMind DB",
+	    Py_TYPE(o)->tp_name);
+	return (-1);
+}
+
+/*
+ * While the tree is built, records are tagged values: node numbers (in
+ * order of creation, so children come before their parents), REC_NONE
+ * or REC_DATA | data offset. They are converted to file records once the
+ * node count is known.
+ */
+#define REC_NONE	((u_int64_t)1 << 62)
+#define REC_DATA	((u_int64_t)1 << 61)
+#define REC_ERROR	((u_int64_t)-1)
+
+struct mmdb_writer {
+	struct mmdb_buf data;		/* data section */
+	struct mmdb_buf rec;		/* scratch for one serialised value */
+	PyObject *dedup;		/* serialised value -> offset */
+	u_int64_t *nodes;		/* pairs of tagged records */
+	size_t nnodes, size;
+	u_int maxbits;
+};
+
+static u_int64_t
+data_record(struct mmdb_writer *w, PyObject *payload)
+{
+	PyObject *key, *off;
+	u_int64_t ret;
+	int r;
+
+	w->rec.len = 0;
+	if (payload == Py_None)
+		r = put_ctrl(&w->rec, MMDB_T_MAP, 0);
+	else
+		r = put_object(&w->rec, payload, 0);
+	if (r != 0)
+		return (REC_ERROR);
+
+	/* Identical values are stored once */
+	key = PyBytes_FromStringAndSize((char *)w->rec.p, w->rec.len);
+	if (key == NULL)
+		return (REC_ERROR);
+	if ((off = PyDict_GetItem(w->dedup, key)) != NULL) {
+		Py_DECREF(key);
+		return (REC_DATA | PyLong_AsUnsignedLongLong(off));
+	}
+	ret = REC_DATA | w->data.len;
+	if (buf_put(&w->data, w->rec.p, w->rec.len) != 0 ||
+	    (off = PyLong_FromSize_t(w->data.len - w->rec.len)) == NULL) {
+		Py_DECREF(key);
+		return (REC_ERROR);
+	}
+	r = PyDict_SetItem(w->dedup, key, off);
+	Py_DECREF(key);
+	Py_DECREF(off);
+	return (r == 0 ? ret : REC_ERROR);
+}
+
+static u_int64_t
+new_node(struct mmdb_writer *w, u_int64_t l, u_int64_t r)
+{
+	u_int64_t *nodes;
+	size_t size;
+
+	if (w->nnodes == w->size) {
+		size = w->size ? w->size * 2 : 1024;
+		nodes = PyMem_Realloc(w->nodes, size * 2 * sizeof(*nodes));
+		if (nodes == NULL) {
+			PyErr_NoMemory();
+			return (REC_ERROR);
+		}
+		w->nodes = nodes;
+		w->size = size;
+	}
+	w->nodes[w->nnodes * 2] = l;
+	w->nodes[w->nnodes * 2 + 1] = r;
+	return (w->nnodes++);
+}
+
+static int
+key_bit(radix_node_t *rn, u_int bit)
+{
+	u_char *addr = (u_char *)&radix_node_key(rn)->add;
+
+	return ((addr[bit >> 3] >> (7 - (bit & 7))) & 1);
+}
+
+/*
+ * Returns the record for the subtree at 'depth' whose first radix node
+ * is 'rn'. Addresses not covered by a prefix below get 'inherit', the
+ * data of the closest enclosing prefix. Subtrees whose two halves get
+ * the same record are folded into that record.
+ */
+static u_int64_t
+gen_tree(struct mmdb_writer *w, radix_node_t *rn, u_int depth,
+    u_int64_t inherit)
+{
+	u_int64_t l, r, sub;
+
+	if (rn == NULL)
+		return (inherit);
+	if (rn->bit == depth) {
+		if (rn->prefix != NULL && rn->data == NULL)
+			inherit = REC_NONE;
+		else if (rn->prefix != NULL &&
+		    (inherit = data_record(w, rn->data)) == REC_ERROR)
+			return (REC_ERROR);
+		if (depth >= w->maxbits)
+			return (inherit);
+		if ((l = gen_tree(w, rn->l, depth + 1, inherit)) == REC_ERROR ||
+		    (r = gen_tree(w, rn->r, depth + 1, inherit)) == REC_ERROR)
+			return (REC_ERROR);
+	} else {
+		if ((sub = gen_tree(w, rn, depth + 1, inherit)) == REC_ERROR)
+			return (REC_ERROR);
+		if (key_bit(rn, depth)) {
+			l = inherit;
+			r = sub;
+		} else {
+			l = sub;
+			r = inherit;
+		}
+	}
+	/* Node numbers are unique, so this only folds equal leaves */
+	if (l == r)
+		return (l);
+	return (new_node(w, l, r));
+}
+
+static int
+put_meta_key(struct mmdb_buf *b, const char *key)
+{
+	return (put_string(b, MMDB_T_STRING, key, strlen(key)));
+}
+
+static int
+put_metadata(struct mmdb_buf *b, PyObject *metadata, size_t node_count,
+    u_int record_size, int ip_version)
+{
+	PyObject *key, *value;
+	Py_ssize_t pos = 0;
+
+	if (put_ctrl(b, MMDB_T_MAP, 6 + PyDict_Size(metadata)) != 0 ||
+	    put_meta_key(b, "node_count") != 0 ||
+	    put_uint(b, MMDB_T_UINT32, 0, node_count) != 0 ||
+	    put_meta_key(b, "record_size") != 0 ||
+	    put_uint(b, MMDB_T_UINT16, 0, record_size) != 0 ||
+	    put_meta_key(b, "ip_version") != 0 ||
+	    put_uint(b, MMDB_T_UINT16, 0, ip_version) != 0 ||
+	    put_meta_key(b, "binary_format_major_version") != 0 ||
+	    put_uint(b, MMDB_T_UINT16, 0, 2) != 0 ||
+	    put_meta_key(b, "binary_format_minor_version") != 0 ||
+	    put_uint(b, MMDB_T_UINT16, 0, 0) != 0 ||
+	    put_meta_key(b, "build_epoch") != 0 ||
+	    put_uint(b, MMDB_T_UINT64, 0, (u_int64_t)time(NULL)) != 0)
+		return (-1);
+	while (PyDict_Next(metadata, &pos, &key, &value)) {
+		if (put_object(b, key, 0) != 0 || put_object(b, value, 0) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+static void
+put_record(u_char *p, u_int record_size, u_int32_t l, u_int32_t r)
+{
+	switch (record_size) {
+	case 24:
+		p[0] = l >> 16; p[1] = l >> 8; p[2] = l;
+		p[3] = r >> 16; p[4] = r >> 8; p[5] = r;
+		break;
+	case 28:
+		p[0] = l >> 16; p[1] = l >> 8; p[2] = l;
+		p[3] = ((l >> 20) & 0xf0) | ((r >> 24) & 0x0f);
+		p[4] = r >> 16; p[5] = r >> 8; p[6] = r;
+		break;
+	default:
+		p[0] = l >> 24; p[1] = l >> 16; p[2] = l >> 8; p[3] = l;
+		p[4] = r >> 24; p[5] = r >> 16; p[6] = r >> 8; p[7] = r;
+		break;
+	}
+}
+
+static u_int32_t
+file_record(u_int64_t rec, size_t node_count)
+{
+	if (rec == REC_NONE)
+		return (node_count);
+	if (rec & REC_DATA)
+		return (node_count + 16 + (rec & ~REC_DATA));
+	/* Nodes are written in reverse order of creation, root first */
+	return (node_count - 1 - rec);
+}
+
+int
+mmdb_write(const char *path, radix_tree_t *tree, int ip_version,
+    PyObject *metadata)
+{
+	struct mmdb_writer w;
+	struct mmdb_buf out;
+	u_int64_t root, max;
+	u_int record_size, node_bytes;
+	u_char rec[8];
+	size_t i, n;
+	FILE *f = NULL;
+	int ret = -1;
+
+	memset(&w, '\0', sizeof(w));
+	memset(&out, '\0', sizeof(out));
+	w.maxbits = ip_version == 6 ? 128 : 32;
+	if ((w.dedup = PyDict_New()) == NULL)
+		return (-1);
+
+	if ((root = gen_tree(&w, tree->head, 0, REC_NONE)) == REC_ERROR)
+		goto out;
+	/* The root must be a node, even for an empty tree */
+	if ((root & (REC_NONE | REC_DATA)) != 0 &&
+	    new_node(&w, root, root) == REC_ERROR)
+		goto out;
+
+	n = w.nnodes;
+	max = n + 16 + w.data.len;
+	if (max < (1 << 24))
+		record_size = 24;
+	else if (max < (1 << 28))
+		record_size = 28;
+	else if (max <= 0xffffffffULL)
+		record_size = 32;
+	else {
+		PyErr_SetString(PyExc_ValueError,
+		    "tree too large for a MaxMind DB");
+		goto out;
+	}
+	node_bytes = record_size / 4;
+
+	for (i = 0; i < n; i++) {
+		put_record(rec, record_size,
+		    file_record(w.nodes[(n - 1 - i) * 2], n),
+		    file_record(w.nodes[(n - 1 - i) * 2 + 1], n));
+		if (buf_put(&out, rec, node_bytes) != 0)
+			goto out;
+	}
+	memset(rec, '\0', sizeof(rec));
+	if (buf_put(&out, rec, 8) != 0 || buf_put(&out, rec, 8) != 0 ||
+	    (w.data.len > 0 && buf_put(&out, w.data.p, w.data.len) != 0) ||
+	    buf_put(&out, MMDB_MARKER, MMDB_MARKER_LEN) != 0 ||
+	    put_metadata(&out, metadata, n, record_size, ip_version) != 0)
+		goto out;
+
+	if ((f = fopen(path, "wb")) == NULL ||
+	    fwrite(out.p, out.len, 1, f) != 1 || fclose(f) != 0) {
+		if (f != NULL && ferror(f))
+			fclose(f);
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		goto out;
+	}
+	ret = 0;
+ out:
+	Py_DECREF(w.dedup);
+	PyMem_Free(w.data.p);
+	PyMem_Free(w.rec.p);
+	PyMem_Free(w.nodes);
+	PyMem_Free(out.p);
+	return (ret);
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Reader */
+
+struct _mmdb_t {
+	u_char *base;
+	size_t len;
+	int mapped;
+	u_int32_t node_count;
+	u_int record_size;
+	u_int ip_version;
+	const u_char *data;		/* data section */
+	size_t data_len;
+	const u_char *meta;		/* metadata section */
+	size_t meta_len;
+	u_int32_t ipv4_start;		/* node reached by ::/96 */
+	u_int ipv4_depth;
+	PyObject *metadata;
+};
+
+struct mmdb_section {
+	const u_char *p;
+	size_t len;
+};
+
+static PyObject *
+mmdb_corrupt(void)
+{
+	PyErr_SetString(PyExc_ValueError, "corrupt MaxMind DB");
+	return (NULL);
+}
+
+static u_int64_t
+get_be(const u_char *p, size_t n)
+{
+	u_int64_t v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | *p++;
+	return (v);
+}
+
+static PyObject *
+decode(struct mmdb_section *s, size_t *off, int depth)
+{
+	PyObject *ret, *key, *value;
+	size_t o = *off, size, ptr, i;
+	u_int64_t v;
+	double d;
+	float fl;
+	int type, ss;
+	u_char ctrl;
+
+	if (depth > MMDB_MAX_DEPTH || o >= s->len)
+		return (mmdb_corrupt());
+	ctrl = s->p[o++];
+	type = ctrl >> 5;
+	if (type == MMDB_T_POINTER) {
+		ss = (ctrl >> 3) & 3;
+		if (o + ss + 1 > s->len)
+			return (mmdb_corrupt());
+		switch (ss) {
+		case 0:
+			ptr = ((ctrl & 7) << 8) | s->p[o];
+			break;
+		case 1:
+			ptr = (((ctrl & 7) << 16) | get_be(s->p + o, 2)) + 2048;
+			break;
+		case 2:
+			ptr = (((size_t)(ctrl & 7) << 24) |
+			    get_be(s->p + o, 3)) + 526336;
+			break;
+		default:
+			ptr = get_be(s->p + o, 4);
+			break;
+		}
+		*off = o + ss + 1;
+		return (decode(s, &ptr, depth + 1));
+	}
+	if (type == MMDB_T_EXTENDED) {
+		if (o >= s->len)
+			return (mmdb_corrupt());
+		type = 7 + s->p[o++];
+	}
+	size = ctrl & 0x1f;
+	if (size >= 29) {
+		ss = size - 28;
+		if (o + ss > s->len)
+			return (mmdb_corrupt());
+		size = get_be(s->p + o, ss) +
+		    (ss == 1 ? 29 : ss == 2 ? 285 : 65821);
+		o += ss;
+	}
+
+	switch (type) {
+	case MMDB_T_MAP:
+		if ((ret = PyDict_New()) == NULL)
+			return (NULL);
+		for (i = 0; i < size; i++) {
+			if ((key = decode(s, &o, depth + 1)) == NULL)
+				goto fail;
+			/* Map keys are always strings */
+			if (!MMDB_TEXT_CHECK(key)) {
+				Py_DECREF(key);
+				mmdb_corrupt();
+				goto fail;
+			}
+			if ((value = decode(s, &o, depth + 1)) == NULL) {
+				Py_DECREF(key);
+				goto fail;
+			}
+			if (PyDict_SetItem(ret, key, value) != 0) {
+				Py_DECREF(key);
+				Py_DECREF(value);
+				goto fail;
+			}
+			Py_DECREF(key);
+			Py_DECREF(value);
+		}
+		*off = o;
+		return (ret);
+	case MMDB_T_ARRAY:
+		if ((ret = PyList_New(size)) == NULL)
+			return (NULL);
+		for (i = 0; i < size; i++) {
+			if ((value = decode(s, &o, depth + 1)) == NULL)
+				goto fail;
+			PyList_SET_ITEM(ret, i, value);
+		}
+		*off = o;
+		return (ret);
+	case MMDB_T_BOOLEAN:
+		*off = o;
+		return (PyBool_FromLong(size != 0));
+	case MMDB_T_END:
+	case MMDB_T_CONTAINER:
+		return (mmdb_corrupt());
+	}
+
+	if (o + size > s->len)
+		return (mmdb_corrupt());
+	*off = o + size;
+	switch (type) {
+	case MMDB_T_STRING:
+		return (PyUnicode_DecodeUTF8((const char *)s->p + o, size,
+		    "replace"));
+	case MMDB_T_BYTES:
+		return (PyBytes_FromStringAndSize((const char *)s->p + o,
+		    size));
+	case MMDB_T_DOUBLE:
+		if (size != 8)
+			return (mmdb_corrupt());
+		v = get_be(s->p + o, 8);
+		memcpy(&d, &v, sizeof(d));
+		return (PyFloat_FromDouble(d));
+	case MMDB_T_FLOAT:
+		if (size != 4)
+			return (mmdb_corrupt());
+		v = get_be(s->p + o, 4);
+		{
+			u_int32_t v32 = v;
+
+			memcpy(&fl, &v32, sizeof(fl));
+		}
+		return (PyFloat_FromDouble(fl));
+	case MMDB_T_INT32:
+		if (size > 4)
+			return (mmdb_corrupt());
+		v = get_be(s->p + o, size);
+		if (size == 4)
+			return (PyLong_FromLong((int32_t)(u_int32_t)v));
+		return (PyLong_FromLong((long)v));
+	case MMDB_T_UINT16:
+	case MMDB_T_UINT32:
+	case MMDB_T_UINT64:
+		if (size > 8)
+			return (mmdb_corrupt());
+		return (PyLong_FromUnsignedLongLong(get_be(s->p + o, size)));
+	case MMDB_T_UINT128:
+		if (size > 16)
+			return (mmdb_corrupt());
+		return (_PyLong_FromByteArray(s->p + o, size, 0, 0));
+	}
+	return (mmdb_corrupt());
+ fail:
+	Py_DECREF(ret);
+	return (NULL);
+}
+
+static u_int32_t
+read_record(mmdb_t *db, u_int32_t node, int right)
+{
+	const u_char *p = db->base + (size_t)node * (db->record_size / 4);
+
+	switch (db->record_size) {
+	case 24:
+		return (get_be(p + (right ? 3 : 0), 3));
+	case 28:
+		if (right)
+			return (((p[3] & 0x0f) << 24) | get_be(p + 4, 3));
+		return (((p[3] & 0xf0) << 20) | get_be(p, 3));
+	default:
+		return (get_be(p + (right ? 4 : 0), 4));
+	}
+}
+
+static int
+meta_uint(PyObject *meta, const char *key, u_int64_t *v)
+{
+	PyObject *o;
+
+	if ((o = PyDict_GetItemString(meta, key)) == NULL ||
+	    !PyLong_Check(o)) {
+		PyErr_Format(PyExc_ValueError,
+		    "MaxMind DB metadata lacks '%s'", key);
+		return (-1);
+	}
+	*v = PyLong_AsUnsignedLongLong(o);
+	return (PyErr_Occurred() ? -1 : 0);
+}
+
+static int
+mmdb_load_file(mmdb_t *db, const char *path)
+{
+	FILE *f;
+	long len;
+#if !defined(_MSC_VER)
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) != -1) {
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			db->base = mmap(NULL, st.st_size, PROT_READ,
+			    MAP_SHARED, fd, 0);
+			if (db->base != MAP_FAILED) {
+				close(fd);
+				db->len = st.st_size;
+				db->mapped = 1;
+				return (0);
+			}
+			db->base = NULL;
+		}
+		close(fd);
+	}
+#endif
+	/* No mmap: read the whole file */
+	if ((f = fopen(path, "rb")) == NULL ||
+	    fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) <= 0 ||
+	    fseek(f, 0, SEEK_SET) != 0 ||
+	    (db->base = PyMem_Malloc(len)) == NULL ||
+	    fread(db->base, len, 1, f) != 1) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		if (f != NULL)
+			fclose(f);
+		return (-1);
+	}
+	fclose(f);
+	db->len = len;
+	return (0);
+}
+
+mmdb_t
+*mmdb_open(const char *path)
+{
+	struct mmdb_section s;
+	mmdb_t *db;
+	const u_char *p, *lim;
+	size_t off, tree_len;
+	u_int64_t node_count, record_size, ip_version;
+	u_int i;
+
+	if ((db = PyMem_Malloc(sizeof(*db))) == NULL) {
+		PyErr_NoMemory();
+		return (NULL);
+	}
+	memset(db, '\0', sizeof(*db));
+	if (mmdb_load_file(db, path) != 0)
+		goto fail;
+
+	/* The metadata follows the last marker in the file */
+	lim = db->len > MMDB_META_MAX ? db->base + db->len - MMDB_META_MAX :
+	    db->base;
+	for (p = db->base + db->len - MMDB_MARKER_LEN; p >= lim; p--) {
+		if (memcmp(p, MMDB_MARKER, MMDB_MARKER_LEN) == 0)
+			break;
+	}
+	if (p < lim) {
+		PyErr_SetString(PyExc_ValueError, "not a MaxMind DB");
+		goto fail;
+	}
+	db->meta = p + MMDB_MARKER_LEN;
+	db->meta_len = db->base + db->len - db->meta;
+	s.p = db->meta;
+	s.len = db->meta_len;
+	off = 0;
+	if ((db->metadata = decode(&s, &off, 0)) == NULL)
+		goto fail;
+	if (!PyDict_Check(db->metadata)) {
+		mmdb_corrupt();
+		goto fail;
+	}
+	if (meta_uint(db->metadata, "node_count", &node_count) != 0 ||
+	    meta_uint(db->metadata, "record_size", &record_size) != 0 ||
+	    meta_uint(db->metadata, "ip_version", &ip_version) != 0)
+		goto fail;
+	if ((record_size != 24 && record_size != 28 && record_size != 32) ||
+	    (ip_version != 4 && ip_version != 6) ||
+	    node_count > 0xffffffffULL) {
+		mmdb_corrupt();
+		goto fail;
+	}
+	db->node_count = node_count;
+	db->record_size = record_size;
+	db->ip_version = ip_version;
+	tree_len = (size_t)node_count * (record_size / 4);
+	if (tree_len + 16 > (size_t)(p - db->base)) {
+		mmdb_corrupt();
+		goto fail;
+	}
+	db->data = db->base + tree_len + 16;
+	db->data_len = p - db->data;
+
+	/* IPv4 addresses in an IPv6 database live under ::/96 */
+	db->ipv4_start = 0;
+	db->ipv4_depth = 0;
+	if (ip_version == 6) {
+		for (i = 0; i < 96 && db->ipv4_start < db->node_count; i++)
+			db->ipv4_start = read_record(db, db->ipv4_start, 0);
+		db->ipv4_depth = i;
+	}
+	return (db);
+ fail:
+	mmdb_close(db);
+	return (NULL);
+}
+
+void
+mmdb_close(mmdb_t *db)
+{
+	if (db->base != NULL) {
+#if !defined(_MSC_VER)
+		if (db->mapped)
+			munmap(db->base, db->len);
+		else
+#endif
+			PyMem_Free(db->base);
+	}
+	Py_XDECREF(db->metadata);
+	PyMem_Free(db);
+}
+
+PyObject *
+mmdb_metadata(mmdb_t *db)
+{
+	Py_INCREF(db->metadata);
+	return (db->metadata);
+}
+
+static PyObject *
+data_at(mmdb_t *db, u_int32_t rec)
+{
+	struct mmdb_section s;
+	size_t off;
+
+	s.p = db->data;
+	s.len = db->data_len;
+	off = rec - db->node_count - 16;
+	if (rec < db->node_count + 16 || off >= s.len)
+		return (mmdb_corrupt());
+	return (decode(&s, &off, 0));
+}
+
+PyObject *
+mmdb_lookup(mmdb_t *db, prefix_t *addr)
+{
+	u_char *a = (u_char *)&addr->add;
+	u_int32_t node = 0;
+	u_int i, bits;
+
+	if (addr->family == AF_INET6) {
+		if (db->ip_version == 4) {
+			PyErr_SetString(PyExc_ValueError,
+			    "IPv6 lookup in an IPv4 MaxMind DB");
+			return (NULL);
+		}
+		bits = 128;
+		i = 0;
+	} else {
+		bits = 32;
+		i = 0;
+		if (db->ip_version == 6) {
+			node = db->ipv4_start;
+			if (db->ipv4_depth < 96)
+				bits = 0;	/* ::/96 ends in a record */
+		}
+	}
+	for (; i < bits && node < db->node_count; i++)
+		node = read_record(db, node, (a[i >> 3] >> (7 - (i & 7))) & 1);
+	if (node <= db->node_count) {
+		Py_INCREF(Py_None);
+		return (Py_None);
+	}
+	return (data_at(db, node));
+}
+
+struct mmdb_walk_ctx {
+	mmdb_t *db;
+	mmdb_cb_t func;
+	void *cbctx;
+	PyObject *cache;		/* data offset -> decoded object */
+	u_char key[16];
+};
+
+static int
+walk_emit(struct mmdb_walk_ctx *w, u_int32_t rec, u_int len)
+{
+	static const u_char zero[12];
+	PyObject *off, *data;
+	prefix_t prefix;
+	int r;
+
+	memset(&prefix, '\0', sizeof(prefix));
+	if (w->db->ip_version == 4) {
+		prefix.family = AF_INET;
+		memcpy(&prefix.add.sin, w->key, 4);
+		prefix.bitlen = len;
+	} else if (len >= 96 && memcmp(w->key, zero, 12) == 0) {
+		prefix.family = AF_INET;
+		memcpy(&prefix.add.sin, w->key + 12, 4);
+		prefix.bitlen = len - 96;
+	} else {
+		prefix.family = AF_INET6;
+		memcpy(&prefix.add.sin6, w->key, 16);
+		prefix.bitlen = len;
+	}
+
+	/* Records with the same data share one decoded object */
+	if ((off = PyLong_FromUnsignedLong(rec)) == NULL)
+		return (-1);
+	if ((data = PyDict_GetItem(w->cache, off)) != NULL)
+		Py_INCREF(data);
+	else if ((data = data_at(w->db, rec)) == NULL ||
+	    PyDict_SetItem(w->cache, off, data) != 0) {
+		Py_XDECREF(data);
+		Py_DECREF(off);
+		return (-1);
+	}
+	Py_DECREF(off);
+	r = w->func(&prefix, data, w->cbctx);
+	Py_DECREF(data);
+	return (r);
+}
+
+static int
+walk_node(struct mmdb_walk_ctx *w, u_int32_t node, u_int depth)
+{
+	mmdb_t *db = w->db;
+	static const u_char zero[12];
+	u_int32_t rec;
+	u_int maxbits = db->ip_version == 6 ? 128 : 32;
+	int side, r;
+
+	if (depth >= maxbits) {
+		mmdb_corrupt();
+		return (-1);
+	}
+	for (side = 0; side < 2; side++) {
+		if (side)
+			w->key[depth >> 3] |= 0x80 >> (depth & 7);
+		rec = read_record(db, node, side);
+		if (rec < db->node_count) {
+			/* Skip aliases of the IPv4 subtree (::ffff:0:0/96 &c) */
+			if (db->ip_version == 6 && rec == db->ipv4_start &&
+			    (depth + 1 != db->ipv4_depth ||
+			    memcmp(w->key, zero, 12) != 0))
+				r = 0;
+			else
+				r = walk_node(w, rec, depth + 1);
+		} else if (rec > db->node_count)
+			r = walk_emit(w, rec, depth + 1);
+		else
+			r = 0;
+		if (side)
+			w->key[depth >> 3] &= ~(0x80 >> (depth & 7));
+		if (r != 0)
+			return (r);
+	}
+	return (0);
+}
+
+int
+mmdb_walk(mmdb_t *db, mmdb_cb_t func, void *cbctx)
+{
+	struct mmdb_walk_ctx w;
+	int r;
+
+	memset(&w, '\0', sizeof(w));
+	w.db = db;
+	w.func = func;
+	w.cbctx = cbctx;
+	if ((w.cache = PyDict_New()) == NULL)
+		return (-1);
+	if (db->node_count == 0)
+		r = 0;
+	else
+		r = walk_node(&w, 0, 0);
+	Py_DECREF(w.cache);
+	return (r);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2004 Damien Miller <djm@mindrot.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* $Id$ */
+
+#ifndef _RADIX_MMDB_H
+#define _RADIX_MMDB_H
+
+#include "radix.h"
+
+/*
+ * Reading and writing of MaxMind DB (format version 2) files. Data
+ * records are converted to and from Python objects: maps are dicts,
+ * arrays are lists, strings are str, bytes are bytes and the numeric and
+ * boolean types are int, float and bool. All functions set a Python
+ * exception when they fail.
+ */
+typedef struct _mmdb_t mmdb_t;
+
+/* Type of walk callback, return non-zero to stop the walk */
+typedef int (*mmdb_cb_t)(prefix_t *, PyObject *, void *);
+
+/*
+ * Write 'tree' (whose node->data pointers are the PyObject payloads of
+ * the prefixes) as an 'ip_version' database. Prefixes with NULL data
+ * mark addresses that have no record. Entries of 'metadata' are added to
+ * the metadata map.
+ */
+int mmdb_write(const char *path, radix_tree_t *tree, int ip_version,
+    PyObject *metadata);
+
+mmdb_t *mmdb_open(const char *path);
+void mmdb_close(mmdb_t *db);
+PyObject *mmdb_metadata(mmdb_t *db);
+PyObject *mmdb_lookup(mmdb_t *db, prefix_t *addr);
+int mmdb_walk(mmdb_t *db, mmdb_cb_t func, void *cbctx);
+
+#endif /* _RADIX_MMDB_H */
@@ -14,9 +14,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define PY_SSIZE_T_CLEAN
 #include "Python.h"
-#include "structmember.h"
 #include "radix.h"
+#include "radix_disk.h"
+#include "radix_mmdb.h"
 
 /* $Id$ */
 
@@ -40,6 +42,11 @@
 struct _RadixObject;
 struct _RadixIterObject;
 static struct _RadixIterObject *newRadixIterObject(struct _RadixObject *);
+static struct _RadixIterObject *newRadixItemsObject(struct _RadixObject *,
+    int, PyObject *);
+static struct _RadixIterObject *newRadixSubtreeIterObject(
+    struct _RadixObject *, radix_node_t *);
+static PyObject *newRadixCursorObject(struct _RadixObject *, PyObject *);
 static PyObject *radix_Radix(PyObject *, PyObject *);
 
 /* ------------------------------------------------------------------------ */
@@ -48,57 +55,88 @@ PyObject *radix_constructor;
 
 /* RadixNode: tree nodes */
 
+/*
+ * The prefix is referenced rather than copied, since the radix.c node
+ * has a lifetime independent of the Python node object. The data dict
+ * and the prefix string are only created when first asked for.
+ */
 typedef struct {
 	PyObject_HEAD
-	PyObject *user_attr;	/* User-specified attributes */
-	PyObject *network;
-	PyObject *prefix;
-	PyObject *prefixlen;
-	PyObject *family;
-	PyObject *packed;
 	radix_node_t *rn;	/* Actual radix node (pointer to parent) */
+	prefix_t *prefix;
+	PyObject *user_attr;	/* User-specified attributes */
+	PyObject *prefix_str;
 } RadixNodeObject;
 
 static PyTypeObject RadixNode_Type;
 
+/*
+ * Freed node objects are kept for reuse, so that prefixes being added
+ * and deleted over and over don't go through the allocator.
+ */
+#define RADIXNODE_MAXFREE	1024
+
+static RadixNodeObject *radixnode_free[RADIXNODE_MAXFREE];
+static int radixnode_nfree = 0;
+
 static RadixNodeObject *
 newRadixNodeObject(radix_node_t *rn)
 {
 	RadixNodeObject *self;
-	char network[256], prefix[256];
 
 	/* Sanity check */
 	if (rn == NULL || rn->prefix == NULL || 
 	    (rn->prefix->family != AF_INET && rn->prefix->family != AF_INET6))
 		return NULL;
 
-	self = PyObject_New(RadixNodeObject, &RadixNode_Type);
-	if (self == NULL)
+	if (radixnode_nfree > 0) {
+		self = radixnode_free[--radixnode_nfree];
+		PyObject_Init((PyObject *)self, &RadixNode_Type);
+	} else if ((self = PyObject_New(RadixNodeObject,
+	    &RadixNode_Type)) == NULL)
 		return NULL;
 
 	self->rn = rn;
+	self->prefix = Ref_Prefix(rn->prefix);
+	self->user_attr = NULL;
+	self->prefix_str = NULL;
+	return self;
+}
+
+/* Returns a borrowed reference to the data dict, creating it if needed */
+static PyObject *
+node_data(RadixNodeObject *self)
+{
+	if (self->user_attr == NULL)
+		self->user_attr = PyDict_New();
+	return (self->user_attr);
+}
 
-	/* Format addresses for packing into objects */
-	prefix_addr_ntop(rn->prefix, network, sizeof(network));
-	prefix_ntop(rn->prefix, prefix, sizeof(prefix));
+/*
+ * The data of a tree node for export: None if its data dict was never
+ * asked for. Returns a borrowed reference. Only for internal use, where
+ * None must be read as an empty dict; results handed to the user get
+ * node_data() instead.
+ */
+static PyObject *
+node_payload(radix_node_t *rn)
+{
+	PyObject *data = ((RadixNodeObject *)rn->data)->user_attr;
 
-	self->user_attr = PyDict_New();
-	self->network = PyString_FromString(network);
-	self->prefix = PyString_FromString(prefix);
-	self->prefixlen = PyInt_FromLong(rn->prefix->bitlen);
-	self->family = PyInt_FromLong(rn->prefix->family);
-	self->packed = PyString_FromStringAndSize((char*)&rn->prefix->add,
-	    rn->prefix->family == AF_INET ? 4 : 16);
+	return (data != NULL ? data : Py_None);
+}
 
-	if (self->user_attr == NULL || self->prefixlen == NULL || 
-	    self->family == NULL || self->network == NULL || 
-	    self->prefix == NULL) {
-		/* RadixNode_dealloc will clean up for us */
-		Py_XDECREF(self);
-		return (NULL);		
-	}
+/* Returns a borrowed reference to the prefix string */
+static PyObject *
+node_prefix_str(RadixNodeObject *self)
+{
+	char prefix[256];
 
-	return self;
+	if (self->prefix_str == NULL) {
+		prefix_ntop(self->prefix, prefix, sizeof(prefix));
+		self->prefix_str = PyString_FromString(prefix);
+	}
+	return (self->prefix_str);
 }
 
 /* RadixNode methods */
@@ -107,21 +145,75 @@ static void
 RadixNode_dealloc(RadixNodeObject *self)
 {
 	Py_XDECREF(self->user_attr);
-	Py_XDECREF(self->prefixlen);
-	Py_XDECREF(self->family);
-	Py_XDECREF(self->network);
-	Py_XDECREF(self->prefix);
-	Py_XDECREF(self->packed);
-	PyObject_Del(self);
+	Py_XDECREF(self->prefix_str);
+	Deref_Prefix(self->prefix);
+	if (radixnode_nfree < RADIXNODE_MAXFREE)
+		radixnode_free[radixnode_nfree++] = self;
+	else
+		PyObject_Del(self);
+}
+
+/*
+ * The caller may change the data dict in place, so the subtree hashes
+ * covering it are marked stale.
+ */
+static PyObject *
+RadixNode_get_data(RadixNodeObject *self, void *closure)
+{
+	PyObject *data;
+
+	if (self->rn != NULL)
+		radix_hash_invalidate(self->rn);
+	if ((data = node_data(self)) != NULL)
+		Py_INCREF(data);
+	return (data);
+}
+
+static PyObject *
+RadixNode_get_network(RadixNodeObject *self, void *closure)
+{
+	char network[256];
+
+	prefix_addr_ntop(self->prefix, network, sizeof(network));
+	return PyString_FromString(network);
+}
+
+static PyObject *
+RadixNode_get_prefix(RadixNodeObject *self, void *closure)
+{
+	PyObject *prefix;
+
+	if ((prefix = node_prefix_str(self)) != NULL)
+		Py_INCREF(prefix);
+	return (prefix);
+}
+
+static PyObject *
+RadixNode_get_prefixlen(RadixNodeObject *self, void *closure)
+{
+	return PyInt_FromLong(self->prefix->bitlen);
+}
+
+static PyObject *
+RadixNode_get_family(RadixNodeObject *self, void *closure)
+{
+	return PyInt_FromLong(self->prefix->family);
+}
+
+static PyObject *
+RadixNode_get_packed(RadixNodeObject *self, void *closure)
+{
+	return PyString_FromStringAndSize((char *)&self->prefix->add,
+	    self->prefix->family == AF_INET ? 4 : 16);
 }
 
-static PyMemberDef RadixNode_members[] = {
-	{"data",	T_OBJECT, offsetof(RadixNodeObject, user_attr),	READONLY},
-	{"network",	T_OBJECT, offsetof(RadixNodeObject, network),	READONLY},
-	{"prefix",	T_OBJECT, offsetof(RadixNodeObject, prefix),	READONLY},
-	{"prefixlen",	T_OBJECT, offsetof(RadixNodeObject, prefixlen),	READONLY},
-	{"family",	T_OBJECT, offsetof(RadixNodeObject, family),	READONLY},
-	{"packed",	T_OBJECT, offsetof(RadixNodeObject, packed),	READONLY},
+static PyGetSetDef RadixNode_getset[] = {
+	{"data",	(getter)RadixNode_get_data,	NULL,	NULL,	NULL},
+	{"network",	(getter)RadixNode_get_network,	NULL,	NULL,	NULL},
+	{"prefix",	(getter)RadixNode_get_prefix,	NULL,	NULL,	NULL},
+	{"prefixlen",	(getter)RadixNode_get_prefixlen,NULL,	NULL,	NULL},
+	{"family",	(getter)RadixNode_get_family,	NULL,	NULL,	NULL},
+	{"packed",	(getter)RadixNode_get_packed,	NULL,	NULL,	NULL},
 	{NULL}
 };
 
@@ -160,8 +252,8 @@ static PyTypeObject RadixNode_Type = {
 	0,			/*tp_iter*/
 	0,			/*tp_iternext*/
 	0,			/*tp_methods*/
-	RadixNode_members,	/*tp_members*/
-	0,			/*tp_getset*/
+	0,			/*tp_members*/
+	RadixNode_getset,	/*tp_getset*/
 	0,			/*tp_base*/
 	0,			/*tp_dict*/
 	0,			/*tp_descr_get*/
@@ -181,6 +273,9 @@ typedef struct _RadixObject {
 	radix_tree_t *rt4;	/* Radix tree for IPv4 addresses */
 	radix_tree_t *rt6;	/* Radix tree for IPv6 addresses */
 	unsigned int gen_id;	/* Detect modification during iterations */
+	radix_journal_t *journal; /* Optional log of modifications */
+	int hashing;		/* Set once root_hash() has been used */
+	PyObject *hash_digest;	/* Payload digest callable, or NULL */
 } RadixObject;
 
 static PyTypeObject Radix_Type;
@@ -206,6 +301,9 @@ newRadixObject(void)
 	self->rt4 = rt4;
 	self->rt6 = rt6;
 	self->gen_id = 0;
+	self->journal = NULL;
+	self->hashing = 0;
+	self->hash_digest = NULL;
 	return (self);
 }
 
@@ -234,11 +332,14 @@ Radix_dealloc(RadixObject *self)
 
 	Destroy_Radix(self->rt4, NULL, NULL);
 	Destroy_Radix(self->rt6, NULL, NULL);
+	if (self->journal != NULL)
+		radix_journal_close(self->journal);
+	Py_XDECREF(self->hash_digest);
 	PyObject_Del(self);
 }
 
 static prefix_t
-*args_to_prefix(char *addr, char *packed, int packlen, long prefixlen)
+*args_to_prefix(char *addr, char *packed, Py_ssize_t packlen, long prefixlen)
 {
 	prefix_t *prefix = NULL;
 	const char *errmsg;
@@ -278,13 +379,370 @@ static prefix_t
 
 #define PICKRT(prefix, rno) (prefix->family == AF_INET6 ? rno->rt6 : rno->rt4)
 
-static PyObject *
-create_add_node(RadixObject *self, prefix_t *prefix)
+/*
+ * The hot lookup methods take METH_FASTCALL arguments where available:
+ * a C array of positional arguments followed by the values of the
+ * keywords named in the 'kwnames' tuple, so no tuple or dict is built
+ * per call. The prefix is decoded into the caller's storage.
+ */
+#if PY_VERSION_HEX >= 0x03070000
+# define PREFIX_ARGS	PyObject *const *args, Py_ssize_t nargs, \
+			    PyObject *kwnames
+# define PREFIX_METH	METH_FASTCALL|METH_KEYWORDS
+# define GET_PREFIX_ARGS(fname, prefix) \
+	get_prefix_args(fname, args, nargs, kwnames, prefix)
+#else
+# define PREFIX_ARGS	PyObject *args, PyObject *kw_args
+# define PREFIX_METH	METH_VARARGS|METH_KEYWORDS
+# define GET_PREFIX_ARGS(fname, prefix) \
+	get_prefix_args(fname, args, kw_args, prefix)
+#endif
+
+/* Parse a string address into 'prefix', setting ValueError on failure */
+static prefix_t *
+text_to_prefix(const char *addr, long prefixlen, prefix_t *prefix)
+{
+	const char *errmsg = NULL;
+
+	if (prefix_pton2(addr, prefixlen, prefix, &errmsg) == NULL) {
+		PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
+		    "Invalid address format");
+		return (NULL);
+	}
+	return (prefix);
+}
+
+/* Interned attribute names of ipaddress objects */
+static PyObject *str_packed, *str_network_address, *str_prefixlen;
+
+/* The string of a text 'network' argument, which may be str or bytes */
+static const char *
+network_string(PyObject *network)
+{
+	const char *s;
+	Py_ssize_t len;
+
+#if PY_MAJOR_VERSION >= 3
+	if (PyUnicode_Check(network)) {
+		if ((s = PyUnicode_AsUTF8AndSize(network, &len)) == NULL)
+			return (NULL);
+	} else
+#endif
+	{
+		s = PyBytes_AS_STRING(network);
+		len = PyBytes_GET_SIZE(network);
+	}
+	if ((size_t)len != strlen(s)) {
+		PyErr_SetString(PyExc_ValueError, "embedded null character");
+		return (NULL);
+	}
+	return (s);
+}
+
+/* Build a prefix from a 4 or 16 byte address, clearing the host bits */
+static prefix_t *
+addr_to_prefix(const u_char *addr, size_t len, long prefixlen,
+    prefix_t *prefix)
+{
+	u_char rec[PREFIX_PACKED_MAX];
+
+	if (prefixlen == -1)
+		prefixlen = len * 8;
+	if (prefixlen < 0 || prefixlen > (long)len * 8) {
+		PyErr_SetString(PyExc_ValueError, "invalid prefix length");
+		return (NULL);
+	}
+	rec[0] = len == 4 ? 4 : 6;
+	rec[1] = prefixlen;
+	memcpy(rec + 2, addr, len);
+	if (prefix_unpack(rec, len + 2, prefix) == 0) {
+		PyErr_SetString(PyExc_ValueError,
+		    "Invalid packed address format");
+		return (NULL);
+	}
+	return (prefix);
+}
+
+/* An integer address; without a 'family' hint it is IPv4 if it fits */
+static prefix_t *
+int_to_prefix(PyObject *network, long prefixlen, int family,
+    prefix_t *prefix)
+{
+	PyObject *shift, *hi_obj;
+	unsigned PY_LONG_LONG hi = 0, lo;
+	PY_LONG_LONG v;
+	u_char addr[16];
+	int overflow, i;
+
+	v = PyLong_AsLongLongAndOverflow(network, &overflow);
+	if (v == -1 && PyErr_Occurred())
+		return (NULL);
+	if (overflow < 0 || (overflow == 0 && v < 0)) {
+		PyErr_SetString(PyExc_ValueError, "negative address");
+		return (NULL);
+	}
+	if (overflow == 0)
+		lo = v;
+	else {
+		lo = PyLong_AsUnsignedLongLongMask(network);
+		if ((shift = PyLong_FromLong(64)) == NULL)
+			return (NULL);
+		hi_obj = PyNumber_Rshift(network, shift);
+		Py_DECREF(shift);
+		if (hi_obj == NULL)
+			return (NULL);
+		hi = PyLong_AsUnsignedLongLong(hi_obj);
+		Py_DECREF(hi_obj);
+		if (hi == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred())
+			return (NULL);
+	}
+	if (family == 0)
+		family = hi == 0 && lo <= 0xffffffffULL ? AF_INET : AF_INET6;
+	if (family == AF_INET && (hi != 0 || lo > 0xffffffffULL)) {
+		PyErr_SetString(PyExc_ValueError,
+		    "address too large for AF_INET");
+		return (NULL);
+	}
+	for (i = 0; i < 8; i++) {
+		addr[i] = hi >> (56 - 8 * i);
+		addr[i + 8] = lo >> (56 - 8 * i);
+	}
+	if (family == AF_INET)
+		return (addr_to_prefix(addr + 12, 4, prefixlen, prefix));
+	return (addr_to_prefix(addr, 16, prefixlen, prefix));
+}
+
+/* A packed address in any buffer, as for the 'packed' argument */
+static prefix_t *
+buffer_to_prefix(PyObject *packed, long prefixlen, prefix_t *prefix)
+{
+	Py_buffer view;
+
+	if (PyObject_GetBuffer(packed, &view, PyBUF_SIMPLE) != 0)
+		return (NULL);
+	if (view.len > 16 || prefix_from_blob2(view.buf, view.len, prefixlen,
+	    prefix) == NULL) {
+		PyErr_SetString(PyExc_ValueError,
+		    "Invalid packed address format");
+		prefix = NULL;
+	}
+	PyBuffer_Release(&view);
+	return (prefix);
+}
+
+/* An ipaddress address or network object, read via its packed form */
+static prefix_t *
+ipaddress_to_prefix(const char *fname, PyObject *network, long prefixlen,
+    prefix_t *prefix)
+{
+	PyObject *addr, *packed = NULL, *plen;
+	prefix_t *ret = NULL;
+	long len;
+
+	if ((addr = PyObject_GetAttr(network, str_network_address)) != NULL) {
+		if ((plen = PyObject_GetAttr(network, str_prefixlen)) == NULL)
+			goto out;
+		len = PyLong_AsLong(plen);
+		Py_DECREF(plen);
+		if (len == -1 && PyErr_Occurred())
+			goto out;
+		if (prefixlen != -1) {
+			PyErr_SetString(PyExc_ValueError,
+			    "masklen specified twice");
+			goto out;
+		}
+		prefixlen = len;
+	} else if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+		PyErr_Clear();
+		Py_INCREF(network);
+		addr = network;
+	} else
+		return (NULL);
+
+	if ((packed = PyObject_GetAttr(addr, str_packed)) == NULL ||
+	    !PyBytes_Check(packed)) {
+		PyErr_Clear();
+		PyErr_Format(PyExc_TypeError, "%s() argument 'network' must "
+		    "be str, int, bytes-like or an ipaddress object, not "
+		    "%.200s", fname, Py_TYPE(network)->tp_name);
+		goto out;
+	}
+	if (PyBytes_GET_SIZE(packed) != 4 && PyBytes_GET_SIZE(packed) != 16) {
+		PyErr_SetString(PyExc_ValueError,
+		    "Invalid packed address format");
+		goto out;
+	}
+	ret = addr_to_prefix((u_char *)PyBytes_AS_STRING(packed),
+	    PyBytes_GET_SIZE(packed), prefixlen, prefix);
+ out:
+	Py_XDECREF(packed);
+	Py_XDECREF(addr);
+	return (ret);
+}
+
+/*
+ * Decode a 'network' argument: a string (str or bytes), an integer, a
+ * packed address in any other buffer object or an ipaddress object.
+ * 'family' is 0 or the address family the result must have.
+ */
+static prefix_t *
+object_to_prefix(const char *fname, PyObject *network, long prefixlen,
+    int family, prefix_t *prefix)
+{
+	const char *addr;
+
+	if (PyBytes_Check(network)
+#if PY_MAJOR_VERSION >= 3
+	    || PyUnicode_Check(network)
+#endif
+	    ) {
+		if ((addr = network_string(network)) == NULL ||
+		    text_to_prefix(addr, prefixlen, prefix) == NULL)
+			return (NULL);
+	} else if (PyLong_Check(network)
+#if PY_MAJOR_VERSION < 3
+	    || PyInt_Check(network)
+#endif
+	    ) {
+		return (int_to_prefix(network, prefixlen, family, prefix));
+	} else if (PyObject_CheckBuffer(network)) {
+		if (buffer_to_prefix(network, prefixlen, prefix) == NULL)
+			return (NULL);
+	} else if (ipaddress_to_prefix(fname, network, prefixlen,
+	    prefix) == NULL)
+		return (NULL);
+
+	if (family != 0 && (int)prefix->family != family) {
+		PyErr_SetString(PyExc_ValueError, "address family mismatch");
+		return (NULL);
+	}
+	return (prefix);
+}
+
+static prefix_t *
+prefix_from_args(const char *fname, PyObject *network, PyObject *masklen,
+    PyObject *packed, PyObject *family_obj, prefix_t *prefix)
+{
+	long prefixlen = -1, family = 0;
+
+	if (masklen != NULL &&
+	    (prefixlen = PyLong_AsLong(masklen)) == -1 && PyErr_Occurred())
+		return (NULL);
+	if (family_obj != NULL &&
+	    (family = PyLong_AsLong(family_obj)) == -1 && PyErr_Occurred())
+		return (NULL);
+	if (family != 0 && family != AF_INET && family != AF_INET6) {
+		PyErr_SetString(PyExc_ValueError, "Unsupported address family");
+		return (NULL);
+	}
+	if (network != NULL && packed != NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			    "Two address types specified. Please pick one.");
+		return (NULL);
+	}
+	if (network != NULL) {
+		return (object_to_prefix(fname, network, prefixlen, family,
+		    prefix));
+	}
+	if (packed == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			    "No address specified (use 'address' or 'packed')");
+		return (NULL);
+	}
+	if (buffer_to_prefix(packed, prefixlen, prefix) == NULL)
+		return (NULL);
+	if (family != 0 && (int)prefix->family != family) {
+		PyErr_SetString(PyExc_ValueError, "address family mismatch");
+		return (NULL);
+	}
+	return (prefix);
+}
+
+#if PY_VERSION_HEX >= 0x03070000
+static prefix_t *
+get_prefix_args(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+    PyObject *kwnames, prefix_t *prefix)
+{
+	static const char *keywords[] = { "network", "masklen", "packed",
+	    "family" };
+	PyObject *argv[4] = { NULL, NULL, NULL, NULL }, *name;
+	const char *addr;
+	Py_ssize_t nkw, i;
+	int k;
+
+	/* Fast path: a single string */
+	if (nargs == 1 && kwnames == NULL && PyUnicode_CheckExact(args[0])) {
+		if ((addr = network_string(args[0])) == NULL)
+			return (NULL);
+		return (text_to_prefix(addr, -1, prefix));
+	}
+
+	if (nargs > 3) {
+		PyErr_Format(PyExc_TypeError, "%s() takes at most 3 "
+		    "positional arguments (%zd given)", fname, nargs);
+		return (NULL);
+	}
+	for (i = 0; i < nargs; i++)
+		argv[i] = args[i];
+	nkw = kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0;
+	for (i = 0; i < nkw; i++) {
+		name = PyTuple_GET_ITEM(kwnames, i);
+		for (k = 0; k < 4; k++) {
+			if (PyUnicode_CompareWithASCIIString(name,
+			    keywords[k]) == 0)
+				break;
+		}
+		if (k == 4) {
+			PyErr_Format(PyExc_TypeError, "%s() got an unexpected "
+			    "keyword argument '%U'", fname, name);
+			return (NULL);
+		}
+		if (argv[k] != NULL) {
+			PyErr_Format(PyExc_TypeError, "argument for %s() given "
+			    "by name ('%s') and position", fname, keywords[k]);
+			return (NULL);
+		}
+		argv[k] = args[nargs + i];
+	}
+	return (prefix_from_args(fname, argv[0], argv[1], argv[2], argv[3],
+	    prefix));
+}
+#else
+static prefix_t *
+get_prefix_args(const char *fname, PyObject *args, PyObject *kw_args,
+    prefix_t *prefix)
+{
+	static char *keywords[] = { "network", "masklen", "packed", "family",
+	    NULL };
+	PyObject *network = NULL, *masklen = NULL, *packed = NULL;
+	PyObject *family = NULL;
+	char format[64];
+
+	snprintf(format, sizeof(format), "|OOOO:%s", fname);
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, format, keywords,
+	    &network, &masklen, &packed, &family))
+		return (NULL);
+	return (prefix_from_args(fname, network, masklen, packed, family,
+	    prefix));
+}
+#endif
+
+/*
+ * Insert 'prefix', returning a borrowed reference to its RadixNode. If
+ * 'hint' is not NULL the insertion goes through radix_lookup_sorted().
+ * A new prefix that cannot be journalled is not added.
+ */
+static RadixNodeObject *
+add_node(RadixObject *self, prefix_t *prefix, radix_node_t **hint)
 {
 	radix_node_t *node;
 	RadixNodeObject *node_obj;
 
-	if ((node = radix_lookup(PICKRT(prefix, self), prefix)) == NULL) {
+	if (hint != NULL)
+		node = radix_lookup_sorted(PICKRT(prefix, self), prefix, hint);
+	else
+		node = radix_lookup(PICKRT(prefix, self), prefix);
+	if (node == NULL) {
 		PyErr_SetString(PyExc_MemoryError, "Couldn't add prefix");
 		return NULL;
 	}
@@ -297,18 +755,104 @@ create_add_node(RadixObject *self, prefix_t *prefix)
 	 */
 	if (node->data == NULL) {
 		if ((node_obj = newRadixNodeObject(node)) == NULL)
-			return (NULL);
+			goto undo;
 		node->data = node_obj;
+		if (self->journal != NULL && radix_journal_append(self->journal,
+		    RADIX_JOURNAL_ADD, node->prefix) != 0) {
+			PyErr_SetFromErrno(PyExc_IOError);
+			node->data = NULL;
+			node_obj->rn = NULL;
+			Py_DECREF(node_obj);
+			goto undo;
+		}
 	} else
 		node_obj = node->data;
 
 	self->gen_id++;
-	Py_XINCREF(node_obj);
+	return (node_obj);
+
+ undo:
+	/* Take the new prefix out again, so the tree matches the journal */
+	radix_remove(PICKRT(prefix, self), node);
+	if (hint != NULL)
+		*hint = NULL;
+	return (NULL);
+}
+
+/*
+ * Remove 'node' from the tree, detaching its RadixNode. If the deletion
+ * cannot be journalled the tree is left alone.
+ */
+static int
+delete_node(RadixObject *self, radix_node_t *node)
+{
+	RadixNodeObject *node_obj;
+
+	if (self->journal != NULL && radix_journal_append(self->journal,
+	    RADIX_JOURNAL_DELETE, node->prefix) != 0) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return (-1);
+	}
+	if (node->data != NULL) {
+		node_obj = node->data;
+		node_obj->rn = NULL;
+		Py_XDECREF(node_obj);
+	}
+	radix_remove(PICKRT(node->prefix, self), node);
+	self->gen_id++;
+	return (0);
+}
+
+static PyObject *
+create_add_node(RadixObject *self, prefix_t *prefix)
+{
+	RadixNodeObject *node_obj;
+
+	if ((node_obj = add_node(self, prefix, NULL)) == NULL)
+		return (NULL);
+	Py_INCREF(node_obj);
 	return (PyObject *)node_obj;
 }
 
+/*
+ * Bulk loading: prefixes that arrive in tree walk order are appended
+ * without a descent from the head of the tree. Out of order input is
+ * still accepted, it just takes the slow path.
+ */
+typedef struct {
+	RadixObject *tree;
+	radix_node_t *hint4, *hint6;
+} RadixLoader;
+
+static void
+loader_init(RadixLoader *ld, RadixObject *tree)
+{
+	ld->tree = tree;
+	ld->hint4 = ld->hint6 = NULL;
+}
+
+/*
+ * Returns a borrowed reference. If 'data' is not NULL or None it replaces
+ * .data; None stands for a data dict that was never used.
+ */
+static RadixNodeObject *
+loader_add(RadixLoader *ld, prefix_t *prefix, PyObject *data)
+{
+	RadixNodeObject *node_obj;
+
+	node_obj = add_node(ld->tree, prefix,
+	    prefix->family == AF_INET6 ? &ld->hint6 : &ld->hint4);
+	if (node_obj != NULL && data != NULL && data != Py_None) {
+		Py_INCREF(data);
+		Py_XDECREF(node_obj->user_attr);
+		node_obj->user_attr = data;
+		radix_hash_invalidate(node_obj->rn);
+	}
+	return (node_obj);
+}
+
 PyDoc_STRVAR(Radix_add_doc,
-"Radix.add(network[, masklen][, packed]) -> new RadixNode object\n\
+"Radix.add(network[, masklen][, packed][, family]) -> new RadixNode object\n\
 \n\
 Adds the network specified by 'network' and 'masklen' to the radix\n\
 tree. 'network' may be a string in CIDR format, a unicast host\n\
@@ -320,6 +864,11 @@ using the 'packed' keyword argument (instead of 'network'). This is\n\
 useful with binary addresses returned by socket.getpeername(),\n\
 socket.inet_ntoa(), etc.\n\
 \n\
+'network' may also be an integer (IPv4 if it fits in 32 bits, unless\n\
+the 'family' keyword says otherwise), an ipaddress address or network\n\
+object, or a packed address in a bytearray, memoryview or other\n\
+buffer object. The search and delete methods accept the same forms.\n\
+\n\
 Both IPv4 and IPv6 addresses/networks are supported and may be mixed in\n\
 the same tree.\n\
 \n\
@@ -327,26 +876,60 @@ This method returns a RadixNode object. Arbitrary data may be strored\n\
 in the RadixNode.data dict.");
 
 static PyObject *
-Radix_add(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_add(RadixObject *self, PREFIX_ARGS)
 {
-	prefix_t *prefix;
-	static char *keywords[] = { "network", "masklen", "packed", NULL };
-	PyObject *node_obj;
-
-	char *addr = NULL, *packed = NULL;
-	long prefixlen = -1;
-	int packlen = -1;
+	prefix_t prefix;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:add", keywords,
-	    &addr, &prefixlen, &packed, &packlen))
-		return NULL;
-	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+	if (GET_PREFIX_ARGS("add", &prefix) == NULL)
 		return NULL;
+	return create_add_node(self, &prefix);
+}
 
-	node_obj = create_add_node(self, prefix);
-	Deref_Prefix(prefix);
+PyDoc_STRVAR(Radix_allocate_doc,
+"Radix.allocate(pool, masklen[, strategy]) -> RadixNode or None\n\
+\n\
+Finds a free block of length 'masklen' in the network 'pool', one that\n\
+holds no prefix and is covered by no prefix longer than the pool, adds\n\
+it to the tree and returns its RadixNode. Returns None if the pool is\n\
+full. With 'strategy' 'first' (the default) the lowest free block is\n\
+taken; with 'best_fit' it is carved from the smallest free space it\n\
+fits in, keeping larger spaces whole. The nodes keep track of the free\n\
+space below them, so this takes time proportional to the tree depth.");
 
-	return node_obj;
+static PyObject *
+Radix_allocate(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "pool", "masklen", "strategy", NULL };
+	const char *strategy = "first";
+	PyObject *pool;
+	prefix_t prefix, block;
+	int masklen, best_fit;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "Oi|s:allocate",
+	    keywords, &pool, &masklen, &strategy))
+		return NULL;
+	if (strcmp(strategy, "first") == 0)
+		best_fit = 0;
+	else if (strcmp(strategy, "best_fit") == 0)
+		best_fit = 1;
+	else {
+		PyErr_SetString(PyExc_ValueError,
+		    "strategy must be 'first' or 'best_fit'");
+		return NULL;
+	}
+	if (object_to_prefix("allocate", pool, -1, 0, &prefix) == NULL)
+		return NULL;
+	if (masklen < (int)prefix.bitlen ||
+	    masklen > (prefix.family == AF_INET ? 32 : 128)) {
+		PyErr_SetString(PyExc_ValueError, "invalid masklen");
+		return NULL;
+	}
+	if (radix_allocate(PICKRT((&prefix), self), &prefix, masklen,
+	    best_fit, &block) != 0) {
+		Py_INCREF(Py_None);
+		return (Py_None);
+	}
+	return create_add_node(self, &block);
 }
 
 PyDoc_STRVAR(Radix_delete_doc,
@@ -355,39 +938,218 @@ PyDoc_STRVAR(Radix_delete_doc,
 Deletes the specified network from the radix tree.");
 
 static PyObject *
-Radix_delete(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_delete(RadixObject *self, PREFIX_ARGS)
 {
 	radix_node_t *node;
-	RadixNodeObject *node_obj;
-	prefix_t *prefix;
-	static char *keywords[] = { "network", "masklen", "packed", NULL };
-
-	char *addr = NULL, *packed = NULL;
-	long prefixlen = -1;
-	int packlen = -1;
+	prefix_t prefix;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:delete", keywords,
-	    &addr, &prefixlen, &packed, &packlen))
+	if (GET_PREFIX_ARGS("delete", &prefix) == NULL)
 		return NULL;
-	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
-		return NULL;
-	if ((node = radix_search_exact(PICKRT(prefix, self), prefix)) == NULL) {
-		Deref_Prefix(prefix);
+	if ((node = radix_search_exact(PICKRT((&prefix), self),
+	    &prefix)) == NULL) {
 		PyErr_SetString(PyExc_KeyError, "no such address");
 		return NULL;
 	}
-	if (node->data != NULL) {
-		node_obj = node->data;
-		node_obj->rn = NULL;
-		Py_XDECREF(node_obj);
+	if (delete_node(self, node) != 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* Bulk deletion: the prefixes are gathered first and removed together */
+
+struct prune_ctx {
+	RadixObject *tree;
+	unsigned int gen_id;	/* Detect changes made by the predicate */
+	PyObject *match;	/* Predicate, or tag looked for in .data */
+	radix_node_t **nodes;
+	RadixNodeObject **objs;	/* Set by prune_detach() */
+	size_t n, max;
+	int detached;
+};
+
+static int
+prune_append(struct prune_ctx *ctx, radix_node_t *node)
+{
+	radix_node_t **nodes;
+	RadixNodeObject **objs;
+	size_t max;
+
+	if (ctx->n == ctx->max) {
+		max = ctx->max == 0 ? 256 : ctx->max * 2;
+		if ((nodes = PyMem_Realloc(ctx->nodes,
+		    max * sizeof(*nodes))) == NULL) {
+			PyErr_NoMemory();
+			return (-1);
+		}
+		ctx->nodes = nodes;
+		if ((objs = PyMem_Realloc(ctx->objs,
+		    max * sizeof(*objs))) == NULL) {
+			PyErr_NoMemory();
+			return (-1);
+		}
+		ctx->objs = objs;
+		ctx->max = max;
 	}
+	ctx->nodes[ctx->n++] = node;
+	return (0);
+}
 
-	radix_remove(PICKRT(prefix, self), node);
-	Deref_Prefix(prefix);
+/*
+ * Journal the deletion of the gathered prefixes and detach their
+ * RadixNodes. The RadixNodes are only released by prune_free(), once the
+ * tree is back in order. If the deletions cannot be journalled nothing
+ * is detached and the tree must be left alone.
+ */
+static int
+prune_detach(struct prune_ctx *ctx)
+{
+	RadixObject *self = ctx->tree;
+	radix_node_t *node;
+	size_t i;
+
+	for (i = 0; self->journal != NULL && i < ctx->n; i++) {
+		if (radix_journal_append(self->journal, RADIX_JOURNAL_DELETE,
+		    ctx->nodes[i]->prefix) != 0) {
+			PyErr_SetFromErrno(PyExc_IOError);
+			return (-1);
+		}
+	}
+	for (i = 0; i < ctx->n; i++) {
+		node = ctx->nodes[i];
+		if ((ctx->objs[i] = node->data) != NULL)
+			ctx->objs[i]->rn = NULL;
+		node->data = NULL;
+	}
+	ctx->detached = 1;
+	return (0);
+}
+
+static void
+prune_free(struct prune_ctx *ctx)
+{
+	size_t i;
+
+	if (ctx->detached) {
+		for (i = 0; i < ctx->n; i++)
+			Py_XDECREF(ctx->objs[i]);
+	}
+	PyMem_Free(ctx->nodes);
+	PyMem_Free(ctx->objs);
+}
+
+/* Returns 1 if 'node' is to be pruned, 0 if not and -1 on error */
+static int
+prune_match(struct prune_ctx *ctx, radix_node_t *node)
+{
+	PyObject *res, *payload;
+	int r;
+
+	if (!PyCallable_Check(ctx->match)) {
+		payload = node_payload(node);
+		if (!PyDict_Check(payload))
+			return (0);
+		return (PyDict_Contains(payload, ctx->match));
+	}
+	if ((res = PyObject_CallFunctionObjArgs(ctx->match,
+	    (PyObject *)node->data, NULL)) == NULL)
+		return (-1);
+	r = PyObject_IsTrue(res);
+	Py_DECREF(res);
+	if (r >= 0 && ctx->gen_id != ctx->tree->gen_id) {
+		PyErr_SetString(PyExc_RuntimeWarning,
+		    "Radix tree modified during prune");
+		r = -1;
+	}
+	return (r);
+}
+
+PyDoc_STRVAR(Radix_delete_covered_doc,
+"Radix.delete_covered(network[, masklen][, packed]) -> int\n\
+\n\
+Deletes every prefix covered by (more specific than or equal to) the\n\
+specified network and returns how many were deleted. The subtree below\n\
+the network is unlinked from the tree at once and freed in one pass,\n\
+rather than taking the prefixes out one at a time.");
+
+static PyObject *
+Radix_delete_covered(RadixObject *self, PREFIX_ARGS)
+{
+	struct prune_ctx ctx;
+	radix_node_t *root, *node;
+	prefix_t prefix;
 
+	if (GET_PREFIX_ARGS("delete_covered", &prefix) == NULL)
+		return NULL;
+	root = radix_search_covered(PICKRT((&prefix), self), &prefix);
+	if (root == NULL)
+		return PyInt_FromLong(0);
+	memset(&ctx, '\0', sizeof(ctx));
+	ctx.tree = self;
+	RADIX_WALK(root, node) {
+		if (prune_append(&ctx, node) != 0) {
+			prune_free(&ctx);
+			return NULL;
+		}
+	} RADIX_WALK_END;
+	if (prune_detach(&ctx) != 0) {
+		prune_free(&ctx);
+		return NULL;
+	}
+	radix_remove_subtree(PICKRT((&prefix), self), root);
 	self->gen_id++;
-	Py_INCREF(Py_None);
-	return Py_None;
+	prune_free(&ctx);
+	return PyInt_FromLong((long)ctx.n);
+}
+
+PyDoc_STRVAR(Radix_prune_doc,
+"Radix.prune(predicate) -> int\n\
+\n\
+Deletes the prefixes whose RadixNode 'predicate' returns true for and\n\
+returns how many were deleted. If 'predicate' is not callable, it is a\n\
+tag: the prefixes whose data dict holds it as a key are deleted. All\n\
+the prefixes are chosen first, then the tree is tidied up in a single\n\
+post-order walk rather than after each deletion. The predicate must\n\
+not modify the tree.");
+
+static PyObject *
+Radix_prune(RadixObject *self, PyObject *match)
+{
+	struct prune_ctx ctx;
+	radix_node_t *node;
+	size_t n4;
+	int i, r;
+
+	memset(&ctx, '\0', sizeof(ctx));
+	ctx.tree = self;
+	ctx.gen_id = self->gen_id;
+	ctx.match = match;
+	n4 = 0;
+	for (i = 0; i < 2; i++) {
+		RADIX_WALK(i == 0 ? self->rt4->head : self->rt6->head, node) {
+			if ((r = prune_match(&ctx, node)) < 0 ||
+			    (r > 0 && prune_append(&ctx, node) != 0)) {
+				prune_free(&ctx);
+				return NULL;
+			}
+		} RADIX_WALK_END;
+		if (i == 0)
+			n4 = ctx.n;
+	}
+	if (ctx.n == 0) {
+		prune_free(&ctx);
+		return PyInt_FromLong(0);
+	}
+	if (prune_detach(&ctx) != 0) {
+		prune_free(&ctx);
+		return NULL;
+	}
+	radix_remove_many(self->rt4, ctx.nodes, n4);
+	radix_remove_many(self->rt6, ctx.nodes + n4, ctx.n - n4);
+	self->gen_id++;
+	prune_free(&ctx);
+	return PyInt_FromLong((long)ctx.n);
 }
 
 PyDoc_STRVAR(Radix_search_exact_doc,
@@ -400,30 +1162,20 @@ Radix.search_best method.\n\
 If no match is found, then this method returns None.");
 
 static PyObject *
-Radix_search_exact(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_search_exact(RadixObject *self, PREFIX_ARGS)
 {
 	radix_node_t *node;
 	RadixNodeObject *node_obj;
-	prefix_t *prefix;
-	static char *keywords[] = { "network", "masklen", "packed", NULL };
-
-	char *addr = NULL, *packed = NULL;
-	long prefixlen = -1;
-	int packlen = -1;
+	prefix_t prefix;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:search_exact", keywords,
-	    &addr, &prefixlen, &packed, &packlen))
-		return NULL;
-	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+	if (GET_PREFIX_ARGS("search_exact", &prefix) == NULL)
 		return NULL;
 
-	node = radix_search_exact(PICKRT(prefix, self), prefix);
+	node = radix_search_exact(PICKRT((&prefix), self), &prefix);
 	if (node == NULL || node->data == NULL) {
-		Deref_Prefix(prefix);
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
-	Deref_Prefix(prefix);
 	node_obj = node->data;
 	Py_XINCREF(node_obj);
 	return (PyObject *)node_obj;
@@ -440,263 +1192,3957 @@ specified 'prefix', much like a IP routing table lookup.\n\
 If no match is found, then returns None.");
 
 static PyObject *
-Radix_search_best(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_search_best(RadixObject *self, PREFIX_ARGS)
 {
 	radix_node_t *node;
 	RadixNodeObject *node_obj;
-	prefix_t *prefix;
-	static char *keywords[] = { "network", "masklen", "packed", NULL };
-
-	char *addr = NULL, *packed = NULL;
-	long prefixlen = -1;
-	int packlen = -1;
+	prefix_t prefix;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:search_best", keywords,
-	    &addr, &prefixlen, &packed, &packlen))
-		return NULL;
-	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+	if (GET_PREFIX_ARGS("search_best", &prefix) == NULL)
 		return NULL;
 
-	if ((node = radix_search_best(PICKRT(prefix, self), prefix)) == NULL || 
-	    node->data == NULL) {
-		Deref_Prefix(prefix);
+	node = radix_search_best(PICKRT((&prefix), self), &prefix);
+	if (node == NULL || node->data == NULL) {
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
-	Deref_Prefix(prefix);
 	node_obj = node->data;
 	Py_XINCREF(node_obj);
 	return (PyObject *)node_obj;
 }
 
-PyDoc_STRVAR(Radix_nodes_doc,
-"Radix.nodes(prefix) -> List of RadixNode\n\
+/* 'network in tree' is true if the network is present exactly */
+static int
+Radix_contains(RadixObject *self, PyObject *network)
+{
+	radix_node_t *node;
+	prefix_t prefix;
+
+	if (object_to_prefix("__contains__", network, -1, 0, &prefix) == NULL)
+		return (-1);
+	node = radix_search_exact(PICKRT((&prefix), self), &prefix);
+	return (node != NULL && node->data != NULL);
+}
+
+static Py_ssize_t
+Radix_length(RadixObject *self)
+{
+	return ((Py_ssize_t)self->rt4->num_prefixes + self->rt6->num_prefixes);
+}
+
+static PySequenceMethods Radix_as_sequence = {
+	(lenfunc)Radix_length,		/*sq_length*/
+	0,				/*sq_concat*/
+	0,				/*sq_repeat*/
+	0,				/*sq_item*/
+	0,				/*sq_slice*/
+	0,				/*sq_ass_item*/
+	0,				/*sq_ass_slice*/
+	(objobjproc)Radix_contains,	/*sq_contains*/
+};
+
+/*
+ * A lookup on one prefix for the batch methods, returning a new ref.
+ * 'ctx' carries state between the lookups of a batch, or is NULL.
+ */
+typedef PyObject *(*radix_lookup_fn)(RadixObject *, prefix_t *, void *);
+
+static PyObject *
+lookup_best(RadixObject *self, prefix_t *prefix, void *ctx)
+{
+	radix_node_t *node;
+	PyObject *ret;
+
+	node = radix_search_best(PICKRT(prefix, self), prefix);
+	ret = node != NULL && node->data != NULL ? node->data : Py_None;
+	Py_INCREF(ret);
+	return (ret);
+}
+
+static PyObject *
+lookup_worst(RadixObject *self, prefix_t *prefix, void *ctx)
+{
+	radix_node_t *node;
+	PyObject *ret;
+
+	node = radix_search_worst(PICKRT(prefix, self), prefix);
+	ret = node != NULL && node->data != NULL ? node->data : Py_None;
+	Py_INCREF(ret);
+	return (ret);
+}
+
+static PyObject *
+lookup_covering(RadixObject *self, prefix_t *prefix, void *ctx)
+{
+	radix_node_t *nodes[RADIX_MAXBITS + 1];
+	PyObject *ret;
+	int i, n;
+
+	n = radix_search_covering(PICKRT(prefix, self), prefix, nodes);
+	if ((ret = PyList_New(0)) == NULL)
+		return (NULL);
+	for (i = 0; i < n; i++) {
+		if (nodes[i]->data != NULL &&
+		    PyList_Append(ret, (PyObject *)nodes[i]->data) != 0) {
+			Py_DECREF(ret);
+			return (NULL);
+		}
+	}
+	return (ret);
+}
+
+/* Apply 'fn' to each address of 'networks', returning the results */
+static PyObject *
+lookup_many(RadixObject *self, const char *fname, PyObject *networks,
+    radix_lookup_fn fn, void *ctx)
+{
+	PyObject *iter, *item, *result, *ret;
+	prefix_t prefix;
+
+	if ((ret = PyList_New(0)) == NULL)
+		return (NULL);
+	if ((iter = PyObject_GetIter(networks)) == NULL) {
+		Py_DECREF(ret);
+		return (NULL);
+	}
+	while ((item = PyIter_Next(iter)) != NULL) {
+		result = NULL;
+		if (object_to_prefix(fname, item, -1, 0, &prefix) != NULL)
+			result = fn(self, &prefix, ctx);
+		Py_DECREF(item);
+		if (result == NULL || PyList_Append(ret, result) != 0) {
+			Py_XDECREF(result);
+			break;
+		}
+		Py_DECREF(result);
+	}
+	Py_DECREF(iter);
+	if (PyErr_Occurred()) {
+		Py_DECREF(ret);
+		return (NULL);
+	}
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_search_covering_doc,
+"Radix.search_covering(network[, masklen][, packed]) -> list of RadixNode\n\
 \n\
-Returns a list containing all the RadixNode objects that have been\n\
-entered into the tree. This list may be empty if no prefixes have\n\
-been entered.");
+Returns the RadixNodes of all prefixes covering (less specific than or\n\
+equal to) the specified network, from the longest to the shortest. An\n\
+exact match, if present, comes first. The nodes are collected in a\n\
+single descent of the tree.");
 
 static PyObject *
-Radix_nodes(RadixObject *self, PyObject *args)
+Radix_search_covering(RadixObject *self, PREFIX_ARGS)
+{
+	prefix_t prefix;
+
+	if (GET_PREFIX_ARGS("search_covering", &prefix) == NULL)
+		return NULL;
+	return lookup_covering(self, &prefix, NULL);
+}
+
+PyDoc_STRVAR(Radix_search_containing_doc,
+"Radix.search_containing(network[, masklen][, packed]) -> RadixNode or None\n\
+\n\
+Returns the longest prefix containing the specified network, not\n\
+counting an exact match: the second entry Radix.search_covering()\n\
+would return when the network itself is in the tree.");
+
+static PyObject *
+Radix_search_containing(RadixObject *self, PREFIX_ARGS)
+{
+	radix_node_t *node;
+	prefix_t prefix;
+
+	if (GET_PREFIX_ARGS("search_containing", &prefix) == NULL)
+		return NULL;
+	node = radix_search_containing(PICKRT((&prefix), self), &prefix);
+	if (node == NULL || node->data == NULL) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	Py_INCREF((PyObject *)node->data);
+	return (PyObject *)node->data;
+}
+
+PyDoc_STRVAR(Radix_search_worst_doc,
+"Radix.search_worst(network[, masklen][, packed]) -> RadixNode or None\n\
+\n\
+Returns the shortest prefix covering the specified network, the last\n\
+entry Radix.search_covering() would return.");
+
+static PyObject *
+Radix_search_worst(RadixObject *self, PREFIX_ARGS)
+{
+	prefix_t prefix;
+
+	if (GET_PREFIX_ARGS("search_worst", &prefix) == NULL)
+		return NULL;
+	return lookup_worst(self, &prefix, NULL);
+}
+
+PyDoc_STRVAR(Radix_search_best_many_doc,
+"Radix.search_best_many(networks) -> list\n\
+\n\
+Returns the result of Radix.search_best() for each network of the\n\
+iterable 'networks', in one call.");
+
+static PyObject *
+Radix_search_best_many(RadixObject *self, PyObject *networks)
+{
+	return lookup_many(self, "search_best_many", networks, lookup_best,
+	    NULL);
+}
+
+PyDoc_STRVAR(Radix_search_worst_many_doc,
+"Radix.search_worst_many(networks) -> list\n\
+\n\
+Returns the result of Radix.search_worst() for each network of the\n\
+iterable 'networks', in one call.");
+
+static PyObject *
+Radix_search_worst_many(RadixObject *self, PyObject *networks)
+{
+	return lookup_many(self, "search_worst_many", networks, lookup_worst,
+	    NULL);
+}
+
+PyDoc_STRVAR(Radix_search_covering_many_doc,
+"Radix.search_covering_many(networks) -> list of lists\n\
+\n\
+Returns the result of Radix.search_covering() for each network of the\n\
+iterable 'networks', in one call.");
+
+static PyObject *
+Radix_search_covering_many(RadixObject *self, PyObject *networks)
+{
+	return lookup_many(self, "search_covering_many", networks,
+	    lookup_covering, NULL);
+}
+
+/* State of a batch of neighbour lookups, whose prefixes must be sorted */
+struct neighbour_ctx {
+	radix_node_t *hint;	/* For radix_ceiling_sorted() */
+	unsigned int gen_id;	/* Drop the hint if the tree changes */
+	int started;
+	prefix_t last;		/* Previous prefix of the batch */
+};
+
+/* The first node holding a prefix >= 'prefix', or NULL */
+static radix_node_t *
+neighbour_ceiling(RadixObject *self, prefix_t *prefix,
+    struct neighbour_ctx *ctx)
+{
+	if (ctx == NULL)
+		return (radix_ceiling(PICKRT(prefix, self), prefix));
+	if (ctx->started && prefix_cmp(prefix, &ctx->last) < 0) {
+		PyErr_SetString(PyExc_ValueError, "networks must be sorted");
+		return (NULL);
+	}
+	if (!ctx->started || ctx->gen_id != self->gen_id)
+		ctx->hint = NULL;
+	ctx->started = 1;
+	ctx->gen_id = self->gen_id;
+	ctx->last = *prefix;
+	return (radix_ceiling_sorted(PICKRT(prefix, self), prefix,
+	    &ctx->hint));
+}
+
+static PyObject *
+lookup_next(RadixObject *self, prefix_t *prefix, void *ctx)
 {
 	radix_node_t *node;
 	PyObject *ret;
 
-	if (!PyArg_ParseTuple(args, ":nodes"))
+	node = neighbour_ceiling(self, prefix, ctx);
+	if (PyErr_Occurred())
+		return (NULL);
+	if (node != NULL && prefix_cmp(node->prefix, prefix) == 0)
+		node = radix_next(node);
+	if (node == NULL && prefix->family == AF_INET)
+		node = radix_first(self->rt6);
+	ret = node != NULL && node->data != NULL ? node->data : Py_None;
+	Py_INCREF(ret);
+	return (ret);
+}
+
+static PyObject *
+lookup_prev(RadixObject *self, prefix_t *prefix, void *ctx)
+{
+	radix_node_t *node;
+	PyObject *ret;
+
+	node = neighbour_ceiling(self, prefix, ctx);
+	if (PyErr_Occurred())
+		return (NULL);
+	if (node != NULL)
+		node = radix_prev(node);
+	else
+		node = radix_last(PICKRT(prefix, self));
+	if (node == NULL && prefix->family == AF_INET6)
+		node = radix_last(self->rt4);
+	ret = node != NULL && node->data != NULL ? node->data : Py_None;
+	Py_INCREF(ret);
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_next_prefix_doc,
+"Radix.next_prefix(network[, masklen][, packed]) -> RadixNode or None\n\
+\n\
+Returns the first prefix in the tree after the specified one, in\n\
+(address, masklen) order with IPv4 before IPv6. The specified prefix\n\
+need not be in the tree.");
+
+static PyObject *
+Radix_next_prefix(RadixObject *self, PREFIX_ARGS)
+{
+	prefix_t prefix;
+
+	if (GET_PREFIX_ARGS("next_prefix", &prefix) == NULL)
 		return NULL;
+	return lookup_next(self, &prefix, NULL);
+}
 
-	if ((ret = PyList_New(0)) == NULL)
+PyDoc_STRVAR(Radix_prev_prefix_doc,
+"Radix.prev_prefix(network[, masklen][, packed]) -> RadixNode or None\n\
+\n\
+Returns the last prefix in the tree before the specified one, in\n\
+(address, masklen) order with IPv4 before IPv6.");
+
+static PyObject *
+Radix_prev_prefix(RadixObject *self, PREFIX_ARGS)
+{
+	prefix_t prefix;
+
+	if (GET_PREFIX_ARGS("prev_prefix", &prefix) == NULL)
 		return NULL;
+	return lookup_prev(self, &prefix, NULL);
+}
 
-	RADIX_WALK(self->rt4->head, node) {
-		if (node->data != NULL)
-			PyList_Append(ret, (PyObject *)node->data);
-	} RADIX_WALK_END;
-	RADIX_WALK(self->rt6->head, node) {
-		if (node->data != NULL)
-			PyList_Append(ret, (PyObject *)node->data);
-	} RADIX_WALK_END;
+PyDoc_STRVAR(Radix_next_prefix_many_doc,
+"Radix.next_prefix_many(networks) -> list\n\
+\n\
+Returns the result of Radix.next_prefix() for each network of the\n\
+iterable 'networks', which must be sorted. Each lookup starts from the\n\
+previous result, so runs of nearby networks avoid descending the tree.");
+
+static PyObject *
+Radix_next_prefix_many(RadixObject *self, PyObject *networks)
+{
+	struct neighbour_ctx ctx;
+
+	memset(&ctx, '\0', sizeof(ctx));
+	return lookup_many(self, "next_prefix_many", networks, lookup_next,
+	    &ctx);
+}
+
+PyDoc_STRVAR(Radix_prev_prefix_many_doc,
+"Radix.prev_prefix_many(networks) -> list\n\
+\n\
+Returns the result of Radix.prev_prefix() for each network of the\n\
+sorted iterable 'networks', as for Radix.next_prefix_many().");
+
+static PyObject *
+Radix_prev_prefix_many(RadixObject *self, PyObject *networks)
+{
+	struct neighbour_ctx ctx;
+
+	memset(&ctx, '\0', sizeof(ctx));
+	return lookup_many(self, "prev_prefix_many", networks, lookup_prev,
+	    &ctx);
+}
+
+PyDoc_STRVAR(Radix_search_covered_doc,
+"Radix.search_covered(network[, masklen][, packed]) -> list of RadixNode\n\
+\n\
+Returns the RadixNodes of all prefixes covered by (more specific than\n\
+or equal to) the specified network, in tree order. Only the subtree\n\
+below the network is visited.");
+
+static PyObject *
+Radix_search_covered(RadixObject *self, PREFIX_ARGS)
+{
+	radix_node_t *root, *node;
+	prefix_t prefix;
+	PyObject *ret;
+
+	if (GET_PREFIX_ARGS("search_covered", &prefix) == NULL)
+		return NULL;
+	if ((ret = PyList_New(0)) == NULL)
+		return NULL;
+	root = radix_search_covered(PICKRT((&prefix), self), &prefix);
+	if (root == NULL)
+		return (ret);
+	RADIX_WALK(root, node) {
+		if (node->data != NULL &&
+		    PyList_Append(ret, (PyObject *)node->data) != 0) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+	} RADIX_WALK_END;
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_iter_covered_doc,
+"Radix.iter_covered(network[, masklen][, packed]) -> iterator\n\
+\n\
+Like Radix.search_covered(), but returns an iterator over the\n\
+RadixNodes. The tree must not be modified while iterating.");
+
+static PyObject *
+Radix_iter_covered(RadixObject *self, PREFIX_ARGS)
+{
+	prefix_t prefix;
+
+	if (GET_PREFIX_ARGS("iter_covered", &prefix) == NULL)
+		return NULL;
+	return (PyObject *)newRadixSubtreeIterObject(self,
+	    radix_search_covered(PICKRT((&prefix), self), &prefix));
+}
+
+PyDoc_STRVAR(Radix_count_covered_doc,
+"Radix.count_covered(network[, masklen][, packed]) -> int\n\
+\n\
+Returns the number of prefixes Radix.search_covered() would return.");
+
+static PyObject *
+Radix_count_covered(RadixObject *self, PREFIX_ARGS)
+{
+	radix_node_t *root;
+	prefix_t prefix;
+
+	if (GET_PREFIX_ARGS("count_covered", &prefix) == NULL)
+		return NULL;
+	root = radix_search_covered(PICKRT((&prefix), self), &prefix);
+	return PyInt_FromLong(root != NULL ? (long)root->count : 0);
+}
+
+PyDoc_STRVAR(Radix_rank_doc,
+"Radix.rank(network[, masklen][, packed]) -> int\n\
+\n\
+Returns the number of prefixes that sort before the specified one in\n\
+(address, masklen) order, IPv4 before IPv6: its index in an iteration\n\
+of the tree if present, otherwise the index it would have.");
+
+static PyObject *
+Radix_rank(RadixObject *self, PREFIX_ARGS)
+{
+	prefix_t prefix;
+	long rank;
+
+	if (GET_PREFIX_ARGS("rank", &prefix) == NULL)
+		return NULL;
+	rank = radix_rank(PICKRT((&prefix), self), &prefix);
+	if (prefix.family == AF_INET6)
+		rank += self->rt4->num_prefixes;
+	return PyInt_FromLong(rank);
+}
+
+PyDoc_STRVAR(Radix_select_doc,
+"Radix.select(index) -> RadixNode\n\
+\n\
+Returns the node at position 'index' of an iteration of the tree, in\n\
+time proportional to the depth of the tree. Negative indices count\n\
+from the end. Raises IndexError if 'index' is out of range.");
+
+static PyObject *
+Radix_select(RadixObject *self, PyObject *args)
+{
+	radix_node_t *node;
+	Py_ssize_t k;
+
+	if (!PyArg_ParseTuple(args, "n:select", &k))
+		return NULL;
+	if (k < 0)
+		k += Radix_length(self);
+	if (k < 0 || k >= Radix_length(self)) {
+		PyErr_SetString(PyExc_IndexError, "index out of range");
+		return NULL;
+	}
+	if (k < self->rt4->num_prefixes)
+		node = radix_select(self->rt4, k);
+	else
+		node = radix_select(self->rt6, k - self->rt4->num_prefixes);
+	Py_INCREF((PyObject *)node->data);
+	return (PyObject *)node->data;
+}
+
+PyDoc_STRVAR(Radix_num_prefixes_doc,
+"Radix.num_prefixes() -> int\n\
+\n\
+Returns the number of prefixes in the tree, as len(tree) does.");
+
+static PyObject *
+Radix_num_prefixes(RadixObject *self, PyObject *unused)
+{
+	return PyInt_FromLong(Radix_length(self));
+}
+
+/*
+ * Decode an address range: 'start' and 'end' may also be networks, in
+ * which case the range runs from the first address of 'start' to the
+ * last of 'end'. Returns the address family, or 0 on error.
+ */
+static int
+range_from_args(const char *fname, PyObject *start_obj, PyObject *end_obj,
+    u_char *start, u_char *end)
+{
+	prefix_t first, last;
+	u_int i, len, bits;
+
+	if (object_to_prefix(fname, start_obj, -1, 0, &first) == NULL ||
+	    object_to_prefix(fname, end_obj, -1, first.family, &last) == NULL)
+		return (0);
+	if (first.family != last.family) {
+		PyErr_SetString(PyExc_ValueError,
+		    "start and end must be of the same address family");
+		return (0);
+	}
+	len = first.family == AF_INET ? 4 : 16;
+	memcpy(start, &first.add, len);
+	memcpy(end, &last.add, len);
+	for (i = 0; i < len; i++) {
+		bits = i * 8;
+		if (first.bitlen < bits + 8)
+			start[i] &= first.bitlen > bits ?
+			    0xff << (8 - (first.bitlen - bits)) : 0;
+		if (last.bitlen < bits + 8)
+			end[i] |= last.bitlen > bits ?
+			    0xff >> (last.bitlen - bits) : 0xff;
+	}
+	if (memcmp(start, end, len) > 0) {
+		PyErr_SetString(PyExc_ValueError,
+		    "start must not be greater than end");
+		return (0);
+	}
+	return (first.family);
+}
+
+struct range_ctx {
+	PyObject *ret;
+	int error;
+};
+
+static void
+range_append(radix_node_t *node, void *cbctx)
+{
+	struct range_ctx *ctx = cbctx;
+
+	if (!ctx->error && node->data != NULL &&
+	    PyList_Append(ctx->ret, (PyObject *)node->data) != 0)
+		ctx->error = 1;
+}
+
+static PyObject *
+search_range(RadixObject *self, const char *fname, PyObject *start_obj,
+    PyObject *end_obj)
+{
+	struct range_ctx ctx;
+	u_char start[16], end[16];
+	int family;
+
+	if ((family = range_from_args(fname, start_obj, end_obj, start,
+	    end)) == 0)
+		return NULL;
+	if ((ctx.ret = PyList_New(0)) == NULL)
+		return NULL;
+	ctx.error = 0;
+	radix_search_range(family == AF_INET ? self->rt4 : self->rt6,
+	    start, end, range_append, &ctx);
+	if (ctx.error) {
+		Py_DECREF(ctx.ret);
+		return NULL;
+	}
+	return (ctx.ret);
+}
+
+PyDoc_STRVAR(Radix_search_range_doc,
+"Radix.search_range(start, end) -> list of RadixNode\n\
+\n\
+Returns the RadixNodes of all prefixes overlapping the address range\n\
+from 'start' to 'end' inclusive, which need not be aligned to a\n\
+prefix: those covering it, covered by it or partially overlapping it,\n\
+in (address, masklen) order. If 'start' or 'end' is a network, the\n\
+range extends to its first or last address respectively.");
+
+static PyObject *
+Radix_search_range(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "start", "end", NULL };
+	PyObject *start, *end;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "OO:search_range",
+	    keywords, &start, &end))
+		return NULL;
+	return search_range(self, "search_range", start, end);
+}
+
+PyDoc_STRVAR(Radix_search_range_many_doc,
+"Radix.search_range_many(ranges) -> list of lists\n\
+\n\
+Returns the result of Radix.search_range() for each (start, end) pair\n\
+of the iterable 'ranges', in one call.");
+
+static PyObject *
+Radix_search_range_many(RadixObject *self, PyObject *ranges)
+{
+	PyObject *iter, *item, *result, *ret;
+
+	if ((ret = PyList_New(0)) == NULL)
+		return NULL;
+	if ((iter = PyObject_GetIter(ranges)) == NULL) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+	while ((item = PyIter_Next(iter)) != NULL) {
+		result = NULL;
+		if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2)
+			PyErr_SetString(PyExc_TypeError,
+			    "ranges must be (start, end) tuples");
+		else
+			result = search_range(self, "search_range_many",
+			    PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1));
+		Py_DECREF(item);
+		if (result == NULL || PyList_Append(ret, result) != 0) {
+			Py_XDECREF(result);
+			break;
+		}
+		Py_DECREF(result);
+	}
+	Py_DECREF(iter);
+	if (PyErr_Occurred()) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+	return (ret);
+}
+
+struct add_range_ctx {
+	RadixLoader ld;
+	PyObject *data;
+	long n;
+};
+
+static int
+add_range_prefix(prefix_t *prefix, void *cbctx)
+{
+	struct add_range_ctx *ctx = cbctx;
+	PyObject *data;
+	int r;
+
+	/* Each prefix gets its own copy of a data dict */
+	data = ctx->data;
+	if (data != NULL && PyDict_CheckExact(data)) {
+		if ((data = PyDict_Copy(data)) == NULL)
+			return (-1);
+	} else
+		Py_XINCREF(data);
+	r = loader_add(&ctx->ld, prefix, data) == NULL ? -1 : 0;
+	Py_XDECREF(data);
+	ctx->n++;
+	return (r);
+}
+
+PyDoc_STRVAR(Radix_add_range_doc,
+"Radix.add_range(start, end[, data]) -> int\n\
+\n\
+Adds the shortest list of prefixes covering exactly the addresses from\n\
+'start' to 'end' inclusive, which need not be aligned to a prefix, and\n\
+returns how many there are. If 'start' or 'end' is a network, the range\n\
+extends to its first or last address respectively. If 'data' is given\n\
+each prefix gets a copy of it as its data dict. The prefixes are found\n\
+and inserted in order in one pass, without a descent of the tree for\n\
+each.");
+
+static PyObject *
+Radix_add_range(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "start", "end", "data", NULL };
+	PyObject *start_obj, *end_obj, *data = NULL;
+	struct add_range_ctx ctx;
+	u_char start[16], end[16];
+	int family;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "OO|O:add_range",
+	    keywords, &start_obj, &end_obj, &data))
+		return NULL;
+	if (data == Py_None)
+		data = NULL;
+	if ((family = range_from_args("add_range", start_obj, end_obj, start,
+	    end)) == 0)
+		return NULL;
+	loader_init(&ctx.ld, self);
+	ctx.data = data;
+	ctx.n = 0;
+	if (radix_range_prefixes(family, start, end, add_range_prefix,
+	    &ctx) != 0)
+		return NULL;
+	return PyInt_FromLong(ctx.n);
+}
+
+/* Append the ranges of 'rt' to 'ret' as (start, end) address strings */
+static int
+ranges_append(PyObject *ret, radix_tree_t *rt, int family)
+{
+	radix_ranges_t list;
+	prefix_t lo, hi;
+	char lo_buf[64], hi_buf[64];
+	PyObject *item;
+	size_t i;
+	int r = -1;
+
+	radix_ranges_init(&list, family);
+	if (radix_ranges_from_tree(&list, rt) != 0) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	for (i = 0; i < list.n; i++) {
+		prefix_from_blob2(list.ranges[i].lo, list.len, list.len * 8,
+		    &lo);
+		prefix_from_blob2(list.ranges[i].hi, list.len, list.len * 8,
+		    &hi);
+		prefix_addr_ntop(&lo, lo_buf, sizeof(lo_buf));
+		prefix_addr_ntop(&hi, hi_buf, sizeof(hi_buf));
+		if ((item = Py_BuildValue("(ss)", lo_buf, hi_buf)) == NULL)
+			goto out;
+		if (PyList_Append(ret, item) != 0) {
+			Py_DECREF(item);
+			goto out;
+		}
+		Py_DECREF(item);
+	}
+	r = 0;
+ out:
+	radix_ranges_free(&list);
+	return (r);
+}
+
+PyDoc_STRVAR(Radix_ranges_doc,
+"Radix.ranges([family]) -> list of (start, end) tuples\n\
+\n\
+Returns the addresses covered by the prefixes in the tree as a list of\n\
+disjoint ranges of addresses, in ascending order and with adjacent and\n\
+overlapping prefixes merged: IPv4 then IPv6, or only those of address\n\
+family 'family' (socket.AF_INET or socket.AF_INET6). The inverse of\n\
+Radix.add_range().");
+
+static PyObject *
+Radix_ranges(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "family", NULL };
+	PyObject *ret;
+	int af = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|i:ranges", keywords,
+	    &af))
+		return NULL;
+	if (af != 0 && af != AF_INET && af != AF_INET6) {
+		PyErr_SetString(PyExc_ValueError, "Unsupported address family");
+		return NULL;
+	}
+	if ((ret = PyList_New(0)) == NULL)
+		return NULL;
+	if ((af != AF_INET6 && ranges_append(ret, self->rt4, AF_INET) != 0) ||
+	    (af != AF_INET && ranges_append(ret, self->rt6, AF_INET6) != 0)) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+	return (ret);
+}
+
+/* Set algebra between trees */
+
+/* Add the prefix of 'node' to the loader's tree, with a copy of its data */
+static int
+setop_add(RadixLoader *ld, radix_node_t *node)
+{
+	PyObject *data;
+	int r;
+
+	data = node_payload(node);
+	if (PyDict_CheckExact(data))
+		data = PyDict_Copy(data);
+	else
+		Py_INCREF(data);
+	if (data == NULL)
+		return (-1);
+	r = loader_add(ld, node->prefix, data) == NULL ? -1 : 0;
+	Py_DECREF(data);
+	return (r);
+}
+
+static int
+setop_add_prefix(prefix_t *prefix, void *cbctx)
+{
+	return (loader_add(cbctx, prefix, NULL) == NULL ? -1 : 0);
+}
+
+/*
+ * Walk both trees in lock-step, as a merge of two sorted lists. Where
+ * only matches matter, the lagging walk seeks forward with
+ * radix_ceiling_sorted() and so skips the subtrees between matches.
+ */
+static int
+setop_exact(RadixLoader *ld, int op, radix_tree_t *ta, radix_tree_t *tb)
+{
+	radix_node_t *a, *b;
+	int c;
+
+	a = radix_first(ta);
+	b = radix_first(tb);
+	while (a != NULL || b != NULL) {
+		if (a == NULL)
+			c = 1;
+		else if (b == NULL)
+			c = -1;
+		else
+			c = prefix_cmp(a->prefix, b->prefix);
+		if (c == 0) {
+			if ((op == RADIX_SET_UNION ||
+			    op == RADIX_SET_INTERSECTION) &&
+			    setop_add(ld, a) != 0)
+				return (-1);
+			a = radix_next(a);
+			b = radix_next(b);
+		} else if (c < 0) {
+			if (op == RADIX_SET_INTERSECTION) {
+				if (b == NULL)
+					break;
+				a = radix_ceiling_sorted(ta, b->prefix, &a);
+				continue;
+			}
+			if (setop_add(ld, a) != 0)
+				return (-1);
+			a = radix_next(a);
+		} else {
+			if (op == RADIX_SET_UNION ||
+			    op == RADIX_SET_SYMMETRIC_DIFFERENCE) {
+				if (setop_add(ld, b) != 0)
+					return (-1);
+				b = radix_next(b);
+				continue;
+			}
+			if (a == NULL)
+				break;
+			b = radix_ceiling_sorted(tb, a->prefix, &b);
+		}
+	}
+	return (0);
+}
+
+/* Operate on the address space covered by the trees */
+static int
+setop_address(RadixLoader *ld, int op, radix_tree_t *ta, radix_tree_t *tb,
+    int family)
+{
+	radix_ranges_t a, b, out;
+	size_t i;
+	int r = -1;
+
+	radix_ranges_init(&a, family);
+	radix_ranges_init(&b, family);
+	radix_ranges_init(&out, family);
+	if (radix_ranges_from_tree(&a, ta) != 0 ||
+	    radix_ranges_from_tree(&b, tb) != 0 ||
+	    radix_ranges_op(op, &a, &b, &out) != 0) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	for (i = 0; i < out.n; i++) {
+		if (radix_range_prefixes(family, out.ranges[i].lo,
+		    out.ranges[i].hi, setop_add_prefix, ld) != 0)
+			goto out;
+	}
+	r = 0;
+ out:
+	radix_ranges_free(&a);
+	radix_ranges_free(&b);
+	radix_ranges_free(&out);
+	return (r);
+}
+
+static PyObject *
+Radix_setop(RadixObject *self, PyObject *args, PyObject *kw_args,
+    const char *format, int op)
+{
+	static char *keywords[] = { "other", "mode", NULL };
+	RadixObject *other, *ret;
+	const char *mode = "exact";
+	RadixLoader ld;
+	int address, r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, format, keywords,
+	    &Radix_Type, &other, &mode))
+		return NULL;
+	if (strcmp(mode, "exact") == 0)
+		address = 0;
+	else if (strcmp(mode, "address") == 0)
+		address = 1;
+	else {
+		PyErr_SetString(PyExc_ValueError,
+		    "mode must be 'exact' or 'address'");
+		return NULL;
+	}
+	if ((ret = newRadixObject()) == NULL)
+		return NULL;
+	loader_init(&ld, ret);
+	if (address)
+		r = setop_address(&ld, op, self->rt4, other->rt4, AF_INET) ||
+		    setop_address(&ld, op, self->rt6, other->rt6, AF_INET6);
+	else
+		r = setop_exact(&ld, op, self->rt4, other->rt4) ||
+		    setop_exact(&ld, op, self->rt6, other->rt6);
+	if (r != 0) {
+		Py_DECREF(ret);
+		return NULL;
+	}
+	return (PyObject *)ret;
+}
+
+PyDoc_STRVAR(Radix_union_doc,
+"Radix.union(other[, mode]) -> Radix\n\
+\n\
+Returns a new tree holding the prefixes of this tree or of 'other'.\n\
+With mode 'exact' (the default) prefixes are compared as they are and\n\
+keep a copy of their data, taken from this tree if both have them.\n\
+With mode 'address' the trees are treated as the sets of addresses\n\
+they cover, and the result is the shortest list of prefixes covering\n\
+the resulting set, without data. Both trees are walked in lock-step,\n\
+so the cost is linear in their sizes.");
+
+static PyObject *
+Radix_union(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	return Radix_setop(self, args, kw_args, "O!|s:union",
+	    RADIX_SET_UNION);
+}
+
+PyDoc_STRVAR(Radix_intersection_doc,
+"Radix.intersection(other[, mode]) -> Radix\n\
+\n\
+Returns a new tree holding the prefixes (or with mode 'address', the\n\
+addresses) present in both this tree and 'other'. See Radix.union().");
+
+static PyObject *
+Radix_intersection(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	return Radix_setop(self, args, kw_args, "O!|s:intersection",
+	    RADIX_SET_INTERSECTION);
+}
+
+PyDoc_STRVAR(Radix_difference_doc,
+"Radix.difference(other[, mode]) -> Radix\n\
+\n\
+Returns a new tree holding the prefixes (or with mode 'address', the\n\
+addresses) of this tree that are not in 'other'. See Radix.union().");
+
+static PyObject *
+Radix_difference(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	return Radix_setop(self, args, kw_args, "O!|s:difference",
+	    RADIX_SET_DIFFERENCE);
+}
+
+PyDoc_STRVAR(Radix_symmetric_difference_doc,
+"Radix.symmetric_difference(other[, mode]) -> Radix\n\
+\n\
+Returns a new tree holding the prefixes (or with mode 'address', the\n\
+addresses) in exactly one of this tree and 'other'. See Radix.union().");
+
+static PyObject *
+Radix_symmetric_difference(RadixObject *self, PyObject *args,
+    PyObject *kw_args)
+{
+	return Radix_setop(self, args, kw_args, "O!|s:symmetric_difference",
+	    RADIX_SET_SYMMETRIC_DIFFERENCE);
+}
+
+/* Merkle hashes of subtrees */
+
+struct hash_ctx {
+	RadixObject *tree;
+	unsigned int gen_id;	/* Detect changes made by the digest */
+	PyObject *digest;
+};
+
+/* Default payload digest: the repr of the sorted items of a data dict */
+static PyObject *
+hash_default_digest(PyObject *data)
+{
+	PyObject *items, *ret;
+
+	if (!PyDict_Check(data))
+		return PyObject_Repr(data);
+	if ((items = PyDict_Items(data)) == NULL)
+		return (NULL);
+	if (PyList_Sort(items) != 0) {
+		/* Keys that do not sort are taken in insertion order */
+		PyErr_Clear();
+		Py_DECREF(items);
+		return PyObject_Repr(data);
+	}
+	ret = PyObject_Repr(items);
+	Py_DECREF(items);
+	return (ret);
+}
+
+static int
+hash_payload(radix_node_t *node, u_int64_t *digest, void *cbctx)
+{
+	struct hash_ctx *ctx = cbctx;
+	PyObject *data, *obj, *bytes;
+
+	*digest = 0;
+	data = node_payload(node);
+	/* A data dict that was never used is the same as an empty one */
+	if (data == Py_None || (PyDict_Check(data) && PyDict_Size(data) == 0))
+		return (0);
+	if (ctx->digest != NULL)
+		obj = PyObject_CallFunctionObjArgs(ctx->digest, data, NULL);
+	else
+		obj = hash_default_digest(data);
+	if (obj == NULL)
+		return (-1);
+	if (PyUnicode_Check(obj))
+		bytes = PyUnicode_AsUTF8String(obj);
+	else if (PyBytes_Check(obj)) {
+		bytes = obj;
+		Py_INCREF(bytes);
+	} else {
+		PyErr_SetString(PyExc_TypeError,
+		    "digest must return bytes or str");
+		bytes = NULL;
+	}
+	Py_DECREF(obj);
+	if (bytes == NULL)
+		return (-1);
+	*digest = radix_hash_bytes(PyBytes_AS_STRING(bytes),
+	    PyBytes_GET_SIZE(bytes));
+	Py_DECREF(bytes);
+	if (ctx->gen_id != ctx->tree->gen_id ||
+	    ctx->digest != ctx->tree->hash_digest) {
+		PyErr_SetString(PyExc_RuntimeWarning,
+		    "Radix tree modified during hashing");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Switch to the payload digest 'digest' (NULL for the default), which
+ * makes every hash stale if it differs from the one in use.
+ */
+static int
+hash_set_digest(RadixObject *self, PyObject *digest)
+{
+	if (digest == Py_None)
+		digest = NULL;
+	if (digest != NULL && !PyCallable_Check(digest)) {
+		PyErr_SetString(PyExc_TypeError, "digest must be callable");
+		return (-1);
+	}
+	if (self->hashing && digest == self->hash_digest)
+		return (0);
+	radix_hash_clear(self->rt4);
+	radix_hash_clear(self->rt6);
+	Py_XINCREF(digest);
+	Py_XDECREF(self->hash_digest);
+	self->hash_digest = digest;
+	self->hashing = 1;
+	return (0);
+}
+
+/* Returns the up to date hash of the subtree of 'node' */
+static int
+hash_subtree(RadixObject *self, radix_node_t *node, u_int64_t *hash)
+{
+	struct hash_ctx ctx;
+	int r;
+
+	ctx.tree = self;
+	ctx.gen_id = self->gen_id;
+	ctx.digest = self->hash_digest;
+	Py_XINCREF(ctx.digest);
+	r = radix_hash(node, hash_payload, &ctx, hash);
+	Py_XDECREF(ctx.digest);
+	return (r);
+}
+
+PyDoc_STRVAR(Radix_root_hash_doc,
+"Radix.root_hash([digest]) -> int\n\
+\n\
+Returns a 64-bit hash of the prefixes in the tree and their payloads,\n\
+equal for trees holding the same prefixes with the same payloads, or 0\n\
+for an empty tree. Each node keeps the hash of its subtree, so after\n\
+the first call only the nodes on the paths to changed prefixes are\n\
+hashed again.\n\
+\n\
+A payload is hashed through the bytes or str that digest(data)\n\
+returns; by default the repr of the sorted items of the data dict. An\n\
+empty data dict has no digest. Payloads are taken to have changed when\n\
+fetched through RadixNode.data, so a data dict that is held on to and\n\
+changed later is missed.");
+
+static PyObject *
+Radix_root_hash(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "digest", NULL };
+	PyObject *digest = NULL;
+	u_int64_t h4, h6;
+	u_char buf[16];
+	int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|O:root_hash",
+	    keywords, &digest))
+		return NULL;
+	if (hash_set_digest(self, digest) != 0 ||
+	    hash_subtree(self, self->rt4->head, &h4) != 0 ||
+	    hash_subtree(self, self->rt6->head, &h6) != 0)
+		return NULL;
+	if (h4 == 0 && h6 == 0)
+		return PyLong_FromUnsignedLongLong(0);
+	for (i = 0; i < 8; i++) {
+		buf[i] = (h4 >> (i * 8)) & 0xff;
+		buf[8 + i] = (h6 >> (i * 8)) & 0xff;
+	}
+	return PyLong_FromUnsignedLongLong(radix_hash_bytes(buf, sizeof(buf)));
+}
+
+PyDoc_STRVAR(Radix_subtree_hash_doc,
+"Radix.subtree_hash(network[, masklen][, packed]) -> int\n\
+\n\
+Returns the hash of the prefixes covered by (or equal to) the one\n\
+specified, and their payloads, or 0 if there are none. Replicas can\n\
+find where they differ by comparing the hashes of ever smaller\n\
+networks. Uses the digest given to the last Radix.root_hash().");
+
+static PyObject *
+Radix_subtree_hash(RadixObject *self, PREFIX_ARGS)
+{
+	prefix_t prefix;
+	u_int64_t hash;
+
+	if (GET_PREFIX_ARGS("subtree_hash", &prefix) == NULL)
+		return NULL;
+	if (!self->hashing && hash_set_digest(self, NULL) != 0)
+		return NULL;
+	if (hash_subtree(self, radix_search_covered(PICKRT((&prefix), self),
+	    &prefix), &hash) != 0)
+		return NULL;
+	return PyLong_FromUnsignedLongLong(hash);
+}
+
+/* Differences between trees */
+
+struct diff_ctx {
+	RadixObject *a, *b;
+	unsigned int gen_a, gen_b;	/* Detect changes made by 'compare' */
+	PyObject *compare;	/* compare_payload callable, or NULL for == */
+	int payloads;		/* Zero if payloads are not compared */
+	int skip;		/* Skip subtrees with equal hashes */
+	PyObject *added, *removed, *changed;
+};
+
+/* Returns 1 if the payloads of 'a' and 'b' are equal, 0 if not, -1 on error */
+static int
+diff_equal(struct diff_ctx *ctx, radix_node_t *a, radix_node_t *b)
+{
+	PyObject *pa, *pb, *res;
+	int r;
+
+	pa = node_payload(a);
+	pb = node_payload(b);
+	if (pa == pb || !ctx->payloads)
+		return (1);
+	/* A data dict that was never used is the same as an empty one */
+	if (pa == Py_None || pb == Py_None) {
+		res = pa == Py_None ? pb : pa;
+		return (PyDict_Check(res) && PyDict_Size(res) == 0);
+	}
+	if (ctx->compare == NULL)
+		r = PyObject_RichCompareBool(pa, pb, Py_EQ);
+	else if ((res = PyObject_CallFunctionObjArgs(ctx->compare, pa, pb,
+	    NULL)) == NULL)
+		r = -1;
+	else {
+		r = PyObject_IsTrue(res);
+		Py_DECREF(res);
+	}
+	if (r >= 0 && (ctx->gen_a != ctx->a->gen_id ||
+	    ctx->gen_b != ctx->b->gen_id)) {
+		PyErr_SetString(PyExc_RuntimeWarning,
+		    "Radix tree modified during diff");
+		r = -1;
+	}
+	return (r);
+}
+
+static int
+diff_append(PyObject *list, radix_node_t *node)
+{
+	PyObject *prefix;
+
+	if ((prefix = node_prefix_str(node->data)) == NULL)
+		return (-1);
+	return (PyList_Append(list, prefix));
+}
+
+/*
+ * Walk both trees in lock-step, as a merge of two sorted lists. Only
+ * the prefixes present in both trees have their payloads compared, and
+ * a payload shared by both is taken to be unchanged without a compare.
+ * With subtree hashes, the walks jump over subtrees that hash the same.
+ */
+static int
+diff_tree(struct diff_ctx *ctx, radix_tree_t *ta, radix_tree_t *tb)
+{
+	radix_node_t *a, *b;
+	int c, r;
+
+	if (ta == tb)
+		return (0);
+	a = radix_first(ta);
+	b = radix_first(tb);
+	while (a != NULL || b != NULL) {
+		if (a == NULL)
+			c = 1;
+		else if (b == NULL)
+			c = -1;
+		else
+			c = prefix_cmp(a->prefix, b->prefix);
+		if (c == 0) {
+			if (ctx->skip && radix_hash_skip(&a, &b))
+				continue;
+			if ((r = diff_equal(ctx, a, b)) < 0 ||
+			    (r == 0 && diff_append(ctx->changed, a) != 0))
+				return (-1);
+			a = radix_next(a);
+			b = radix_next(b);
+		} else if (c < 0) {
+			if (diff_append(ctx->removed, a) != 0)
+				return (-1);
+			a = radix_next(a);
+		} else {
+			if (diff_append(ctx->added, b) != 0)
+				return (-1);
+			b = radix_next(b);
+		}
+	}
+	return (0);
+}
+
+PyDoc_STRVAR(Radix_diff_doc,
+"Radix.diff(other[, compare_payload]) -> (added, removed, changed)\n\
+\n\
+Compares this tree with 'other', a later version of it. Returns three\n\
+lists of prefix strings in (address, masklen) order: the prefixes only\n\
+in 'other', those only in this tree and those in both whose payloads\n\
+(the data dicts) differ. Payloads are compared with ==, or by calling\n\
+compare_payload(old, new); if compare_payload is False they are not\n\
+compared and 'changed' is empty.\n\
+\n\
+If both trees keep subtree hashes with the same digest (see\n\
+Radix.root_hash()) and payloads are compared with ==, subtrees that\n\
+hash the same are skipped, so the time taken grows with the number of\n\
+changes rather than the size of the trees.");
+
+static PyObject *
+Radix_diff(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "other", "compare_payload", NULL };
+	PyObject *compare = NULL, *ret = NULL;
+	struct diff_ctx ctx;
+	u_int64_t hash;
+
+	memset(&ctx, '\0', sizeof(ctx));
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "O!|O:diff", keywords,
+	    &Radix_Type, &ctx.b, &compare))
+		return NULL;
+	ctx.payloads = compare != Py_False;
+	if (compare == Py_None || compare == Py_False)
+		compare = NULL;
+	if (compare != NULL && !PyCallable_Check(compare)) {
+		PyErr_SetString(PyExc_TypeError,
+		    "compare_payload must be callable or False");
+		return NULL;
+	}
+	ctx.a = self;
+	ctx.gen_a = self->gen_id;
+	ctx.gen_b = ctx.b->gen_id;
+	ctx.compare = compare;
+	if (compare == NULL && ctx.payloads && self->hashing &&
+	    ctx.b->hashing && self->hash_digest == ctx.b->hash_digest) {
+		if (hash_subtree(self, self->rt4->head, &hash) != 0 ||
+		    hash_subtree(self, self->rt6->head, &hash) != 0 ||
+		    hash_subtree(ctx.b, ctx.b->rt4->head, &hash) != 0 ||
+		    hash_subtree(ctx.b, ctx.b->rt6->head, &hash) != 0)
+			return NULL;
+		ctx.skip = 1;
+	}
+	if ((ctx.added = PyList_New(0)) == NULL ||
+	    (ctx.removed = PyList_New(0)) == NULL ||
+	    (ctx.changed = PyList_New(0)) == NULL)
+		goto out;
+	if (diff_tree(&ctx, self->rt4, ctx.b->rt4) != 0 ||
+	    diff_tree(&ctx, self->rt6, ctx.b->rt6) != 0)
+		goto out;
+	ret = PyTuple_Pack(3, ctx.added, ctx.removed, ctx.changed);
+ out:
+	Py_XDECREF(ctx.added);
+	Py_XDECREF(ctx.removed);
+	Py_XDECREF(ctx.changed);
+	return (ret);
+}
+
+/* Aggregation: merging siblings and removing redundant prefixes */
+
+struct agg_entry {
+	prefix_t prefix;
+	PyObject *data;
+};
+
+struct agg_ctx {
+	RadixObject *tree;
+	unsigned int gen_id;	/* Detect changes made by 'equal' */
+	PyObject *equal;	/* payload_equal callable, or NULL for == */
+	PyObject *empty;	/* Stands in for data dicts never used */
+	u_int max_len;		/* Summarise to this length, or maxbits + 1 */
+	struct agg_entry *out;
+	size_t n, max;
+};
+
+#define AGG_MIXED	0
+#define AGG_UNIFORM	1
+
+/*
+ * Compare two values, where NULL stands for addresses outside every
+ * prefix. Returns 1 if equal, 0 if not and -1 on error.
+ */
+static int
+agg_equal(struct agg_ctx *ctx, PyObject *a, PyObject *b)
+{
+	PyObject *res;
+	int r;
+
+	if (a == b)
+		return (1);
+	if (a == NULL || b == NULL)
+		return (0);
+	if (ctx->equal == NULL)
+		r = PyObject_RichCompareBool(a, b, Py_EQ);
+	else if ((res = PyObject_CallFunctionObjArgs(ctx->equal, a, b,
+	    NULL)) == NULL)
+		r = -1;
+	else {
+		r = PyObject_IsTrue(res);
+		Py_DECREF(res);
+	}
+	if (r >= 0 && ctx->gen_id != ctx->tree->gen_id) {
+		PyErr_SetString(PyExc_RuntimeWarning,
+		    "Radix tree modified during aggregation");
+		r = -1;
+	}
+	return (r);
+}
+
+/* Output the region of length 'bitlen' leading to 'node' with 'data' */
+static int
+agg_emit(struct agg_ctx *ctx, radix_node_t *node, u_int bitlen,
+    PyObject *data)
+{
+	struct agg_entry *tmp;
+	size_t max;
+
+	if (ctx->n == ctx->max) {
+		max = ctx->max == 0 ? 256 : ctx->max * 2;
+		if ((tmp = PyMem_Realloc(ctx->out, max * sizeof(*tmp))) ==
+		    NULL) {
+			PyErr_NoMemory();
+			return (-1);
+		}
+		ctx->out = tmp;
+		ctx->max = max;
+	}
+	prefix_supernet(radix_node_key(node), bitlen,
+	    &ctx->out[ctx->n].prefix);
+	Py_INCREF(data);
+	ctx->out[ctx->n++].data = data;
+	return (0);
+}
+
+/* Drop the output after 'mark' */
+static void
+agg_truncate(struct agg_ctx *ctx, size_t mark)
+{
+	while (ctx->n > mark)
+		Py_DECREF(ctx->out[--ctx->n].data);
+}
+
+/* The payload of 'node', with an empty dict for one never used */
+static PyObject *
+agg_payload(struct agg_ctx *ctx, radix_node_t *node)
+{
+	PyObject *data = node_payload(node);
+
+	return (data == Py_None ? ctx->empty : data);
+}
+
+/*
+ * Whether every prefix in the subtree of 'node' has the same payload,
+ * returned in '*value'. Returns 1 if so, 0 if not and -1 on error.
+ */
+static int
+agg_blur(struct agg_ctx *ctx, radix_node_t *node, PyObject **value)
+{
+	radix_node_t *rn;
+	PyObject *data;
+	int r;
+
+	*value = NULL;
+	RADIX_WALK(node, rn) {
+		data = agg_payload(ctx, rn);
+		if (*value == NULL)
+			*value = data;
+		else if ((r = agg_equal(ctx, *value, data)) != 1)
+			return (r);
+	} RADIX_WALK_END;
+	return (1);
+}
+
+/*
+ * Post-order walk. 'fill' is the value the nearest prefix above 'node'
+ * gives to the addresses below it. The output for the subtree is what
+ * it would be if no merging happened above; when the region of 'node'
+ * turns out to hold a single value ('*value', for the region of length
+ * '*depth'), the caller may replace it wholesale. Returns AGG_UNIFORM,
+ * AGG_MIXED or -1 on error.
+ */
+static int
+agg_walk(struct agg_ctx *ctx, radix_node_t *node, PyObject *fill,
+    PyObject **value, u_int *depth)
+{
+	radix_node_t *child[2];
+	PyObject *own, *inherit = fill, *v[2];
+	size_t mark = ctx->n;
+	u_int d;
+	int i, r, s[2];
+
+	/* Widen the region at max_len if it holds a single payload */
+	if (node->bit >= ctx->max_len &&
+	    (node->parent == NULL || node->parent->bit < ctx->max_len)) {
+		if ((r = agg_blur(ctx, node, value)) < 0)
+			return (-1);
+		if (r == 1) {
+			*depth = ctx->max_len;
+			if ((r = agg_equal(ctx, *value, fill)) < 0 ||
+			    (r == 0 && agg_emit(ctx, node, ctx->max_len,
+			    *value) != 0))
+				return (-1);
+			return (AGG_UNIFORM);
+		}
+	}
+
+	own = node->prefix != NULL ? agg_payload(ctx, node) : NULL;
+	if (own != NULL) {
+		if ((r = agg_equal(ctx, own, fill)) < 0 ||
+		    (r == 0 && agg_emit(ctx, node, node->bit, own) != 0))
+			return (-1);
+		fill = own;
+	}
+
+	child[0] = node->l;
+	child[1] = node->r;
+	for (i = 0; i < 2; i++) {
+		v[i] = fill;
+		s[i] = AGG_UNIFORM;
+		if (child[i] == NULL)
+			continue;
+		if ((s[i] = agg_walk(ctx, child[i], fill, &v[i], &d)) < 0)
+			return (-1);
+		/* A deeper uniform region leaves the rest of the half */
+		if (s[i] == AGG_UNIFORM && d != node->bit + 1) {
+			if ((r = agg_equal(ctx, v[i], fill)) < 0)
+				return (-1);
+			if (r == 0)
+				s[i] = AGG_MIXED;
+		}
+	}
+	if (s[0] != AGG_UNIFORM || s[1] != AGG_UNIFORM)
+		return (AGG_MIXED);
+	if ((r = agg_equal(ctx, v[0], v[1])) != 1)
+		return (r < 0 ? -1 : AGG_MIXED);
+
+	/* Both halves hold the same value: replace the subtree's output */
+	agg_truncate(ctx, mark);
+	*value = v[0];
+	*depth = node->bit;
+	if ((r = agg_equal(ctx, v[0], inherit)) < 0 ||
+	    (r == 0 && agg_emit(ctx, node, node->bit, v[0]) != 0))
+		return (-1);
+	return (AGG_UNIFORM);
+}
+
+/* Parse a max_len argument: None, an int or an (IPv4, IPv6) pair */
+static int
+agg_max_len(PyObject *arg, u_int *max4, u_int *max6)
+{
+	long m4, m6;
+
+	*max4 = 33;
+	*max6 = 129;
+	if (arg == NULL || arg == Py_None)
+		return (0);
+	if (PyTuple_Check(arg)) {
+		if (!PyArg_ParseTuple(arg, "ll:aggregate", &m4, &m6))
+			return (-1);
+	} else {
+		if ((m4 = PyLong_AsLong(arg)) == -1 && PyErr_Occurred())
+			return (-1);
+		m6 = m4;
+	}
+	if (m4 < 0 || m6 < 0 || (PyTuple_Check(arg) && m4 > 32) ||
+	    m6 > 128) {
+		PyErr_SetString(PyExc_ValueError, "invalid max_len");
+		return (-1);
+	}
+	*max4 = m4 > 32 ? 33 : m4;
+	*max6 = m6;
+	return (0);
+}
+
+PyDoc_STRVAR(Radix_aggregate_doc,
+"Radix.aggregate([max_len][, payload_equal]) -> Radix\n\
+\n\
+Returns a new tree with the same longest-match results using fewer\n\
+prefixes: prefixes covered by one with an equal payload are dropped\n\
+and sibling prefixes with equal payloads are merged into their parent,\n\
+repeatedly. Addresses outside every prefix stay outside.\n\
+\n\
+If 'max_len' is given (an int, or a pair of IPv4 and IPv6 lengths),\n\
+prefixes longer than it are also summarised to that length, covering\n\
+the whole of the shorter prefix, wherever all the prefixes inside it\n\
+have equal payloads.\n\
+\n\
+Payloads (the data dicts) are compared with ==, or by calling\n\
+payload_equal(a, b). The new prefixes get a copy of the payload.");
+
+static PyObject *
+Radix_aggregate(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "max_len", "payload_equal", NULL };
+	PyObject *max_len = NULL, *equal = NULL, *data;
+	RadixObject *ret = NULL;
+	struct agg_ctx ctx;
+	radix_tree_t *rt[2];
+	RadixLoader ld;
+	PyObject *value;
+	u_int max[2], depth;
+	size_t i;
+	int t;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|OO:aggregate",
+	    keywords, &max_len, &equal))
+		return NULL;
+	if (agg_max_len(max_len, &max[0], &max[1]) != 0)
+		return NULL;
+	if (equal == Py_None)
+		equal = NULL;
+	if (equal != NULL && !PyCallable_Check(equal)) {
+		PyErr_SetString(PyExc_TypeError,
+		    "payload_equal must be callable");
+		return NULL;
+	}
+
+	memset(&ctx, '\0', sizeof(ctx));
+	ctx.tree = self;
+	ctx.gen_id = self->gen_id;
+	ctx.equal = equal;
+	if ((ctx.empty = PyDict_New()) == NULL)
+		return NULL;
+	rt[0] = self->rt4;
+	rt[1] = self->rt6;
+	for (t = 0; t < 2; t++) {
+		ctx.max_len = max[t];
+		if (rt[t]->head != NULL && agg_walk(&ctx, rt[t]->head, NULL,
+		    &value, &depth) < 0)
+			goto out;
+	}
+
+	if ((ret = newRadixObject()) == NULL)
+		goto out;
+	loader_init(&ld, ret);
+	for (i = 0; i < ctx.n; i++) {
+		data = ctx.out[i].data;
+		data = PyDict_CheckExact(data) ? PyDict_Copy(data) : data;
+		if (data == NULL || loader_add(&ld, &ctx.out[i].prefix,
+		    data) == NULL) {
+			if (data != ctx.out[i].data)
+				Py_XDECREF(data);
+			Py_CLEAR(ret);
+			goto out;
+		}
+		if (data != ctx.out[i].data)
+			Py_DECREF(data);
+	}
+ out:
+	agg_truncate(&ctx, 0);
+	PyMem_Free(ctx.out);
+	Py_DECREF(ctx.empty);
+	return (PyObject *)ret;
+}
+
+/*
+ * FIB compression with the Optimal Routing Table Constructor (Draves et
+ * al., 1999). Payloads are mapped to next-hop ids, 0 standing for
+ * addresses outside every prefix. The tree is treated as the complete
+ * binary trie ORTC works on: the levels a node skips and its missing
+ * children are implicit nodes, handled arithmetically.
+ *
+ * Addresses without a route must stay without one, so a region holding
+ * any of them gets the set {0} and no route may cover it. Within that
+ * constraint the result is minimal.
+ */
+
+struct ortc_set {
+	u_int *ids;		/* Sorted candidate next-hops */
+	u_int n;
+	u_int own;		/* Next-hop of the node's prefix, or 0 */
+};
+
+struct ortc_ctx {
+	RadixObject *tree;
+	unsigned int gen_id;	/* Detect changes made by 'key' */
+	PyObject *key;		/* key callable, or NULL */
+	PyObject *empty;	/* Stands in for data dicts never used */
+	PyObject *ids;		/* key -> next-hop id */
+	PyObject *payloads;	/* payload of next-hop id i at i - 1 */
+	struct ortc_set *sets;	/* Per tree node, in walk order */
+	size_t idx;
+	u_int maxbits;
+	RadixLoader ld;
+};
+
+static int
+ortc_set_one(struct ortc_set *set, u_int id)
+{
+	if ((set->ids = PyMem_Malloc(sizeof(*set->ids))) == NULL) {
+		PyErr_NoMemory();
+		return (-1);
+	}
+	set->ids[0] = id;
+	set->n = 1;
+	return (0);
+}
+
+static int
+ortc_set_has(struct ortc_set *set, u_int id)
+{
+	u_int lo = 0, hi = set->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (set->ids[mid] == id)
+			return (1);
+		if (set->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (0);
+}
+
+/* ORTC pass 2: the intersection of the sets if not empty, else the union */
+static int
+ortc_set_combine(struct ortc_set *a, struct ortc_set *b,
+    struct ortc_set *out)
+{
+	u_int i, j, n;
+
+	if ((a->n == 1 && a->ids[0] == 0) || (b->n == 1 && b->ids[0] == 0))
+		return (ortc_set_one(out, 0));
+	if ((out->ids = PyMem_Malloc((a->n + b->n) *
+	    sizeof(*out->ids))) == NULL) {
+		PyErr_NoMemory();
+		return (-1);
+	}
+	for (i = j = n = 0; i < a->n && j < b->n; ) {
+		if (a->ids[i] == b->ids[j]) {
+			out->ids[n++] = a->ids[i];
+			i++;
+			j++;
+		} else if (a->ids[i] < b->ids[j])
+			i++;
+		else
+			j++;
+	}
+	if (n == 0) {
+		for (i = j = 0; i < a->n || j < b->n; ) {
+			if (j == b->n || (i < a->n && a->ids[i] < b->ids[j]))
+				out->ids[n++] = a->ids[i++];
+			else if (i == a->n || b->ids[j] < a->ids[i])
+				out->ids[n++] = b->ids[j++];
+			else {
+				out->ids[n++] = a->ids[i++];
+				j++;
+			}
+		}
+	}
+	out->n = n;
+	return (0);
+}
+
+/* The next-hop id of the payload of 'node' */
+static int
+ortc_id(struct ortc_ctx *ctx, radix_node_t *node, u_int *id)
+{
+	PyObject *data, *key, *items, *value;
+
+	if ((data = node_payload(node)) == Py_None)
+		data = ctx->empty;
+	if (ctx->key != NULL)
+		key = PyObject_CallFunctionObjArgs(ctx->key, data, NULL);
+	else if (PyDict_Check(data)) {
+		if ((items = PyDict_Items(data)) == NULL)
+			return (-1);
+		key = PyFrozenSet_New(items);
+		Py_DECREF(items);
+	} else {
+		Py_INCREF(data);
+		key = data;
+	}
+	if (key == NULL)
+		return (-1);
+	if (ctx->gen_id != ctx->tree->gen_id) {
+		PyErr_SetString(PyExc_RuntimeWarning,
+		    "Radix tree modified during compression");
+		Py_DECREF(key);
+		return (-1);
+	}
+#if PY_MAJOR_VERSION >= 3
+	value = PyDict_GetItemWithError(ctx->ids, key);
+#else
+	value = PyDict_GetItem(ctx->ids, key);
+#endif
+	if (value != NULL) {
+		*id = PyLong_AsLong(value);
+		Py_DECREF(key);
+		return (0);
+	}
+	*id = PyList_GET_SIZE(ctx->payloads) + 1;
+	if (PyErr_Occurred() || PyList_Append(ctx->payloads, data) != 0 ||
+	    (value = PyLong_FromLong(*id)) == NULL) {
+		Py_DECREF(key);
+		return (-1);
+	}
+	if (PyDict_SetItem(ctx->ids, key, value) != 0)
+		*id = 0;
+	Py_DECREF(value);
+	Py_DECREF(key);
+	return (*id == 0 ? -1 : 0);
+}
+
+/*
+ * The set of the implicit node just above 'child', when 'levels' levels
+ * are skipped between it and its parent. Each skipped level pairs the
+ * path with an empty sibling whose set is {fill}.
+ */
+static int
+ortc_gap_set(struct ortc_set *cs, u_int levels, u_int fill,
+    struct ortc_set *out)
+{
+	struct ortc_set leaf;
+	int r;
+
+	if (fill == 0 || levels > 1 || ortc_set_has(cs, fill))
+		return (ortc_set_one(out, fill));
+	if (ortc_set_one(&leaf, fill) != 0)
+		return (-1);
+	r = ortc_set_combine(cs, &leaf, out);
+	PyMem_Free(leaf.ids);
+	return (r);
+}
+
+/* ORTC passes 1 and 2, post-order: the candidate sets of the nodes */
+static int
+ortc_sets(struct ortc_ctx *ctx, radix_node_t *node, u_int fill,
+    struct ortc_set **setp)
+{
+	struct ortc_set *set, *cs, tmp[2], *half[2];
+	radix_node_t *child;
+	u_int levels;
+	int i, r = 0;
+
+	*setp = set = &ctx->sets[ctx->idx++];
+	set->own = 0;
+	if (node->prefix != NULL) {
+		if (ortc_id(ctx, node, &set->own) != 0)
+			return (-1);
+		fill = set->own;
+	}
+	tmp[0].ids = tmp[1].ids = NULL;
+	for (i = 0; i < 2 && r == 0; i++) {
+		child = i ? node->r : node->l;
+		half[i] = &tmp[i];
+		if (child == NULL)
+			r = ortc_set_one(&tmp[i], fill);
+		else if ((r = ortc_sets(ctx, child, fill, &cs)) != 0)
+			break;
+		else if ((levels = child->bit - node->bit - 1) == 0)
+			half[i] = cs;
+		else
+			r = ortc_gap_set(cs, levels, fill, &tmp[i]);
+	}
+	if (r == 0)
+		r = ortc_set_combine(half[0], half[1], set);
+	PyMem_Free(tmp[0].ids);
+	PyMem_Free(tmp[1].ids);
+	return (r);
+}
+
+/*
+ * Add the region of length 'bitlen' leading to 'node', with next-hop
+ * 'id'. If 'last' is 0 or 1 the final bit of the region is set to it.
+ */
+static int
+ortc_add(struct ortc_ctx *ctx, radix_node_t *node, u_int bitlen, int last,
+    u_int id)
+{
+	prefix_t prefix;
+	PyObject *payload, *data;
+	u_char *addr;
+	u_int bit = bitlen - 1;
+	int r;
+
+	prefix_supernet(radix_node_key(node), bitlen, &prefix);
+	addr = (u_char *)&prefix.add;
+	if (last == 0)
+		addr[bit >> 3] &= ~(0x80 >> (bit & 0x07));
+	else if (last == 1)
+		addr[bit >> 3] |= 0x80 >> (bit & 0x07);
+	payload = PyList_GET_ITEM(ctx->payloads, id - 1);
+	if (PyDict_CheckExact(payload)) {
+		if ((data = PyDict_Copy(payload)) == NULL)
+			return (-1);
+	} else {
+		Py_INCREF(payload);
+		data = payload;
+	}
+	r = loader_add(&ctx->ld, &prefix, data) == NULL ? -1 : 0;
+	Py_DECREF(data);
+	return (r);
+}
+
+/*
+ * ORTC pass 3, pre-order: 'inherit' is the next-hop the output gives the
+ * region of 'node' from above and 'fill' the one the input gives it. A
+ * node keeps 'inherit' if it is a candidate, else takes its first one.
+ */
+static int
+ortc_emit(struct ortc_ctx *ctx, radix_node_t *node, u_int fill,
+    u_int inherit)
+{
+	struct ortc_set *set = &ctx->sets[ctx->idx++], gap;
+	radix_node_t *child;
+	u_char *addr;
+	u_int hop, cur, levels, bit;
+	int i, r, side;
+
+	if (set->own != 0)
+		fill = set->own;
+	hop = inherit;
+	if (!ortc_set_has(set, inherit)) {
+		hop = set->ids[0];
+		if (ortc_add(ctx, node, node->bit, -1, hop) != 0)
+			return (-1);
+	}
+	for (i = 0; i < 2; i++) {
+		child = i ? node->r : node->l;
+		if (child == NULL) {
+			/* A missing half is a leaf holding 'fill' */
+			if (hop != fill && node->bit < ctx->maxbits &&
+			    ortc_add(ctx, node, node->bit + 1, i, fill) != 0)
+				return (-1);
+			continue;
+		}
+		cur = hop;
+		side = -1;
+		if ((levels = child->bit - node->bit - 1) > 0) {
+			/* The topmost skipped level, when not the last */
+			if (levels > 1 && cur != fill) {
+				if (ortc_add(ctx, child, node->bit + 1, -1,
+				    fill) != 0)
+					return (-1);
+				cur = fill;
+			}
+			/* The level just above the child */
+			if (ortc_gap_set(&ctx->sets[ctx->idx], 1, fill,
+			    &gap) != 0)
+				return (-1);
+			r = 0;
+			if (!ortc_set_has(&gap, cur)) {
+				cur = gap.ids[0];
+				r = ortc_add(ctx, child, child->bit - 1, -1,
+				    cur);
+			}
+			PyMem_Free(gap.ids);
+			if (r != 0)
+				return (-1);
+			/* The child's empty sibling holds 'fill' */
+			if (cur != fill) {
+				bit = child->bit - 1;
+				addr = (u_char *)&radix_node_key(child)->add;
+				side = !(addr[bit >> 3] & (0x80 >> (bit & 0x07)));
+			}
+		}
+		if (side == 0 &&
+		    ortc_add(ctx, child, child->bit, side, fill) != 0)
+			return (-1);
+		if (ortc_emit(ctx, child, fill, cur) != 0)
+			return (-1);
+		if (side == 1 &&
+		    ortc_add(ctx, child, child->bit, side, fill) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+PyDoc_STRVAR(Radix_compress_fib_doc,
+"Radix.compress_fib([key]) -> Radix\n\
+\n\
+Returns a new tree with the fewest prefixes that gives the same\n\
+Radix.search_best() results as this one for every address, using the\n\
+Optimal Routing Table Constructor. Prefixes are considered to have the\n\
+same next-hop when key(data) is equal; by default the data dicts are\n\
+compared by their items, which must be hashable. Addresses outside\n\
+every prefix stay outside. The new prefixes get a copy of the data of\n\
+a prefix with their next-hop.");
+
+static PyObject *
+Radix_compress_fib(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "key", NULL };
+	struct ortc_set *set;
+	struct ortc_ctx ctx;
+	radix_tree_t *rt[2];
+	RadixObject *ret = NULL;
+	PyObject *key = NULL;
+	size_t i, n;
+	int t;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|O:compress_fib",
+	    keywords, &key))
+		return NULL;
+	memset(&ctx, '\0', sizeof(ctx));
+	ctx.tree = self;
+	ctx.gen_id = self->gen_id;
+	ctx.key = key == Py_None ? NULL : key;
+	rt[0] = self->rt4;
+	rt[1] = self->rt6;
+	n = (size_t)rt[0]->num_active_node + rt[1]->num_active_node;
+	if ((ctx.ids = PyDict_New()) == NULL ||
+	    (ctx.empty = PyDict_New()) == NULL ||
+	    (ctx.payloads = PyList_New(0)) == NULL ||
+	    (ret = newRadixObject()) == NULL)
+		goto out;
+	if ((ctx.sets = PyMem_Malloc((n + 1) * sizeof(*ctx.sets))) == NULL) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+	loader_init(&ctx.ld, ret);
+	for (t = 0; t < 2; t++) {
+		if (rt[t]->head == NULL)
+			continue;
+		ctx.maxbits = rt[t]->maxbits;
+		ctx.idx = 0;
+		if (ortc_sets(&ctx, rt[t]->head, 0, &set) != 0) {
+			n = ctx.idx;
+			goto fail;
+		}
+		n = ctx.idx;
+		ctx.idx = 0;
+		if (ortc_emit(&ctx, rt[t]->head, 0, 0) != 0)
+			goto fail;
+		for (i = 0; i < n; i++)
+			PyMem_Free(ctx.sets[i].ids);
+	}
+	goto out;
+ fail:
+	for (i = 0; i < n && ctx.sets != NULL; i++)
+		PyMem_Free(ctx.sets[i].ids);
+	Py_CLEAR(ret);
+ out:
+	PyMem_Free(ctx.sets);
+	Py_XDECREF(ctx.ids);
+	Py_XDECREF(ctx.empty);
+	Py_XDECREF(ctx.payloads);
+	return (PyObject *)ret;
+}
+
+/* Address space outside every prefix */
+
+struct complement_ctx {
+	RadixLoader ld;		/* Unless 'packed' */
+	int packed;
+	u_char *buf;		/* prefix_pack() records */
+	size_t len, max;
+};
+
+static int
+complement_add(prefix_t *prefix, void *cbctx)
+{
+	struct complement_ctx *ctx = cbctx;
+	u_char *tmp;
+	size_t max;
+
+	if (!ctx->packed)
+		return (loader_add(&ctx->ld, prefix, NULL) == NULL ? -1 : 0);
+	if (ctx->len + PREFIX_PACKED_MAX > ctx->max) {
+		max = ctx->max == 0 ? 1024 : ctx->max * 2;
+		if ((tmp = PyMem_Realloc(ctx->buf, max)) == NULL) {
+			PyErr_NoMemory();
+			return (-1);
+		}
+		ctx->buf = tmp;
+		ctx->max = max;
+	}
+	ctx->len += prefix_pack(prefix, ctx->buf + ctx->len);
+	return (0);
+}
+
+PyDoc_STRVAR(Radix_complement_doc,
+"Radix.complement(within[, packed]) -> Radix or bytes\n\
+\n\
+Returns the addresses of the network 'within' that no prefix in the\n\
+tree covers, as the shortest list of prefixes. They are found in a\n\
+single walk of the prefixes under 'within', so the time taken grows\n\
+with the size of that subtree and of the result. The prefixes are put\n\
+in a new tree or, if 'packed' is true, returned in ascending order as a\n\
+bytes object of records as from Radix.items(fields=None).");
+
+static PyObject *
+Radix_complement(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "within", "packed", NULL };
+	struct complement_ctx ctx;
+	RadixObject *tree = NULL;
+	PyObject *within, *ret = NULL;
+	prefix_t prefix;
+
+	memset(&ctx, '\0', sizeof(ctx));
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "O|i:complement",
+	    keywords, &within, &ctx.packed))
+		return NULL;
+	if (object_to_prefix("complement", within, -1, 0, &prefix) == NULL)
+		return NULL;
+	if (!ctx.packed) {
+		if ((tree = newRadixObject()) == NULL)
+			return NULL;
+		loader_init(&ctx.ld, tree);
+	}
+	if (radix_complement(PICKRT((&prefix), self), &prefix, complement_add,
+	    &ctx) != 0) {
+		Py_XDECREF(tree);
+		goto out;
+	}
+	if (ctx.packed)
+		ret = PyString_FromStringAndSize((char *)ctx.buf, ctx.len);
+	else
+		ret = (PyObject *)tree;
+ out:
+	PyMem_Free(ctx.buf);
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_coverage_doc,
+"Radix.coverage([family][, within]) -> int\n\
+\n\
+Returns the number of addresses covered by the prefixes in the tree,\n\
+each counted once however many nested prefixes cover it: those of the\n\
+address family 'family' (socket.AF_INET or socket.AF_INET6), or those\n\
+in the network 'within'. The nodes keep count of the addresses below\n\
+them that no prefix covers, so this takes time proportional to the\n\
+tree depth.");
+
+static PyObject *
+Radix_coverage(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "family", "within", NULL };
+	PyObject *within = NULL;
+	u_int64_t uncovered[2], hi, lo;
+	prefix_t prefix;
+	radix_tree_t *rt;
+	u_int bitlen, maxbits, k;
+	char buf[40];
+	int af = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|iO:coverage",
+	    keywords, &af, &within))
+		return NULL;
+	if (within == Py_None)
+		within = NULL;
+	if ((af == 0) == (within == NULL)) {
+		PyErr_SetString(PyExc_TypeError,
+		    "coverage() takes either family or within");
+		return NULL;
+	}
+	if (within != NULL) {
+		if (object_to_prefix("coverage", within, -1, 0,
+		    &prefix) == NULL)
+			return NULL;
+		af = prefix.family;
+	} else if (af != AF_INET && af != AF_INET6) {
+		PyErr_SetString(PyExc_ValueError, "Unsupported address family");
+		return NULL;
+	}
+	rt = af == AF_INET ? self->rt4 : self->rt6;
+	maxbits = af == AF_INET ? 32 : 128;
+	if (radix_coverage(rt, within != NULL ? &prefix : NULL, &bitlen,
+	    uncovered) == 0)
+		return PyInt_FromLong(0);
+
+	/* 2^(maxbits - bitlen) - uncovered, which is 2^128 at most */
+	k = maxbits - bitlen;
+	if (k == 128 && uncovered[0] == 0 && uncovered[1] == 0)
+		return PyLong_FromString("100000000000000000000000000000000",
+		    NULL, 16);
+	hi = k >= 64 ? (k == 128 ? 0 : (u_int64_t)1 << (k - 64)) : 0;
+	lo = k >= 64 ? 0 : (u_int64_t)1 << k;
+	hi -= uncovered[0] + (lo < uncovered[1]);
+	lo -= uncovered[1];
+	if (hi == 0)
+		return PyLong_FromUnsignedLongLong(lo);
+	snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)hi,
+	    (unsigned long long)lo);
+	return PyLong_FromString(buf, NULL, 16);
+}
+
+PyDoc_STRVAR(Radix_nodes_doc,
+"Radix.nodes(prefix) -> List of RadixNode\n\
+\n\
+Returns a list containing all the RadixNode objects that have been\n\
+entered into the tree. This list may be empty if no prefixes have\n\
+been entered.");
+
+static PyObject *
+Radix_nodes(RadixObject *self, PyObject *args)
+{
+	radix_node_t *node;
+	PyObject *ret;
+
+	if (!PyArg_ParseTuple(args, ":nodes"))
+		return NULL;
+
+	if ((ret = PyList_New(0)) == NULL)
+		return NULL;
+
+	RADIX_WALK(self->rt4->head, node) {
+		if (node->data != NULL)
+			PyList_Append(ret, (PyObject *)node->data);
+	} RADIX_WALK_END;
+	RADIX_WALK(self->rt6->head, node) {
+		if (node->data != NULL)
+			PyList_Append(ret, (PyObject *)node->data);
+	} RADIX_WALK_END;
+
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_prefixes_doc,
+"Radix.prefixes(prefix) -> List of prefix strings\n\
+\n\
+Returns a list containing all the prefixes that have been entered\n\
+into the tree. This list may be empty if no prefixes have been\n\
+entered.");
+
+static PyObject *
+Radix_prefixes(RadixObject *self, PyObject *args)
+{
+	radix_node_t *node;
+	PyObject *ret, *str;
+	char buf[256];
+	int i;
+
+	if (!PyArg_ParseTuple(args, ":prefixes"))
+		return NULL;
+
+	if ((ret = PyList_New(0)) == NULL)
+		return NULL;
+
+	for (i = 0; i < 2; i++) {
+		RADIX_WALK(i == 0 ? self->rt4->head : self->rt6->head, node) {
+			if (node->data != NULL) {
+				/* Don't make every node cache its string */
+				prefix_ntop(node->prefix, buf, sizeof(buf));
+				if ((str = PyString_FromString(buf)) == NULL ||
+				    PyList_Append(ret, str) != 0) {
+					Py_XDECREF(str);
+					Py_DECREF(ret);
+					return NULL;
+				}
+				Py_DECREF(str);
+			}
+		} RADIX_WALK_END;
+	}
+
+	return (ret);
+}
+
+/* Wrap the bytes object 'col' as a memoryview of 'format' items */
+static PyObject *
+column_view(PyObject *col, const char *format)
+{
+	PyObject *view, *ret;
+
+	if (col == NULL)
+		return (NULL);
+	view = PyMemoryView_FromObject(col);
+	Py_DECREF(col);
+	if (view == NULL || format == NULL)
+		return (view);
+	ret = PyObject_CallMethod(view, "cast", "s", format);
+	Py_DECREF(view);
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_to_columns_doc,
+"Radix.to_columns([family]) -> dict of columns\n\
+\n\
+Returns the prefixes of the tree, in tree order, as a dict of columns:\n\
+'address' (16 bytes per prefix, IPv4 as IPv4-mapped IPv6 addresses),\n\
+'masklen' and 'family' (one unsigned byte per prefix, the family being\n\
+4 or 6 whatever the platform's AF_INET6) and 'data' (a list of the\n\
+data dicts, which may be changed in place). The first three are\n\
+memoryviews of contiguous buffers, laid out like Arrow\n\
+fixed_size_binary(16) and uint8 arrays.\n\
+If 'family' is socket.AF_INET only IPv4 prefixes are returned and\n\
+'address' holds native-endian unsigned 32-bit integers (an Arrow\n\
+uint32 array); with socket.AF_INET6 only IPv6 prefixes are returned.");
+
+static PyObject *
+Radix_to_columns(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "family", NULL };
+	PyObject *address, *masklen, *family, *data, *payload, *ret = NULL;
+	radix_tree_t *rt[2];
+	radix_node_t *node;
+	prefix_t *prefix;
+	u_char *ap, *mp, *fp, *a;
+	Py_ssize_t n = 0, k = 0;
+	int i, nrt, af = 0, width;
+	u_int32_t v4;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|i:to_columns",
+	    keywords, &af))
+		return NULL;
+	nrt = 0;
+	if (af == 0 || af == AF_INET)
+		rt[nrt++] = self->rt4;
+	if (af == 0 || af == AF_INET6)
+		rt[nrt++] = self->rt6;
+	if (nrt == 0) {
+		PyErr_SetString(PyExc_ValueError, "Unsupported address family");
+		return NULL;
+	}
+	width = af == AF_INET ? 4 : 16;
+
+	for (i = 0; i < nrt; i++) {
+		RADIX_WALK(rt[i]->head, node) {
+			if (node->data != NULL)
+				n++;
+		} RADIX_WALK_END;
+	}
+	address = PyString_FromStringAndSize(NULL, n * width);
+	masklen = PyString_FromStringAndSize(NULL, n);
+	family = PyString_FromStringAndSize(NULL, n);
+	data = PyList_New(n);
+	if (address == NULL || masklen == NULL || family == NULL ||
+	    data == NULL)
+		goto out;
+
+	ap = (u_char *)PyString_AsString(address);
+	mp = (u_char *)PyString_AsString(masklen);
+	fp = (u_char *)PyString_AsString(family);
+	for (i = 0; i < nrt; i++) {
+		RADIX_WALK(rt[i]->head, node) {
+			if (node->data != NULL) {
+				prefix = node->prefix;
+				a = (u_char *)&prefix->add;
+				if (width == 4) {
+					v4 = ((u_int32_t)a[0] << 24) |
+					    (a[1] << 16) | (a[2] << 8) | a[3];
+					memcpy(ap, &v4, 4);
+				} else if (prefix->family == AF_INET) {
+					memset(ap, '\0', 10);
+					ap[10] = ap[11] = 0xff;
+					memcpy(ap + 12, a, 4);
+				} else
+					memcpy(ap, a, 16);
+				ap += width;
+				mp[k] = prefix->bitlen;
+				fp[k] = prefix->family == AF_INET ? 4 : 6;
+				radix_hash_invalidate(node);
+				if ((payload = node_data(node->data)) == NULL)
+					goto out;
+				Py_INCREF(payload);
+				PyList_SET_ITEM(data, k, payload);
+				k++;
+			}
+		} RADIX_WALK_END;
+	}
+
+	address = column_view(address, width == 4 ? "I" : NULL);
+	masklen = column_view(masklen, NULL);
+	family = column_view(family, NULL);
+	if (address != NULL && masklen != NULL && family != NULL) {
+		ret = Py_BuildValue("{sOsOsOsO}", "address", address,
+		    "masklen", masklen, "family", family, "data", data);
+	}
+ out:
+	Py_XDECREF(address);
+	Py_XDECREF(masklen);
+	Py_XDECREF(family);
+	Py_XDECREF(data);
+	return (ret);
+}
+
+PyDoc_STRVAR(Radix_from_columns_doc,
+"Radix.from_columns(address, masklen[, family][, data]) -> None\n\
+Radix.from_columns(columns) -> None\n\
+\n\
+Adds the prefixes held in column buffers, as returned by\n\
+Radix.to_columns(), to the tree. 'address' holds either 16 bytes or a\n\
+native-endian unsigned 32-bit IPv4 address per prefix and 'masklen'\n\
+one byte per prefix. The optional 'family' column, 4 or 6 per prefix,\n\
+tells IPv4 (stored IPv4-mapped) from IPv6 rows of a 16-byte 'address'\n\
+column, without it those are all IPv6. 'data' is an optional sequence\n\
+whose items become the data of the prefixes. Input in tree order is\n\
+bulk loaded.\n\
+\n\
+A dict of columns may be passed instead of separate arguments.");
+
+static PyObject *
+Radix_from_columns(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "address", "masklen", "family", "data",
+	    NULL };
+	PyObject *address, *masklen = NULL, *family = NULL, *data = NULL;
+	PyObject *seq = NULL, *ret = NULL;
+	Py_buffer abuf, mbuf, fbuf;
+	RadixLoader ld;
+	prefix_t prefix;
+	u_char rec[PREFIX_PACKED_MAX], *ap, *mp, *fp;
+	Py_ssize_t n, i;
+	u_int32_t v4;
+	int width;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "O|OOO:from_columns",
+	    keywords, &address, &masklen, &family, &data))
+		return NULL;
+	if (masklen == NULL && PyDict_Check(address)) {
+		masklen = PyDict_GetItemString(address, "masklen");
+		family = PyDict_GetItemString(address, "family");
+		data = PyDict_GetItemString(address, "data");
+		address = PyDict_GetItemString(address, "address");
+	}
+	if (address == NULL || masklen == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+		    "'address' and 'masklen' columns are required");
+		return NULL;
+	}
+
+	abuf.obj = mbuf.obj = fbuf.obj = NULL;
+	if (PyObject_GetBuffer(address, &abuf, PyBUF_SIMPLE) != 0 ||
+	    PyObject_GetBuffer(masklen, &mbuf, PyBUF_SIMPLE) != 0 ||
+	    (family != NULL && family != Py_None &&
+	    PyObject_GetBuffer(family, &fbuf, PyBUF_SIMPLE) != 0))
+		goto out;
+	n = mbuf.len;
+	if (abuf.len == n * 4)
+		width = 4;
+	else if (abuf.len == n * 16)
+		width = 16;
+	else {
+		PyErr_SetString(PyExc_ValueError,
+		    "address column does not match masklen column");
+		goto out;
+	}
+	if (fbuf.obj != NULL && fbuf.len != n) {
+		PyErr_SetString(PyExc_ValueError,
+		    "family column does not match masklen column");
+		goto out;
+	}
+	if (data != NULL && data != Py_None) {
+		if ((seq = PySequence_Fast(data, "data must be a sequence")) ==
+		    NULL)
+			goto out;
+		if (PySequence_Fast_GET_SIZE(seq) != n) {
+			PyErr_SetString(PyExc_ValueError,
+			    "data column does not match masklen column");
+			goto out;
+		}
+	}
+
+	loader_init(&ld, self);
+	ap = abuf.buf;
+	mp = mbuf.buf;
+	fp = fbuf.obj != NULL ? fbuf.buf : NULL;
+	for (i = 0; i < n; i++, ap += width) {
+		rec[1] = mp[i];
+		if (width == 4) {
+			memcpy(&v4, ap, 4);
+			rec[0] = 4;
+			rec[2] = v4 >> 24;
+			rec[3] = v4 >> 16;
+			rec[4] = v4 >> 8;
+			rec[5] = v4;
+		} else if (fp != NULL && fp[i] == 4) {
+			rec[0] = 4;
+			memcpy(rec + 2, ap + 12, 4);
+		} else if (fp == NULL || fp[i] == 6) {
+			rec[0] = 6;
+			memcpy(rec + 2, ap, 16);
+		} else {
+			PyErr_SetString(PyExc_ValueError,
+			    "Unsupported address family");
+			goto out;
+		}
+		if (prefix_unpack(rec, sizeof(rec), &prefix) == 0) {
+			PyErr_SetString(PyExc_ValueError, "Invalid mask length");
+			goto out;
+		}
+		if (loader_add(&ld, &prefix,
+		    seq != NULL ? PySequence_Fast_GET_ITEM(seq, i) : NULL) == NULL)
+			goto out;
+	}
+	Py_INCREF(Py_None);
+	ret = Py_None;
+ out:
+	if (abuf.obj != NULL)
+		PyBuffer_Release(&abuf);
+	if (mbuf.obj != NULL)
+		PyBuffer_Release(&mbuf);
+	if (fbuf.obj != NULL)
+		PyBuffer_Release(&fbuf);
+	Py_XDECREF(seq);
+	return (ret);
+}
+
+/*
+ * Used for pickling. The state is a tuple of
+ *	(RADIX_STATE_VERSION, records, [data, ...])
+ * where 'records' is a bytes object of prefix_pack()ed prefixes in tree
+ * walk order and the list holds the matching RadixNode.data objects.
+ */
+#define RADIX_STATE_VERSION	1
+
+static PyObject *
+radix_getstate(RadixObject *self, int protocol)
+{
+	radix_node_t *node;
+	radix_tree_t *rt[2];
+	PyObject *records, *payloads, *ret;
+	u_char *cp;
+	Py_ssize_t len;
+	int i;
+
+	rt[0] = self->rt4;
+	rt[1] = self->rt6;
+	len = Radix_length(self) * PREFIX_PACKED_MAX;
+	if ((records = PyBytes_FromStringAndSize(NULL, len)) == NULL)
+		return NULL;
+	if ((payloads = PyList_New(0)) == NULL) {
+		Py_DECREF(records);
+		return NULL;
+	}
+
+	cp = (u_char *)PyBytes_AS_STRING(records);
+	for (i = 0; i < 2; i++) {
+		RADIX_WALK(rt[i]->head, node) {
+			if (node->data != NULL) {
+				if (PyList_Append(payloads,
+				    node_payload(node)) != 0) {
+					Py_DECREF(records);
+					Py_DECREF(payloads);
+					return NULL;
+				}
+				cp += prefix_pack(node->prefix, cp);
+			}
+		} RADIX_WALK_END;
+	}
+	len = cp - (u_char *)PyBytes_AS_STRING(records);
+	if (_PyBytes_Resize(&records, len) != 0) {
+		Py_DECREF(payloads);
+		return NULL;
+	}
+
+#if PY_VERSION_HEX >= 0x03080000
+	/* Protocol 5 may pass the records out-of-band */
+	if (protocol >= 5) {
+		PyObject *pb;
+
+		pb = PyPickleBuffer_FromObject(records);
+		Py_DECREF(records);
+		if ((records = pb) == NULL) {
+			Py_DECREF(payloads);
+			return NULL;
+		}
+	}
+#endif
+
+	ret = Py_BuildValue("(iNN)", RADIX_STATE_VERSION, records, payloads);
+	return ret;
+}
+
+static PyObject *
+Radix_getstate(RadixObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":__getstate__"))
+		return NULL;
+	return radix_getstate(self, 0);
+}
+
+static PyObject *
+radix_reduce(RadixObject *self, int protocol)
+{
+	PyObject *state, *ret;
+
+	if ((state = radix_getstate(self, protocol)) == NULL)
+		return NULL;
+
+	ret = Py_BuildValue("(O()O)", radix_constructor, state);
+	Py_XDECREF(state);
+
+	return ret;
+}
+
+static PyObject *
+Radix_reduce(RadixObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":__reduce__"))
+		return NULL;
+	return radix_reduce(self, 0);
+}
+
+static PyObject *
+Radix_reduce_ex(RadixObject *self, PyObject *args)
+{
+	int protocol = 0;
+
+	if (!PyArg_ParseTuple(args, "|i:__reduce_ex__", &protocol))
+		return NULL;
+	return radix_reduce(self, protocol);
+}
+
+/* Unpickling of the list of (prefix, data) tuples used before version 1 */
+static int
+radix_setstate_list(RadixObject *self, PyObject *state)
+{
+	PyObject *tpl, *addr, *data;
+	Py_ssize_t len, i;
+	RadixLoader ld;
+	prefix_t *prefix;
+	char *addr_string;
+	const char *errmsg;
+
+	loader_init(&ld, self);
+	len = PyList_Size(state);
+	for (i = 0; i < len; i++) {
+		if ((tpl = PyList_GetItem(state, i)) == NULL)
+			return -1;
+		if ((addr = PyTuple_GetItem(tpl, 0)) == NULL)
+			return -1;
+		if ((data = PyTuple_GetItem(tpl, 1)) == NULL)
+			return -1;
+		if ((addr_string = PyString_AsString(addr)) == NULL)
+			return -1;
+		if ((prefix = prefix_pton(addr_string, -1, &errmsg)) == NULL) {
+			PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
+			    "Invalid address format");
+			return -1;
+		}
+		if (loader_add(&ld, prefix, data) == NULL) {
+			Deref_Prefix(prefix);
+			return -1;
+		}
+		Deref_Prefix(prefix);
+	}
+	return 0;
+}
+
+static int
+radix_setstate_records(RadixObject *self, PyObject *records,
+    PyObject *payloads)
+{
+	Py_buffer view;
+	RadixLoader ld;
+	prefix_t prefix;
+	const u_char *cp;
+	size_t left, used;
+	Py_ssize_t i, npayloads;
+	int ret = -1;
+
+	if (PyObject_GetBuffer(records, &view, PyBUF_SIMPLE) != 0)
+		return -1;
+	npayloads = PyList_GET_SIZE(payloads);
+	loader_init(&ld, self);
+	cp = view.buf;
+	left = view.len;
+	for (i = 0; left > 0; i++) {
+		if ((used = prefix_unpack(cp, left, &prefix)) == 0 ||
+		    i >= npayloads) {
+			PyErr_SetString(PyExc_ValueError,
+			    "Invalid Radix state records");
+			goto out;
+		}
+		if (loader_add(&ld, &prefix,
+		    PyList_GET_ITEM(payloads, i)) == NULL)
+			goto out;
+		cp += used;
+		left -= used;
+	}
+	if (i != npayloads) {
+		PyErr_SetString(PyExc_ValueError,
+		    "Radix state records and data do not match");
+		goto out;
+	}
+	ret = 0;
+ out:
+	PyBuffer_Release(&view);
+	return ret;
+}
+
+/* Used for unpickling */
+static PyObject *
+Radix_setstate(RadixObject *self, PyObject *args)
+{
+	PyObject *state, *records, *payloads;
+	int version, r;
+
+	if (!Radix_CheckExact(self)) {
+		PyErr_SetString(PyExc_ValueError, "not a Radix object");
+		return NULL;
+	}
+
+	if (!PyArg_ParseTuple(args, "O:__setstate__", &state))
+		return NULL;
+
+	if (PyList_Check(state))
+		r = radix_setstate_list(self, state);
+	else if (!PyTuple_Check(state)) {
+		PyErr_Format(PyExc_TypeError, "__setstate__() argument 1 "
+		    "must be list or tuple, not %.200s",
+		    Py_TYPE(state)->tp_name);
+		return NULL;
+	} else {
+		if (!PyArg_ParseTuple(state, "iOO!:__setstate__", &version,
+		    &records, &PyList_Type, &payloads))
+			return NULL;
+		if (version != RADIX_STATE_VERSION) {
+			PyErr_Format(PyExc_ValueError,
+			    "Unsupported Radix state version %d", version);
+			return NULL;
+		}
+		r = radix_setstate_records(self, records, payloads);
+	}
+	if (r != 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyDoc_STRVAR(Radix_journal_doc,
+"Radix.journal(path[, batch]) -> None\n\
+\n\
+Attaches an append-only journal file to the tree. Every subsequent\n\
+addition of a new prefix and every deletion is appended to the file as\n\
+a compact binary record. Records are written and fsync()ed 'batch'\n\
+(default 64) at a time, or when Radix.sync() is called. Passing None\n\
+as the path flushes and detaches the current journal.\n\
+\n\
+If a write fails, IOError is raised, the change that failed is not\n\
+made and the journal takes no further records; the changes after the\n\
+last successful Radix.sync() may be lost from it. Attach a new journal\n\
+to carry on.\n\
+\n\
+Changes to RadixNode.data are not journalled. To persist a tree,\n\
+pickle it together with the offset returned by Radix.sync() and,\n\
+after unpickling, bring it up to date with Radix.replay().");
+
+static PyObject *
+Radix_journal(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "path", "batch", NULL };
+	radix_journal_t *journal = NULL;
+	const char *path, *errmsg = NULL;
+	int batch = 64, r = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "z|i:journal",
+	    keywords, &path, &batch))
+		return NULL;
+	if (path != NULL &&
+	    (journal = radix_journal_open(path, batch, &errmsg)) == NULL) {
+		PyErr_SetString(PyExc_IOError, errmsg);
+		return NULL;
+	}
+	if (self->journal != NULL)
+		r = radix_journal_close(self->journal);
+	self->journal = journal;
+	if (r != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyDoc_STRVAR(Radix_sync_doc,
+"Radix.sync() -> offset\n\
+\n\
+Writes out and fsync()s any buffered journal records. Returns the\n\
+journal offset up to which the tree's changes are durable, suitable\n\
+for passing to Radix.replay().");
+
+static PyObject *
+Radix_sync(RadixObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":sync"))
+		return NULL;
+	if (self->journal == NULL) {
+		PyErr_SetString(PyExc_ValueError, "no journal attached");
+		return NULL;
+	}
+	if (radix_journal_sync(self->journal) != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+	return PyLong_FromLong(radix_journal_offset(self->journal));
+}
+
+static int
+replay_cb(int op, prefix_t *prefix, void *cbctx)
+{
+	RadixLoader *ld = cbctx;
+	radix_node_t *node;
+
+	if (op == RADIX_JOURNAL_ADD)
+		return (loader_add(ld, prefix, NULL) == NULL ? -1 : 0);
+	if ((node = radix_search_exact(PICKRT(prefix, ld->tree),
+	    prefix)) == NULL)
+		return (0);
+	ld->hint4 = ld->hint6 = NULL;
+	return (delete_node(ld->tree, node));
+}
+
+PyDoc_STRVAR(Radix_replay_doc,
+"Radix.replay(path[, offset]) -> offset\n\
+\n\
+Applies the records of the journal file 'path', starting at 'offset'\n\
+(default: the beginning), to the tree. Additions are bulk loaded.\n\
+Returns the offset just past the last complete record, so a journal\n\
+cut short by a crash can be replayed safely.");
+
+static PyObject *
+Radix_replay(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "path", "offset", NULL };
+	radix_journal_t *journal;
+	const char *path, *errmsg = NULL;
+	RadixLoader ld;
+	long offset = 0, end;
+	int r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "s|l:replay",
+	    keywords, &path, &offset))
+		return NULL;
+
+	/* Don't journal the records being replayed */
+	journal = self->journal;
+	self->journal = NULL;
+	loader_init(&ld, self);
+	r = radix_journal_replay(path, offset, replay_cb, &ld, &end, &errmsg);
+	self->journal = journal;
+	if (r != 0) {
+		if (errmsg != NULL)
+			PyErr_SetString(PyExc_IOError, errmsg);
+		return NULL;
+	}
+	return PyLong_FromLong(end);
+}
+
+/* Copy the prefixes of 'src' into 'dst', with their data dicts as data */
+static int
+mmdb_tree_add(radix_tree_t *dst, radix_tree_t *src, int map4)
+{
+	radix_node_t *rn, *node;
+	prefix_t prefix;
+
+	RADIX_WALK(src->head, rn) {
+		prefix = *rn->prefix;
+		prefix.ref_count = 0;
+		if (map4) {
+			/* IPv4 lives in ::/96 of an IPv6 database */
+			prefix.family = AF_INET6;
+			prefix.bitlen += 96;
+			memset(&prefix.add.sin6, '\0', 12);
+			memcpy((u_char *)&prefix.add.sin6 + 12,
+			    &rn->prefix->add.sin, 4);
+		}
+		if ((node = radix_lookup(dst, &prefix)) == NULL) {
+			PyErr_NoMemory();
+			return (-1);
+		}
+		node->data = node_payload(rn);
+	} RADIX_WALK_END;
+	return (0);
+}
+
+/*
+ * Keep IPv6 prefixes covering ::/96 from covering the IPv4 addresses of
+ * an IPv6 database: ::/96 gets no record unless an IPv4 prefix sets one.
+ * IPv6 prefixes inside ::/96 would be mistaken for IPv4 ones, so they
+ * are refused.
+ */
+static int
+mmdb_tree_v4(radix_tree_t *tree)
+{
+	radix_node_t *node;
+	prefix_t prefix;
+
+	memset(&prefix, '\0', sizeof(prefix));
+	prefix.family = AF_INET6;
+	prefix.bitlen = 96;
+	if (radix_search_covered(tree, &prefix) != NULL) {
+		PyErr_SetString(PyExc_ValueError, "IPv6 prefixes within ::/96 "
+		    "clash with the IPv4 addresses of a MaxMind DB");
+		return (-1);
+	}
+	if ((node = radix_lookup(tree, &prefix)) == NULL) {
+		PyErr_NoMemory();
+		return (-1);
+	}
+	node->data = NULL;
+	return (0);
+}
+
+PyDoc_STRVAR(Radix_export_mmdb_doc,
+"Radix.export_mmdb(path[, database_type][, description][, languages])\n\
+\n\
+Writes the tree to 'path' as a MaxMind DB (format 2.0) file, which can\n\
+be read by radix.MMDB() and the MaxMind reader libraries. The data\n\
+dict of each prefix becomes its record; dicts, lists, tuples, str,\n\
+bytes, int, float and bool values are supported. Identical records are\n\
+stored once. If the tree holds IPv6 prefixes an IPv6 database is\n\
+written, with IPv4 prefixes stored under ::/96; IPv6 prefixes within\n\
+::/96 are refused with ValueError. 'description' is a string and\n\
+'languages' a list of strings for the metadata.");
+
+static PyObject *
+Radix_export_mmdb(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "path", "database_type", "description",
+	    "languages", NULL };
+	PyObject *metadata, *description = NULL, *languages = NULL, *map;
+	const char *path, *database_type = "py-radix";
+	radix_tree_t *tree;
+	int ip_version, r = -1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "s|sOO:export_mmdb",
+	    keywords, &path, &database_type, &description, &languages))
+		return NULL;
+
+	if ((metadata = Py_BuildValue("{ss}", "database_type",
+	    database_type)) == NULL)
+		return NULL;
+	if (description != NULL && description != Py_None) {
+		map = Py_BuildValue("{sO}", "en", description);
+		if (map == NULL ||
+		    PyDict_SetItemString(metadata, "description", map) != 0) {
+			Py_XDECREF(map);
+			goto out;
+		}
+		Py_DECREF(map);
+	}
+	if (languages != NULL && languages != Py_None &&
+	    PyDict_SetItemString(metadata, "languages", languages) != 0)
+		goto out;
+
+	if ((tree = New_Radix()) == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	ip_version = self->rt6->num_active_node > 0 ? 6 : 4;
+	if (mmdb_tree_add(tree, self->rt6, 0) == 0 &&
+	    (ip_version == 4 || mmdb_tree_v4(tree) == 0) &&
+	    mmdb_tree_add(tree, self->rt4, ip_version == 6) == 0)
+		r = mmdb_write(path, tree, ip_version, metadata);
+	Destroy_Radix(tree, NULL, NULL);
+ out:
+	Py_DECREF(metadata);
+	if (r != 0)
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+struct mmdb_load_ctx {
+	RadixLoader ld;
+	long count;
+};
+
+static int
+mmdb_load_cb(prefix_t *prefix, PyObject *data, void *cbctx)
+{
+	struct mmdb_load_ctx *ctx = cbctx;
+
+	ctx->count++;
+	return (loader_add(&ctx->ld, prefix, data) == NULL ? -1 : 0);
+}
+
+PyDoc_STRVAR(Radix_load_mmdb_doc,
+"Radix.load_mmdb(path) -> count\n\
+\n\
+Adds every network of the MaxMind DB file 'path' to the tree, with its\n\
+decoded record as the node's data. Networks sharing a record share one\n\
+data object. IPv4 networks of an IPv6 database are added as IPv4.\n\
+Returns the number of networks loaded.");
+
+static PyObject *
+Radix_load_mmdb(RadixObject *self, PyObject *args)
+{
+	struct mmdb_load_ctx ctx;
+	const char *path;
+	mmdb_t *db;
+	int r;
+
+	if (!PyArg_ParseTuple(args, "s:load_mmdb", &path))
+		return NULL;
+	if ((db = mmdb_open(path)) == NULL)
+		return NULL;
+	loader_init(&ctx.ld, self);
+	ctx.count = 0;
+	r = mmdb_walk(db, mmdb_load_cb, &ctx);
+	mmdb_close(db);
+	if (r != 0)
+		return NULL;
+	return PyInt_FromLong(ctx.count);
+}
+
+PyDoc_STRVAR(Radix_items_doc,
+"Radix.items([chunk][, fields]) -> iterator over lists of tuples\n\
+\n\
+Returns an iterator walking the tree in order which yields lists of up\n\
+to 'chunk' (default 1024) tuples, one per prefix, instead of RadixNode\n\
+objects. 'fields' names the members of the tuples, from 'packed',\n\
+'masklen', 'family', 'prefix', 'network' and 'data' (default:\n\
+('packed', 'masklen', 'data')). 'data' is the RadixNode.data dict of\n\
+the prefix. If 'fields' is None, each chunk is instead a\n\
+bytes object of packed records: a byte 4 or 6 for the family, a byte\n\
+for the mask length and then the 4 or 16 address bytes.");
+
+static PyObject *
+Radix_items(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "chunk", "fields", NULL };
+	PyObject *fields = NULL;
+	int chunk = 1024;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|iO:items", keywords,
+	    &chunk, &fields))
+		return NULL;
+	if (chunk <= 0) {
+		PyErr_SetString(PyExc_ValueError, "chunk must be positive");
+		return NULL;
+	}
+	return (PyObject *)newRadixItemsObject(self, chunk, fields);
+}
+
+PyDoc_STRVAR(Radix_cursor_doc,
+"Radix.cursor([resume]) -> RadixCursor\n\
+\n\
+Returns a cursor for paging through the prefixes in (address, masklen)\n\
+order, IPv4 before IPv6. It starts at the first prefix, or after the\n\
+prefix named by a resume key from RadixCursor.next(). Unlike iterators,\n\
+cursors remain usable while the tree is modified.");
+
+static PyObject *
+Radix_cursor(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "resume", NULL };
+	PyObject *resume = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|O:cursor", keywords,
+	    &resume))
+		return NULL;
+	return newRadixCursorObject(self, resume);
+}
+
+static PyObject *
+Radix_getiter(RadixObject *self)
+{
+	return (PyObject *)newRadixIterObject(self);
+}
+
+PyDoc_STRVAR(Radix_doc, "Radix tree");
+
+static PyMethodDef Radix_methods[] = {
+	{"add",		(PyCFunction)(void(*)(void))Radix_add,		PREFIX_METH,		Radix_add_doc		},
+	{"delete",	(PyCFunction)(void(*)(void))Radix_delete,	PREFIX_METH,		Radix_delete_doc	},
+	{"delete_covered",(PyCFunction)(void(*)(void))Radix_delete_covered,PREFIX_METH,	Radix_delete_covered_doc },
+	{"prune",	(PyCFunction)Radix_prune,	METH_O,			Radix_prune_doc		},
+	{"search_exact",(PyCFunction)(void(*)(void))Radix_search_exact,PREFIX_METH,		Radix_search_exact_doc	},
+	{"search_best",	(PyCFunction)(void(*)(void))Radix_search_best,	PREFIX_METH,		Radix_search_best_doc	},
+	{"search_covering",(PyCFunction)(void(*)(void))Radix_search_covering,PREFIX_METH,	Radix_search_covering_doc },
+	{"search_containing",(PyCFunction)(void(*)(void))Radix_search_containing,PREFIX_METH, Radix_search_containing_doc },
+	{"search_worst",(PyCFunction)(void(*)(void))Radix_search_worst,PREFIX_METH,		Radix_search_worst_doc	},
+	{"search_best_many",(PyCFunction)Radix_search_best_many,METH_O,		Radix_search_best_many_doc },
+	{"search_worst_many",(PyCFunction)Radix_search_worst_many,METH_O,		Radix_search_worst_many_doc },
+	{"search_covering_many",(PyCFunction)Radix_search_covering_many,METH_O,	Radix_search_covering_many_doc },
+	{"next_prefix",	(PyCFunction)(void(*)(void))Radix_next_prefix,	PREFIX_METH,		Radix_next_prefix_doc	},
+	{"prev_prefix",	(PyCFunction)(void(*)(void))Radix_prev_prefix,	PREFIX_METH,		Radix_prev_prefix_doc	},
+	{"next_prefix_many",(PyCFunction)Radix_next_prefix_many,METH_O,		Radix_next_prefix_many_doc },
+	{"prev_prefix_many",(PyCFunction)Radix_prev_prefix_many,METH_O,		Radix_prev_prefix_many_doc },
+	{"search_covered",(PyCFunction)(void(*)(void))Radix_search_covered,PREFIX_METH,	Radix_search_covered_doc },
+	{"search_range",(PyCFunction)Radix_search_range,METH_VARARGS|METH_KEYWORDS,	Radix_search_range_doc	},
+	{"search_range_many",(PyCFunction)Radix_search_range_many,METH_O,	Radix_search_range_many_doc },
+	{"add_range",	(PyCFunction)Radix_add_range,	METH_VARARGS|METH_KEYWORDS,	Radix_add_range_doc	},
+	{"ranges",	(PyCFunction)Radix_ranges,	METH_VARARGS|METH_KEYWORDS,	Radix_ranges_doc	},
+	{"union",	(PyCFunction)Radix_union,	METH_VARARGS|METH_KEYWORDS,	Radix_union_doc		},
+	{"intersection",(PyCFunction)Radix_intersection,METH_VARARGS|METH_KEYWORDS,	Radix_intersection_doc	},
+	{"difference",	(PyCFunction)Radix_difference,	METH_VARARGS|METH_KEYWORDS,	Radix_difference_doc	},
+	{"symmetric_difference",(PyCFunction)Radix_symmetric_difference,METH_VARARGS|METH_KEYWORDS, Radix_symmetric_difference_doc },
+	{"root_hash",	(PyCFunction)Radix_root_hash,	METH_VARARGS|METH_KEYWORDS,	Radix_root_hash_doc	},
+	{"subtree_hash",(PyCFunction)(void(*)(void))Radix_subtree_hash,PREFIX_METH,	Radix_subtree_hash_doc	},
+	{"diff",	(PyCFunction)Radix_diff,	METH_VARARGS|METH_KEYWORDS,	Radix_diff_doc		},
+	{"aggregate",	(PyCFunction)Radix_aggregate,	METH_VARARGS|METH_KEYWORDS,	Radix_aggregate_doc	},
+	{"compress_fib",(PyCFunction)Radix_compress_fib,METH_VARARGS|METH_KEYWORDS,	Radix_compress_fib_doc	},
+	{"allocate",	(PyCFunction)Radix_allocate,	METH_VARARGS|METH_KEYWORDS,	Radix_allocate_doc	},
+	{"complement",	(PyCFunction)Radix_complement,	METH_VARARGS|METH_KEYWORDS,	Radix_complement_doc	},
+	{"coverage",	(PyCFunction)Radix_coverage,	METH_VARARGS|METH_KEYWORDS,	Radix_coverage_doc	},
+	{"iter_covered",(PyCFunction)(void(*)(void))Radix_iter_covered,PREFIX_METH,		Radix_iter_covered_doc	},
+	{"count_covered",(PyCFunction)(void(*)(void))Radix_count_covered,PREFIX_METH,	Radix_count_covered_doc	},
+	{"rank",	(PyCFunction)(void(*)(void))Radix_rank,		PREFIX_METH,		Radix_rank_doc		},
+	{"select",	(PyCFunction)Radix_select,	METH_VARARGS,		Radix_select_doc	},
+	{"num_prefixes",(PyCFunction)Radix_num_prefixes,METH_NOARGS,		Radix_num_prefixes_doc	},
+	{"nodes",	(PyCFunction)Radix_nodes,	METH_VARARGS,			Radix_nodes_doc		},
+	{"prefixes",	(PyCFunction)Radix_prefixes,	METH_VARARGS,			Radix_prefixes_doc	},
+	{"items",	(PyCFunction)Radix_items,	METH_VARARGS|METH_KEYWORDS,	Radix_items_doc		},
+	{"cursor",	(PyCFunction)Radix_cursor,	METH_VARARGS|METH_KEYWORDS,	Radix_cursor_doc	},
+	{"to_columns",	(PyCFunction)Radix_to_columns,	METH_VARARGS|METH_KEYWORDS,	Radix_to_columns_doc	},
+	{"from_columns",(PyCFunction)Radix_from_columns,METH_VARARGS|METH_KEYWORDS,	Radix_from_columns_doc	},
+	{"journal",	(PyCFunction)Radix_journal,	METH_VARARGS|METH_KEYWORDS,	Radix_journal_doc	},
+	{"sync",	(PyCFunction)Radix_sync,	METH_VARARGS,			Radix_sync_doc		},
+	{"replay",	(PyCFunction)Radix_replay,	METH_VARARGS|METH_KEYWORDS,	Radix_replay_doc	},
+	{"export_mmdb",	(PyCFunction)Radix_export_mmdb,	METH_VARARGS|METH_KEYWORDS,	Radix_export_mmdb_doc	},
+	{"load_mmdb",	(PyCFunction)Radix_load_mmdb,	METH_VARARGS,			Radix_load_mmdb_doc	},
+	{"__getstate__",(PyCFunction)Radix_getstate,	METH_VARARGS,			NULL			},
+	{"__setstate__",(PyCFunction)Radix_setstate,	METH_VARARGS,			NULL			},
+	{"__reduce__",	(PyCFunction)Radix_reduce,	METH_VARARGS,			NULL			},
+	{"__reduce_ex__",(PyCFunction)Radix_reduce_ex,	METH_VARARGS,			NULL			},
+	{NULL,		NULL}		/* sentinel */
+};
+
+static PyTypeObject Radix_Type = {
+	/* The ob_type field must be initialized in the module init function
+	 * to be portable to Windows without using C++. */
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"radix.Radix",		/*tp_name*/
+	sizeof(RadixObject),	/*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	/* methods */
+	(destructor)Radix_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	0,			/*tp_repr*/
+	0,			/*tp_as_number*/
+	&Radix_as_sequence,	/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,			/*tp_call*/
+	0,			/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	Radix_doc,		/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	(getiterfunc)Radix_getiter, /*tp_iter*/
+	0,			/*tp_iternext*/
+	Radix_methods,		/*tp_methods*/
+	0,			/*tp_members*/
+	0,			/*tp_getset*/
+	0,			/*tp_base*/
+	0,			/*tp_dict*/
+	0,			/*tp_descr_get*/
+	0,			/*tp_descr_set*/
+	0,			/*tp_dictoffset*/
+	0,			/*tp_init*/
+	0,			/*tp_alloc*/
+	0,			/*tp_new*/
+	0,			/*tp_free*/
+	0,			/*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------ */
+
+/* RadixIter: radix tree iterator */
+
+/* Fields of the tuples returned by Radix.items() */
+#define ITEM_PACKED	0
+#define ITEM_MASKLEN	1
+#define ITEM_FAMILY	2
+#define ITEM_PREFIX	3
+#define ITEM_NETWORK	4
+#define ITEM_DATA	5
+#define ITEM_NFIELDS	6
+
+static const char *item_fields[ITEM_NFIELDS] = {
+	"packed", "masklen", "family", "prefix", "network", "data"
+};
+
+typedef struct _RadixIterObject {
+	PyObject_HEAD
+	RadixObject *parent;
+	radix_node_t *iterstack[RADIX_MAXBITS+1];
+	radix_node_t **sp;
+	radix_node_t *rn;
+	radix_node_t *next_head;	/* Tree to walk after this one */
+	unsigned int gen_id;	/* Detect tree modifications */
+	int chunk;		/* Radix.items(): nodes per chunk, or 0 */
+	int nfields;		/* 0 for packed records */
+	int fields[ITEM_NFIELDS];
+} RadixIterObject;
+
+static PyTypeObject RadixIter_Type;
+
+static RadixIterObject *
+newRadixIterObject(RadixObject *parent)
+{
+	RadixIterObject *self;
+
+	self = PyObject_New(RadixIterObject, &RadixIter_Type);
+	if (self == NULL)
+		return NULL;
+
+	self->parent = parent;
+	Py_XINCREF(self->parent);
+
+	self->sp = self->iterstack;
+	self->rn = self->parent->rt4->head;
+	self->next_head = self->parent->rt6->head;
+	self->gen_id = self->parent->gen_id;
+	self->chunk = 0;
+	self->nfields = 0;
+	return self;
+}
+
+/* Iterator over the subtree of 'root' only */
+static RadixIterObject *
+newRadixSubtreeIterObject(RadixObject *parent, radix_node_t *root)
+{
+	RadixIterObject *self;
+
+	if ((self = newRadixIterObject(parent)) == NULL)
+		return NULL;
+	self->rn = root;
+	self->next_head = NULL;
+	return self;
+}
+
+/* Iterator for Radix.items(): 'fields' is NULL for the default fields */
+static RadixIterObject *
+newRadixItemsObject(RadixObject *parent, int chunk, PyObject *fields)
+{
+	RadixIterObject *iter;
+	PyObject *seq, *name;
+	Py_ssize_t i, n;
+	int f;
+
+	if ((iter = newRadixIterObject(parent)) == NULL)
+		return NULL;
+	iter->chunk = chunk;
+	if (fields == NULL) {
+		iter->fields[0] = ITEM_PACKED;
+		iter->fields[1] = ITEM_MASKLEN;
+		iter->fields[2] = ITEM_DATA;
+		iter->nfields = 3;
+		return (iter);
+	}
+	if (fields == Py_None)
+		return (iter);
+
+	if ((seq = PySequence_Fast(fields, "fields must be a sequence")) == NULL)
+		goto fail;
+	n = PySequence_Fast_GET_SIZE(seq);
+	if (n == 0 || n > ITEM_NFIELDS) {
+		PyErr_SetString(PyExc_ValueError, "invalid number of fields");
+		Py_DECREF(seq);
+		goto fail;
+	}
+	for (i = 0; i < n; i++) {
+		name = PySequence_Fast_GET_ITEM(seq, i);
+		for (f = 0; f < ITEM_NFIELDS; f++) {
+#if PY_MAJOR_VERSION >= 3
+			if (PyUnicode_Check(name) &&
+			    PyUnicode_CompareWithASCIIString(name,
+			    item_fields[f]) == 0)
+#else
+			if (PyString_Check(name) && strcmp(
+			    PyString_AS_STRING(name), item_fields[f]) == 0)
+#endif
+				break;
+		}
+		if (f == ITEM_NFIELDS) {
+			PyErr_SetString(PyExc_ValueError, "unknown field");
+			Py_DECREF(seq);
+			goto fail;
+		}
+		iter->fields[i] = f;
+	}
+	iter->nfields = n;
+	Py_DECREF(seq);
+	return (iter);
+ fail:
+	Py_DECREF(iter);
+	return NULL;
+}
+
+/* RadixIter methods */
+
+static void
+RadixIter_dealloc(RadixIterObject *self)
+{
+	Py_XDECREF(self->parent);
+	PyObject_Del(self);
+}
+
+/* Returns the next tree node holding a prefix, or NULL at the end */
+static radix_node_t *
+iter_next_node(RadixIterObject *self)
+{
+	radix_node_t *node;
+
+ again:
+	if ((node = self->rn) == NULL) {
+		/* We have walked both trees */
+		if (self->next_head == NULL)
+			return NULL;
+		/* Otherwise reset and start walk of IPv6 tree */
+		self->sp = self->iterstack;
+		self->rn = self->next_head;
+		self->next_head = NULL;
+		goto again;
+	}
+
+	/* Get next node */
+	if (self->rn->l) {
+		if (self->rn->r)
+			*self->sp++ = self->rn->r;
+		self->rn = self->rn->l;
+	} else if (self->rn->r)
+		self->rn = self->rn->r;
+	else if (self->sp != self->iterstack)
+		self->rn = *(--self->sp);
+	else
+		self->rn = NULL;
+
+	if (node->prefix == NULL || node->data == NULL)
+		goto again;
+	return (node);
+}
+
+static PyObject *
+item_field(radix_node_t *node, int field)
+{
+	RadixNodeObject *node_obj = node->data;
+	PyObject *ret;
+	char buf[256];
+
+	switch (field) {
+	case ITEM_PACKED:
+		return PyString_FromStringAndSize((char *)&node->prefix->add,
+		    node->prefix->family == AF_INET ? 4 : 16);
+	case ITEM_MASKLEN:
+		return PyInt_FromLong(node->prefix->bitlen);
+	case ITEM_FAMILY:
+		return PyInt_FromLong(node->prefix->family);
+	case ITEM_PREFIX:
+		if ((ret = node_obj->prefix_str) != NULL) {
+			Py_INCREF(ret);
+			return (ret);
+		}
+		prefix_ntop(node->prefix, buf, sizeof(buf));
+		return PyString_FromString(buf);
+	case ITEM_NETWORK:
+		prefix_addr_ntop(node->prefix, buf, sizeof(buf));
+		return PyString_FromString(buf);
+	default:
+		/* As with RadixNode.data, the dict may be changed in place */
+		radix_hash_invalidate(node);
+		if ((ret = node_data(node_obj)) != NULL)
+			Py_INCREF(ret);
+		return (ret);
+	}
+}
+
+/* Radix.items() with no fields: a bytes object of prefix_pack() records */
+static PyObject *
+iter_records_chunk(RadixIterObject *self)
+{
+	radix_node_t *node;
+	PyObject *ret;
+	u_char *cp, *start;
+	int n;
+
+	ret = PyString_FromStringAndSize(NULL,
+	    (Py_ssize_t)self->chunk * PREFIX_PACKED_MAX);
+	if (ret == NULL)
+		return (NULL);
+	start = cp = (u_char *)PyString_AsString(ret);
+	for (n = 0; n < self->chunk && (node = iter_next_node(self)) != NULL;
+	    n++)
+		cp += prefix_pack(node->prefix, cp);
+	if (n == 0) {
+		Py_DECREF(ret);
+		return (NULL);
+	}
+	if (_PyBytes_Resize(&ret, cp - start) != 0)
+		return (NULL);
+	return (ret);
+}
+
+static PyObject *
+iter_items_chunk(RadixIterObject *self)
+{
+	radix_node_t *node;
+	PyObject *ret, *item, *value;
+	int n, i;
+
+	if (self->nfields == 0)
+		return (iter_records_chunk(self));
+	if ((ret = PyList_New(0)) == NULL)
+		return (NULL);
+	for (n = 0; n < self->chunk && (node = iter_next_node(self)) != NULL;
+	    n++) {
+		if ((item = PyTuple_New(self->nfields)) == NULL)
+			goto fail;
+		for (i = 0; i < self->nfields; i++) {
+			if ((value = item_field(node, self->fields[i])) == NULL) {
+				Py_DECREF(item);
+				goto fail;
+			}
+			PyTuple_SET_ITEM(item, i, value);
+		}
+		if (PyList_Append(ret, item) != 0) {
+			Py_DECREF(item);
+			goto fail;
+		}
+		Py_DECREF(item);
+	}
+	if (n == 0) {
+		Py_DECREF(ret);
+		return (NULL);
+	}
+	return (ret);
+ fail:
+	Py_DECREF(ret);
+	return (NULL);
+}
+
+static PyObject *
+RadixIter_iternext(RadixIterObject *self)
+{
+	radix_node_t *node;
+	PyObject *ret;
+
+	if (self->gen_id != self->parent->gen_id) {
+		PyErr_SetString(PyExc_RuntimeWarning,
+		    "Radix tree modified during iteration");
+		return (NULL);
+	}
+	if (self->chunk > 0)
+		return (iter_items_chunk(self));
+	if ((node = iter_next_node(self)) == NULL)
+		return (NULL);
+
+	ret = node->data;
+	Py_INCREF(ret);
+	return (ret);
+}
+
+PyDoc_STRVAR(RadixIter_doc, 
+"Radix tree iterator");
+
+static PyTypeObject RadixIter_Type = {
+	/* The ob_type field must be initialized in the module init function
+	 * to be portable to Windows without using C++. */
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"radix.RadixIter",	/*tp_name*/
+	sizeof(RadixIterObject),/*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	/* methods */
+	(destructor)RadixIter_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	0,			/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,			/*tp_call*/
+	0,			/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	RadixIter_doc,		/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	PyObject_SelfIter,	/*tp_iter*/
+	(iternextfunc)RadixIter_iternext, /*tp_iternext*/
+	0,			/*tp_methods*/
+	0,			/*tp_members*/
+	0,			/*tp_getset*/
+	0,			/*tp_base*/
+	0,			/*tp_dict*/
+	0,			/*tp_descr_get*/
+	0,			/*tp_descr_set*/
+	0,			/*tp_dictoffset*/
+	0,			/*tp_init*/
+	0,			/*tp_alloc*/
+	0,			/*tp_new*/
+	0,			/*tp_free*/
+	0,			/*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------ */
+
+/*
+ * RadixCursor: ordered, resumable walks. The position is kept as a
+ * prefix rather than as a tree node, so each page starts with a fresh
+ * descent and the cursor stays valid while the tree is modified.
+ */
+
+#define CURSOR_START	0	/* Before the first prefix */
+#define CURSOR_AT	1	/* At the first prefix >= key */
+#define CURSOR_AFTER	2	/* At the first prefix > key */
+
+typedef struct {
+	PyObject_HEAD
+	RadixObject *parent;
+	prefix_t key;
+	int state;
+} RadixCursorObject;
+
+static PyTypeObject RadixCursor_Type;
+
+/* Decode a resume key, which holds a prefix_pack() record */
+static prefix_t *
+resume_to_prefix(PyObject *resume, prefix_t *prefix)
+{
+	u_char *buf;
+	Py_ssize_t len;
+
+	if (!PyBytes_Check(resume)) {
+		PyErr_SetString(PyExc_TypeError, "resume key must be bytes");
+		return (NULL);
+	}
+	buf = (u_char *)PyBytes_AS_STRING(resume);
+	len = PyBytes_GET_SIZE(resume);
+	if ((len != 6 && len != 18) || buf[0] != (len == 6 ? 4 : 6) ||
+	    prefix_from_blob2(buf + 2, len - 2, buf[1], prefix) == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Invalid resume key");
+		return (NULL);
+	}
+	return (prefix);
+}
+
+static PyObject *
+newRadixCursorObject(RadixObject *parent, PyObject *resume)
+{
+	RadixCursorObject *self;
+
+	self = PyObject_New(RadixCursorObject, &RadixCursor_Type);
+	if (self == NULL)
+		return NULL;
+	self->parent = parent;
+	Py_INCREF(self->parent);
+	self->state = CURSOR_START;
+	if (resume != NULL && resume != Py_None) {
+		if (resume_to_prefix(resume, &self->key) == NULL) {
+			Py_DECREF(self);
+			return NULL;
+		}
+		self->state = CURSOR_AFTER;
+	}
+	return (PyObject *)self;
+}
+
+static void
+RadixCursor_dealloc(RadixCursorObject *self)
+{
+	Py_XDECREF(self->parent);
+	PyObject_Del(self);
+}
+
+/* Returns the node at the cursor position, or NULL at the end */
+static radix_node_t *
+cursor_node(RadixCursorObject *self)
+{
+	radix_node_t *node = NULL;
+
+	if (self->state != CURSOR_START) {
+		node = radix_ceiling(PICKRT((&self->key), self->parent),
+		    &self->key);
+		if (node != NULL && self->state == CURSOR_AFTER &&
+		    prefix_cmp(node->prefix, &self->key) == 0)
+			node = radix_next(node);
+		if (node != NULL || self->key.family == AF_INET6)
+			return (node);
+	} else if ((node = radix_first(self->parent->rt4)) != NULL)
+		return (node);
+	return (radix_first(self->parent->rt6));
+}
+
+PyDoc_STRVAR(RadixCursor_seek_doc,
+"RadixCursor.seek(network[, masklen][, packed]) -> None\n\
+\n\
+Positions the cursor at the first prefix greater than or equal to the\n\
+specified one, in (address, masklen) order with IPv4 before IPv6.");
+
+static PyObject *
+RadixCursor_seek(RadixCursorObject *self, PREFIX_ARGS)
+{
+	prefix_t prefix;
+
+	if (GET_PREFIX_ARGS("seek", &prefix) == NULL)
+		return NULL;
+	self->key = prefix;
+	self->state = CURSOR_AT;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(RadixCursor_next_doc,
+"RadixCursor.next(n) -> (list of RadixNode, resume key)\n\
+\n\
+Returns up to 'n' RadixNodes from the cursor position onwards and\n\
+advances past them. The resume key is an opaque bytes object that\n\
+Radix.cursor() accepts to continue after the last node returned, or\n\
+None if the walk has reached the end of the tree. 'n' must be at least\n\
+1, so that None never stands for a position that is not the end.");
+
+static PyObject *
+RadixCursor_next(RadixCursorObject *self, PyObject *args)
+{
+	radix_node_t *node, *last = NULL;
+	PyObject *nodes, *resume, *ret;
+	u_char buf[PREFIX_PACKED_MAX];
+	Py_ssize_t n, i = 0;
+
+	if (!PyArg_ParseTuple(args, "n:next", &n))
+		return NULL;
+	if (n < 1) {
+		PyErr_SetString(PyExc_ValueError, "n must be positive");
+		return NULL;
+	}
+	if ((nodes = PyList_New(0)) == NULL)
+		return NULL;
+	node = cursor_node(self);
+	while (node != NULL && i < n) {
+		if (node->data != NULL) {
+			if (PyList_Append(nodes, (PyObject *)node->data) != 0) {
+				Py_DECREF(nodes);
+				return NULL;
+			}
+			last = node;
+			i++;
+		}
+		if ((node = radix_next(node)) == NULL &&
+		    last != NULL && last->prefix->family == AF_INET)
+			node = radix_first(self->parent->rt6);
+	}
+	if (last != NULL) {
+		prefix_from_blob2((u_char *)&last->prefix->add,
+		    last->prefix->family == AF_INET ? 4 : 16,
+		    last->prefix->bitlen, &self->key);
+		self->state = CURSOR_AFTER;
+	}
+	/* As n > 0, nodes are left only after a full page */
+	if (node == NULL) {
+		Py_INCREF(Py_None);
+		resume = Py_None;
+	} else if ((resume = PyString_FromStringAndSize((char *)buf,
+	    prefix_pack(last->prefix, buf))) == NULL) {
+		Py_DECREF(nodes);
+		return NULL;
+	}
+	ret = Py_BuildValue("(NN)", nodes, resume);
+	return (ret);
+}
+
+static PyMethodDef RadixCursor_methods[] = {
+	{"seek",	(PyCFunction)(void(*)(void))RadixCursor_seek,PREFIX_METH,	RadixCursor_seek_doc	},
+	{"next",	(PyCFunction)RadixCursor_next,	METH_VARARGS,	RadixCursor_next_doc	},
+	{NULL,		NULL}		/* sentinel */
+};
+
+PyDoc_STRVAR(RadixCursor_doc,
+"Ordered, resumable cursor over a Radix tree");
+
+static PyTypeObject RadixCursor_Type = {
+	/* The ob_type field must be initialized in the module init function
+	 * to be portable to Windows without using C++. */
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"radix.RadixCursor",	/*tp_name*/
+	sizeof(RadixCursorObject),/*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	/* methods */
+	(destructor)RadixCursor_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	0,			/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,			/*tp_call*/
+	0,			/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	RadixCursor_doc,	/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	0,			/*tp_iter*/
+	0,			/*tp_iternext*/
+	RadixCursor_methods,	/*tp_methods*/
+	0,			/*tp_members*/
+	0,			/*tp_getset*/
+	0,			/*tp_base*/
+	0,			/*tp_dict*/
+	0,			/*tp_descr_get*/
+	0,			/*tp_descr_set*/
+	0,			/*tp_dictoffset*/
+	0,			/*tp_init*/
+	0,			/*tp_alloc*/
+	0,			/*tp_new*/
+	0,			/*tp_free*/
+	0,			/*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------ */
+
+/* DiskRadix: radix tree stored in a memory-mapped file */
+
+typedef struct {
+	PyObject_HEAD
+	radix_disk_t *disk;
+} DiskRadixObject;
+
+static PyTypeObject DiskRadix_Type;
+
+static void
+DiskRadix_dealloc(DiskRadixObject *self)
+{
+	if (self->disk != NULL)
+		radix_disk_close(self->disk);
+	PyObject_Del(self);
+}
+
+static int
+disk_check_open(DiskRadixObject *self)
+{
+	if (self->disk == NULL) {
+		PyErr_SetString(PyExc_ValueError,
+		    "operation on closed DiskRadix");
+		return (-1);
+	}
+	if (radix_disk_corrupt(self->disk)) {
+		PyErr_SetString(PyExc_IOError, "not a radix tree file");
+		return (-1);
+	}
+	return (0);
+}
+
+static PyObject *
+disk_error(DiskRadixObject *self)
+{
+	if (radix_disk_corrupt(self->disk))
+		PyErr_SetString(PyExc_IOError, "not a radix tree file");
+	else
+		PyErr_SetFromErrno(PyExc_IOError);
+	return NULL;
+}
+
+static PyObject *
+disk_result(prefix_t *found, u_int64_t value)
+{
+	char buf[256];
+
+	prefix_ntop(found, buf, sizeof(buf));
+	return Py_BuildValue("(sK)", buf, (unsigned PY_LONG_LONG)value);
+}
+
+PyDoc_STRVAR(DiskRadix_add_doc,
+"DiskRadix.add(network[, masklen][, packed][, value]) -> None\n\
+\n\
+Adds the specified network to the tree, associating it with the\n\
+unsigned 64-bit integer 'value' (default 0). Adding a network that\n\
+is already present replaces its value.");
+
+static PyObject *
+DiskRadix_add(DiskRadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	prefix_t *prefix;
+	static char *keywords[] = { "network", "masklen", "packed", "value",
+	    NULL };
+
+	char *addr = NULL, *packed = NULL;
+	long prefixlen = -1;
+	Py_ssize_t packlen = -1;
+	unsigned PY_LONG_LONG value = 0;
+	int r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#K:add", keywords,
+	    &addr, &prefixlen, &packed, &packlen, &value))
+		return NULL;
+	if (disk_check_open(self) != 0)
+		return NULL;
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+		return NULL;
+	r = radix_disk_add(self->disk, prefix, value);
+	Deref_Prefix(prefix);
+	if (r != 0)
+		return disk_error(self);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyDoc_STRVAR(DiskRadix_delete_doc,
+"DiskRadix.delete(network[, masklen][, packed]) -> None\n\
+\n\
+Deletes the specified network from the tree.");
+
+static PyObject *
+DiskRadix_delete(DiskRadixObject *self, PyObject *args, PyObject *kw_args)
+{
+	prefix_t *prefix;
+	static char *keywords[] = { "network", "masklen", "packed", NULL };
+
+	char *addr = NULL, *packed = NULL;
+	long prefixlen = -1;
+	Py_ssize_t packlen = -1;
+	int r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|sls#:delete",
+	    keywords, &addr, &prefixlen, &packed, &packlen))
+		return NULL;
+	if (disk_check_open(self) != 0)
+		return NULL;
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+		return NULL;
+	r = radix_disk_delete(self->disk, prefix);
+	Deref_Prefix(prefix);
+	if (r == -1)
+		return disk_error(self);
+	if (r == 0) {
+		PyErr_SetString(PyExc_KeyError, "no such address");
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+disk_search(DiskRadixObject *self, PyObject *args, PyObject *kw_args,
+    const char *fmt, int best)
+{
+	prefix_t *prefix, found;
+	u_int64_t value;
+	static char *keywords[] = { "network", "masklen", "packed", NULL };
+
+	char *addr = NULL, *packed = NULL;
+	long prefixlen = -1;
+	Py_ssize_t packlen = -1;
+	int r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, fmt, keywords,
+	    &addr, &prefixlen, &packed, &packlen))
+		return NULL;
+	if (disk_check_open(self) != 0)
+		return NULL;
+	if ((prefix = args_to_prefix(addr, packed, packlen, prefixlen)) == NULL)
+		return NULL;
+	if (best)
+		r = radix_disk_search_best(self->disk, prefix, &found, &value);
+	else
+		r = radix_disk_search_exact(self->disk, prefix, &found, &value);
+	Deref_Prefix(prefix);
+	if (r == -1)
+		return disk_error(self);
+	if (r == 0) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	return disk_result(&found, value);
+}
+
+PyDoc_STRVAR(DiskRadix_search_exact_doc,
+"DiskRadix.search_exact(network[, masklen][, packed]) -> (prefix, value)\n\
+\n\
+Search for the specified network in the tree. Returns a tuple of the\n\
+prefix string and its value, or None if no match is found.");
+
+static PyObject *
+DiskRadix_search_exact(DiskRadixObject *self, PyObject *args,
+    PyObject *kw_args)
+{
+	return disk_search(self, args, kw_args, "|sls#:search_exact", 0);
+}
+
+PyDoc_STRVAR(DiskRadix_search_best_doc,
+"DiskRadix.search_best(network[, masklen][, packed]) -> (prefix, value)\n\
+\n\
+Returns the best (longest) entry that includes the specified network\n\
+as a tuple of the prefix string and its value, or None.");
+
+static PyObject *
+DiskRadix_search_best(DiskRadixObject *self, PyObject *args,
+    PyObject *kw_args)
+{
+	return disk_search(self, args, kw_args, "|sls#:search_best", 1);
+}
+
+static int
+disk_prefixes_cb(prefix_t *prefix, u_int64_t value, void *cbctx)
+{
+	PyObject *item;
+	char buf[256];
+	int r;
 
-	return (ret);
+	prefix_ntop(prefix, buf, sizeof(buf));
+	if ((item = PyString_FromString(buf)) == NULL)
+		return (-1);
+	r = PyList_Append((PyObject *)cbctx, item);
+	Py_DECREF(item);
+	return (r);
 }
 
-PyDoc_STRVAR(Radix_prefixes_doc,
-"Radix.prefixes(prefix) -> List of prefix strings\n\
+PyDoc_STRVAR(DiskRadix_prefixes_doc,
+"DiskRadix.prefixes() -> List of prefix strings\n\
 \n\
-Returns a list containing all the prefixes that have been entered\n\
-into the tree. This list may be empty if no prefixes have been\n\
-entered.");
+Returns a list containing all the prefixes stored in the tree.");
 
 static PyObject *
-Radix_prefixes(RadixObject *self, PyObject *args)
+DiskRadix_prefixes(DiskRadixObject *self, PyObject *args)
 {
-	radix_node_t *node;
 	PyObject *ret;
 
 	if (!PyArg_ParseTuple(args, ":prefixes"))
 		return NULL;
-
-	if ((ret = PyList_New(0)) == NULL)
+	if (disk_check_open(self) != 0)
 		return NULL;
-
-	RADIX_WALK(self->rt4->head, node) {
-		if (node->data != NULL) {
-			PyList_Append(ret,
-			    ((RadixNodeObject *)node->data)->prefix);
-		}
-	} RADIX_WALK_END;
-	RADIX_WALK(self->rt6->head, node) {
-		if (node->data != NULL) {
-			PyList_Append(ret,
-			    ((RadixNodeObject *)node->data)->prefix);
-		}
-	} RADIX_WALK_END;
-
-	return (ret);
-}
-
-/* Used for pickling */
-static PyObject *
-radix_getstate(RadixObject *self)
-{
-	radix_node_t *node;
-	PyObject *ret;
-	RadixNodeObject *rnode;
-	PyObject *item_tuple;
-#if PY_MAJOR_VERSION >= 3
-	PyObject *prefix_bytes;
-#endif
-
 	if ((ret = PyList_New(0)) == NULL)
 		return NULL;
-
-	RADIX_WALK(self->rt4->head, node) {
-		if (node->data != NULL) {
-			rnode = (RadixNodeObject *)node->data;
-#if PY_MAJOR_VERSION >= 3
-			prefix_bytes = PyUnicode_AsASCIIString(rnode->prefix);
-			item_tuple = Py_BuildValue("(OO)", prefix_bytes, rnode->user_attr);
-			PyList_Append(ret, item_tuple);
-			Py_DECREF(item_tuple);
-			Py_DECREF(prefix_bytes);
-#else
-			item_tuple = Py_BuildValue("(OO)", rnode->prefix, rnode->user_attr);
-			PyList_Append(ret, item_tuple);
-			Py_DECREF(item_tuple);
-#endif
-		}
-	} RADIX_WALK_END;
-	RADIX_WALK(self->rt6->head, node) {
-		if (node->data != NULL) {
-			rnode = (RadixNodeObject *)node->data;
-#if PY_MAJOR_VERSION >= 3
-			prefix_bytes = PyUnicode_AsASCIIString(rnode->prefix);
-			item_tuple = Py_BuildValue("(OO)", prefix_bytes, rnode->user_attr);
-			PyList_Append(ret, item_tuple);
-			Py_DECREF(item_tuple);
-			Py_DECREF(prefix_bytes);
-#else
-			item_tuple = Py_BuildValue("(OO)", rnode->prefix, rnode->user_attr);
-			PyList_Append(ret, item_tuple);
-			Py_DECREF(item_tuple);
-#endif
-		}
-	} RADIX_WALK_END;
-
+	if (radix_disk_process(self->disk, disk_prefixes_cb, ret) != 0) {
+		Py_DECREF(ret);
+		if (radix_disk_corrupt(self->disk))
+			return disk_error(self);
+		return NULL;
+	}
 	return (ret);
 }
 
-static PyObject *
-Radix_getstate(RadixObject *self, PyObject *args)
-{
-	if (!PyArg_ParseTuple(args, ":__getstate__"))
-		return NULL;
-	return radix_getstate(self);
-}
+PyDoc_STRVAR(DiskRadix_sync_doc,
+"DiskRadix.sync() -> None\n\
+\n\
+Flushes all modified pages to the tree file.");
 
 static PyObject *
-Radix_reduce(RadixObject *self, PyObject *args)
+DiskRadix_sync(DiskRadixObject *self, PyObject *args)
 {
-	PyObject *state, *ret;
-
-	if (!PyArg_ParseTuple(args, ":__reduce__"))
+	if (!PyArg_ParseTuple(args, ":sync"))
 		return NULL;
-	if ((state = radix_getstate(self)) == NULL)
+	if (disk_check_open(self) != 0)
 		return NULL;
-
-	ret = Py_BuildValue("(O()O)", radix_constructor, state);
-	Py_XDECREF(state);
-
-	return ret;
+	if (radix_disk_sync(self->disk) != 0)
+		return PyErr_SetFromErrno(PyExc_IOError);
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
-/* Used for unpickling */
+PyDoc_STRVAR(DiskRadix_close_doc,
+"DiskRadix.close() -> None\n\
+\n\
+Flushes and closes the tree file. Further operations raise ValueError.");
+
 static PyObject *
-Radix_setstate(RadixObject *self, PyObject *args)
+DiskRadix_close(DiskRadixObject *self, PyObject *args)
 {
-	PyObject *state, *tpl, *addr, *data;
-	int len, i;
-	RadixNodeObject *node;
-	prefix_t *prefix;
-	char *addr_string;
-	const char *errmsg;
-
-	if (!Radix_CheckExact(self)) {
-		PyErr_SetString(PyExc_ValueError, "not a Radix object");
-		return NULL;
-	}
-
-	/* XXX type-checking is overstrict here */
-	if (!PyArg_ParseTuple(args, "O!:__setstate__", &PyList_Type, &state))
+	if (!PyArg_ParseTuple(args, ":close"))
 		return NULL;
-
-	len = PyList_Size(state);
-	for (i = 0; i < len; i++) {
-		if ((tpl = PyList_GetItem(state, i)) == NULL)
-			return NULL;
-		if ((addr = PyTuple_GetItem(tpl, 0)) == NULL)
-			return NULL;
-		if ((data = PyTuple_GetItem(tpl, 1)) == NULL)
-			return NULL;
-		if ((addr_string = PyString_AsString(addr)) == NULL)
-			return NULL;
-		if ((prefix = prefix_pton(addr_string, -1, &errmsg)) == NULL) {
-			PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
-			    "Invalid address format");
-			return NULL;
-		}
-		if ((node = (RadixNodeObject *)create_add_node(self,
-		    prefix)) == NULL) {
-			Deref_Prefix(prefix);
-			return NULL;
-		}
-		Deref_Prefix(prefix);
-		Py_XDECREF(node->user_attr);
-		node->user_attr = data;
-		Py_INCREF(node->user_attr);
-	}
-
+	if (self->disk != NULL)
+		radix_disk_close(self->disk);
+	self->disk = NULL;
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
-static PyObject *
-Radix_getiter(RadixObject *self)
+static Py_ssize_t
+DiskRadix_length(DiskRadixObject *self)
 {
-	return (PyObject *)newRadixIterObject(self);
+	if (disk_check_open(self) != 0)
+		return (-1);
+	return (radix_disk_count(self->disk));
 }
 
-PyDoc_STRVAR(Radix_doc, "Radix tree");
+static PySequenceMethods DiskRadix_as_sequence = {
+	(lenfunc)DiskRadix_length,	/*sq_length*/
+};
 
-static PyMethodDef Radix_methods[] = {
-	{"add",		(PyCFunction)Radix_add,		METH_VARARGS|METH_KEYWORDS,	Radix_add_doc		},
-	{"delete",	(PyCFunction)Radix_delete,	METH_VARARGS|METH_KEYWORDS,	Radix_delete_doc	},
-	{"search_exact",(PyCFunction)Radix_search_exact,METH_VARARGS|METH_KEYWORDS,	Radix_search_exact_doc	},
-	{"search_best",	(PyCFunction)Radix_search_best,	METH_VARARGS|METH_KEYWORDS,	Radix_search_best_doc	},
-	{"nodes",	(PyCFunction)Radix_nodes,	METH_VARARGS,			Radix_nodes_doc		},
-	{"prefixes",	(PyCFunction)Radix_prefixes,	METH_VARARGS,			Radix_prefixes_doc	},
-	{"__getstate__",(PyCFunction)Radix_getstate,	METH_VARARGS,			NULL			},
-	{"__setstate__",(PyCFunction)Radix_setstate,	METH_VARARGS,			NULL			},
-	{"__reduce__",	(PyCFunction)Radix_reduce,	METH_VARARGS,			NULL			},
+PyDoc_STRVAR(DiskRadix_doc, "Disk-backed radix tree");
+
+static PyMethodDef DiskRadix_methods[] = {
+	{"add",		(PyCFunction)DiskRadix_add,	METH_VARARGS|METH_KEYWORDS,	DiskRadix_add_doc	},
+	{"delete",	(PyCFunction)DiskRadix_delete,	METH_VARARGS|METH_KEYWORDS,	DiskRadix_delete_doc	},
+	{"search_exact",(PyCFunction)DiskRadix_search_exact,METH_VARARGS|METH_KEYWORDS,	DiskRadix_search_exact_doc },
+	{"search_best",	(PyCFunction)DiskRadix_search_best,METH_VARARGS|METH_KEYWORDS,	DiskRadix_search_best_doc },
+	{"prefixes",	(PyCFunction)DiskRadix_prefixes,METH_VARARGS,			DiskRadix_prefixes_doc	},
+	{"sync",	(PyCFunction)DiskRadix_sync,	METH_VARARGS,			DiskRadix_sync_doc	},
+	{"close",	(PyCFunction)DiskRadix_close,	METH_VARARGS,			DiskRadix_close_doc	},
 	{NULL,		NULL}		/* sentinel */
 };
 
-static PyTypeObject Radix_Type = {
+static PyTypeObject DiskRadix_Type = {
 	/* The ob_type field must be initialized in the module init function
 	 * to be portable to Windows without using C++. */
 	PyVarObject_HEAD_INIT(NULL, 0)
-	"radix.Radix",		/*tp_name*/
-	sizeof(RadixObject),	/*tp_basicsize*/
+	"radix.DiskRadix",	/*tp_name*/
+	sizeof(DiskRadixObject),/*tp_basicsize*/
 	0,			/*tp_itemsize*/
 	/* methods */
-	(destructor)Radix_dealloc, /*tp_dealloc*/
+	(destructor)DiskRadix_dealloc, /*tp_dealloc*/
 	0,			/*tp_print*/
 	0,			/*tp_getattr*/
 	0,			/*tp_setattr*/
 	0,			/*tp_compare*/
 	0,			/*tp_repr*/
 	0,			/*tp_as_number*/
-	0,			/*tp_as_sequence*/
+	&DiskRadix_as_sequence,	/*tp_as_sequence*/
 	0,			/*tp_as_mapping*/
 	0,			/*tp_hash*/
 	0,			/*tp_call*/
@@ -705,14 +5151,14 @@ static PyTypeObject Radix_Type = {
 	0,			/*tp_setattro*/
 	0,			/*tp_as_buffer*/
 	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
-	Radix_doc,		/*tp_doc*/
+	DiskRadix_doc,		/*tp_doc*/
 	0,			/*tp_traverse*/
 	0,			/*tp_clear*/
 	0,			/*tp_richcompare*/
 	0,			/*tp_weaklistoffset*/
-	(getiterfunc)Radix_getiter, /*tp_iter*/
+	0,			/*tp_iter*/
 	0,			/*tp_iternext*/
-	Radix_methods,		/*tp_methods*/
+	DiskRadix_methods,	/*tp_methods*/
 	0,			/*tp_members*/
 	0,			/*tp_getset*/
 	0,			/*tp_base*/
@@ -729,104 +5175,112 @@ static PyTypeObject Radix_Type = {
 
 /* ------------------------------------------------------------------------ */
 
-/* RadixIter: radix tree iterator */
+/* MMDB: reader of MaxMind DB files */
 
-typedef struct _RadixIterObject {
+typedef struct {
 	PyObject_HEAD
-	RadixObject *parent;
-	radix_node_t *iterstack[RADIX_MAXBITS+1];
-	radix_node_t **sp;
-	radix_node_t *rn;
-	int af;
-	unsigned int gen_id;	/* Detect tree modifications */
-} RadixIterObject;
+	mmdb_t *db;
+} MMDBObject;
 
-static PyTypeObject RadixIter_Type;
+static PyTypeObject MMDB_Type;
 
-static RadixIterObject *
-newRadixIterObject(RadixObject *parent)
+static void
+MMDB_dealloc(MMDBObject *self)
 {
-	RadixIterObject *self;
-
-	self = PyObject_New(RadixIterObject, &RadixIter_Type);
-	if (self == NULL)
-		return NULL;
-
-	self->parent = parent;
-	Py_XINCREF(self->parent);
-
-	self->sp = self->iterstack;
-	self->rn = self->parent->rt4->head;
-	self->gen_id = self->parent->gen_id;
-	self->af = AF_INET;
-	return self;
+	if (self->db != NULL)
+		mmdb_close(self->db);
+	PyObject_Del(self);
 }
 
-/* RadixIter methods */
-
-static void
-RadixIter_dealloc(RadixIterObject *self)
+static int
+mmdb_check_open(MMDBObject *self)
 {
-	Py_XDECREF(self->parent);
-	PyObject_Del(self);
+	if (self->db == NULL) {
+		PyErr_SetString(PyExc_ValueError,
+		    "operation on closed MMDB");
+		return (-1);
+	}
+	return (0);
 }
 
+PyDoc_STRVAR(MMDB_lookup_doc,
+"MMDB.lookup(network[, packed]) -> data\n\
+\n\
+Returns the decoded record of the most specific network in the\n\
+database containing the address, or None if there is none.");
+
 static PyObject *
-RadixIter_iternext(RadixIterObject *self)
+MMDB_lookup(MMDBObject *self, PyObject *args, PyObject *kw_args)
 {
-	radix_node_t *node;
+	static char *keywords[] = { "network", "packed", NULL };
+	char *addr = NULL, *packed = NULL;
+	Py_ssize_t packlen = -1;
+	prefix_t *prefix;
 	PyObject *ret;
 
-	if (self->gen_id != self->parent->gen_id) {
-		PyErr_SetString(PyExc_RuntimeWarning,
-		    "Radix tree modified during iteration");
-		return (NULL);
-	}
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zz#:lookup",
+	    keywords, &addr, &packed, &packlen))
+		return NULL;
+	if (mmdb_check_open(self) != 0)
+		return NULL;
+	if ((prefix = args_to_prefix(addr, packed, packlen, -1)) == NULL)
+		return NULL;
+	ret = mmdb_lookup(self->db, prefix);
+	Deref_Prefix(prefix);
+	return ret;
+}
 
- again:
-	if ((node = self->rn) == NULL) {
-		/* We have walked both trees */
-		if (self->af == AF_INET6)
-			return NULL;
-		/* Otherwise reset and start walk of IPv6 tree */
-		self->sp = self->iterstack;
-		self->rn = self->parent->rt6->head;
-		self->af = AF_INET6;
-		goto again;
-	}
+PyDoc_STRVAR(MMDB_metadata_doc,
+"MMDB.metadata() -> dict\n\
+\n\
+Returns the metadata map of the database.");
 
-	/* Get next node */
-	if (self->rn->l) {
-		if (self->rn->r)
-			*self->sp++ = self->rn->r;
-		self->rn = self->rn->l;
-	} else if (self->rn->r)
-		self->rn = self->rn->r;
-	else if (self->sp != self->iterstack)
-		self->rn = *(--self->sp);
-	else
-		self->rn = NULL;
+static PyObject *
+MMDB_metadata(MMDBObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":metadata"))
+		return NULL;
+	if (mmdb_check_open(self) != 0)
+		return NULL;
+	return mmdb_metadata(self->db);
+}
 
-	if (node->prefix == NULL || node->data == NULL)
-		goto again;
+PyDoc_STRVAR(MMDB_close_doc,
+"MMDB.close() -> None\n\
+\n\
+Unmaps the database file. Further lookups raise ValueError.");
 
-	ret = node->data;
-	Py_INCREF(ret);
-	return (ret);
+static PyObject *
+MMDB_close(MMDBObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, ":close"))
+		return NULL;
+	if (self->db != NULL) {
+		mmdb_close(self->db);
+		self->db = NULL;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
-PyDoc_STRVAR(RadixIter_doc, 
-"Radix tree iterator");
+PyDoc_STRVAR(MMDB_doc, "MaxMind DB reader");
 
-static PyTypeObject RadixIter_Type = {
+static PyMethodDef MMDB_methods[] = {
+	{"lookup",	(PyCFunction)MMDB_lookup,	METH_VARARGS|METH_KEYWORDS,	MMDB_lookup_doc		},
+	{"metadata",	(PyCFunction)MMDB_metadata,	METH_VARARGS,			MMDB_metadata_doc	},
+	{"close",	(PyCFunction)MMDB_close,	METH_VARARGS,			MMDB_close_doc		},
+	{NULL,		NULL}		/* sentinel */
+};
+
+static PyTypeObject MMDB_Type = {
 	/* The ob_type field must be initialized in the module init function
 	 * to be portable to Windows without using C++. */
 	PyVarObject_HEAD_INIT(NULL, 0)
-	"radix.RadixIter",	/*tp_name*/
-	sizeof(RadixIterObject),/*tp_basicsize*/
+	"radix.MMDB",		/*tp_name*/
+	sizeof(MMDBObject),	/*tp_basicsize*/
 	0,			/*tp_itemsize*/
 	/* methods */
-	(destructor)RadixIter_dealloc, /*tp_dealloc*/
+	(destructor)MMDB_dealloc, /*tp_dealloc*/
 	0,			/*tp_print*/
 	0,			/*tp_getattr*/
 	0,			/*tp_setattr*/
@@ -842,14 +5296,14 @@ static PyTypeObject RadixIter_Type = {
 	0,			/*tp_setattro*/
 	0,			/*tp_as_buffer*/
 	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
-	RadixIter_doc,		/*tp_doc*/
+	MMDB_doc,		/*tp_doc*/
 	0,			/*tp_traverse*/
 	0,			/*tp_clear*/
 	0,			/*tp_richcompare*/
 	0,			/*tp_weaklistoffset*/
 	0,			/*tp_iter*/
-	(iternextfunc)RadixIter_iternext, /*tp_iternext*/
-	0,			/*tp_methods*/
+	0,			/*tp_iternext*/
+	MMDB_methods,		/*tp_methods*/
 	0,			/*tp_members*/
 	0,			/*tp_getset*/
 	0,			/*tp_base*/
@@ -886,8 +5340,65 @@ radix_Radix(PyObject *self, PyObject *args)
 	return (PyObject *)rv;
 }
 
+PyDoc_STRVAR(radix_DiskRadix_doc,
+"DiskRadix(path) -> new disk-backed radix tree object\n\
+\n\
+Opens (creating if necessary) a radix tree stored in the file 'path'.\n\
+Nodes are kept in fixed-size pages of the file, which is mapped into\n\
+memory, so trees larger than RAM may be queried while only the pages\n\
+on the lookup paths are resident. Each prefix holds an unsigned 64-bit\n\
+integer value rather than a data dict.");
+
+static PyObject *
+radix_DiskRadix(PyObject *self, PyObject *args)
+{
+	DiskRadixObject *rv;
+	const char *path, *errmsg = NULL;
+	radix_disk_t *disk;
+
+	if (!PyArg_ParseTuple(args, "s:DiskRadix", &path))
+		return NULL;
+	if ((disk = radix_disk_open(path, &errmsg)) == NULL) {
+		PyErr_SetString(PyExc_IOError, errmsg);
+		return NULL;
+	}
+	if ((rv = PyObject_New(DiskRadixObject, &DiskRadix_Type)) == NULL) {
+		radix_disk_close(disk);
+		return NULL;
+	}
+	rv->disk = disk;
+	return (PyObject *)rv;
+}
+
+PyDoc_STRVAR(radix_MMDB_doc,
+"MMDB(path) -> new MaxMind DB reader object\n\
+\n\
+Opens the MaxMind DB file 'path' for lookups. The file is mapped into\n\
+memory and records are decoded on demand.");
+
+static PyObject *
+radix_MMDB(PyObject *self, PyObject *args)
+{
+	MMDBObject *rv;
+	const char *path;
+	mmdb_t *db;
+
+	if (!PyArg_ParseTuple(args, "s:MMDB", &path))
+		return NULL;
+	if ((db = mmdb_open(path)) == NULL)
+		return NULL;
+	if ((rv = PyObject_New(MMDBObject, &MMDB_Type)) == NULL) {
+		mmdb_close(db);
+		return NULL;
+	}
+	rv->db = db;
+	return (PyObject *)rv;
+}
+
 static PyMethodDef radix_methods[] = {
 	{"Radix",	radix_Radix,	METH_VARARGS,	radix_Radix_doc	},
+	{"DiskRadix",	radix_DiskRadix,METH_VARARGS,	radix_DiskRadix_doc },
+	{"MMDB",	radix_MMDB,	METH_VARARGS,	radix_MMDB_doc	},
 	{NULL,		NULL}		/* sentinel */
 };
 
@@ -1020,8 +5531,26 @@ static PyObject *module_initialize(void)
 
 	if (PyType_Ready(&Radix_Type) < 0)
 		return NULL;
+#if PY_MAJOR_VERSION >= 3
+	str_packed = PyUnicode_InternFromString("packed");
+	str_network_address = PyUnicode_InternFromString("network_address");
+	str_prefixlen = PyUnicode_InternFromString("prefixlen");
+#else
+	str_packed = PyString_InternFromString("packed");
+	str_network_address = PyString_InternFromString("network_address");
+	str_prefixlen = PyString_InternFromString("prefixlen");
+#endif
+	if (str_packed == NULL || str_network_address == NULL ||
+	    str_prefixlen == NULL)
+		return NULL;
 	if (PyType_Ready(&RadixNode_Type) < 0)
 		return NULL;
+	if (PyType_Ready(&RadixCursor_Type) < 0)
+		return NULL;
+	if (PyType_Ready(&DiskRadix_Type) < 0)
+		return NULL;
+	if (PyType_Ready(&MMDB_Type) < 0)
+		return NULL;
 #if PY_MAJOR_VERSION >= 3
 	m = PyModule_Create(&radix_module_def);
 #else
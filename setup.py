@@ -24,7 +24,8 @@ VERSION = "0.5"
 
 if __name__ == '__main__':
 	libs = []
-	src = [ 'radix.c', 'radix_python.c' ]
+	src = [ 'radix.c', 'radix_disk.c', 'radix_mmdb.c',
+	    'radix_python.c' ]
 	if sys.platform == 'win32':
 		libs += [ 'ws2_32' ]
 		src += [ 'strlcpy.c' ]
@@ -22,6 +22,9 @@ import unittest
 import socket
 import struct
 import pickle
+import os
+import tempfile
+import ipaddress
 if sys.version_info[0] >= 3:
 	# for Py3K
 	t00_class_name = "<class 'radix.Radix'>"
@@ -376,6 +379,780 @@ class TestRadix(unittest.TestCase):
 		self.assertEquals(tree.search_best('10.0.0.0/15').prefix,
 		    '10.0.0.0/13')
 
+	def test_23__pickle_out_of_band(self):
+		if pickle.HIGHEST_PROTOCOL < 5:
+			return
+		tree = radix.Radix()
+		tree.add("10.0.0.0/8").data["a"] = 1
+		tree.add("dead:beef::/32").data["b"] = 2
+		tree.add("10.1.0.0/16")
+		buffers = []
+		tree_pickled = pickle.dumps(tree, protocol = 5,
+		    buffer_callback = buffers.append)
+		self.assertEquals(len(buffers), 1)
+		tree2 = pickle.loads(tree_pickled, buffers = buffers)
+		self.assertEquals(tree2.prefixes(), tree.prefixes())
+		self.assertEquals(tree2.search_exact("10.0.0.0/8").data["a"], 1)
+		self.assertEquals(tree2.search_best("dead:beef::1").data["b"], 2)
+
+	def test_24__setstate_old_format(self):
+		tree = radix.Radix()
+		tree.__setstate__([(b"10.0.0.0/8", {"a": 1}),
+		    (b"10.0.0.0/16", {"b": 2})])
+		self.assertEquals(tree.search_exact("10.0.0.0/8").data["a"], 1)
+		self.assertEquals(tree.search_best("10.0.0.1").data["b"], 2)
+		self.assertRaises(ValueError, tree.__setstate__,
+		    (1, b"\x04\x40\x0a\x00\x00\x00", [{}]))
+		for state in (1, "10.0.0.0/8", {}):
+			self.assertRaises(TypeError, tree.__setstate__, state)
+
+	def test_25__disk_radix(self):
+		fd, path = tempfile.mkstemp()
+		os.close(fd)
+		os.unlink(path)
+		try:
+			tree = radix.DiskRadix(path)
+			tree.add("10.0.0.0/8", value = 1)
+			tree.add("10.0.0.0/16", value = 2)
+			tree.add("dead:beef::/32", value = 3)
+			tree.delete("10.0.0.0/16")
+			self.assertRaises(KeyError, tree.delete, "10.0.0.0/16")
+			tree.close()
+			self.assertRaises(ValueError, len, tree)
+			tree = radix.DiskRadix(path)
+			self.assertEquals(len(tree), 2)
+			self.assertEquals(tree.search_best("10.0.0.1"),
+			    ("10.0.0.0/8", 1))
+			self.assertEquals(tree.search_exact("dead:beef::/32"),
+			    ("dead:beef::/32", 3))
+			self.assertEquals(tree.search_exact("10.0.0.0/16"), None)
+			self.assertEquals(sorted(tree.prefixes()),
+			    ["10.0.0.0/8", "dead:beef::/32"])
+			tree.close()
+		finally:
+			os.unlink(path)
+
+	def test_26__journal_replay(self):
+		fd, path = tempfile.mkstemp()
+		os.close(fd)
+		os.unlink(path)
+		try:
+			tree = radix.Radix()
+			tree.journal(path, batch = 4)
+			tree.add("10.0.0.0/8").data["a"] = 1
+			tree.add("10.1.0.0/16")
+			offset = tree.sync()
+			snapshot = pickle.dumps(tree)
+			tree.add("dead:beef::/32")
+			tree.delete("10.1.0.0/16")
+			tree.add("192.168.0.0/24")
+			tree.journal(None)
+			self.assertRaises(ValueError, tree.sync)
+			# Simulate a crash in the middle of writing a record
+			f = open(path, "ab")
+			f.write(b"\x01\x04")
+			f.close()
+
+			tree2 = pickle.loads(snapshot)
+			tree2.replay(path, offset)
+			self.assertEquals(sorted(tree2.prefixes()),
+			    sorted(tree.prefixes()))
+			self.assertEquals(tree2.search_best("10.1.2.3").data["a"], 1)
+			tree3 = radix.Radix()
+			end = tree3.replay(path)
+			self.assertEquals(end, os.path.getsize(path) - 2)
+			self.assertEquals(sorted(tree3.prefixes()),
+			    sorted(tree.prefixes()))
+			# Reopening cuts off the torn record before appending
+			tree.journal(path)
+			tree.add("172.16.0.0/12")
+			tree.journal(None)
+			tree4 = radix.Radix()
+			self.assertEquals(tree4.replay(path), os.path.getsize(path))
+			self.assertEquals(sorted(tree4.prefixes()),
+			    sorted(tree.prefixes()))
+			# A bad record that is not at the end is an error
+			f = open(path, "r+b")
+			f.seek(offset + 1)
+			f.write(b"\x05")
+			f.close()
+			self.assertRaises(IOError, radix.Radix().replay, path)
+			self.assertRaises(IOError, tree.journal, path)
+		finally:
+			os.unlink(path)
+
+	def test_27__mmdb(self):
+		fd, path = tempfile.mkstemp()
+		os.close(fd)
+		try:
+			tree = radix.Radix()
+			tree.add("10.0.0.0/8").data.update(
+			    { "asn": 65001, "name": "ten", "tags": [ "a", "b" ] })
+			tree.add("10.1.0.0/16").data["asn"] = -1
+			tree.add("2001:db8::/32").data["ok"] = True
+			tree.add("::/0").data["default"] = 1.5
+			tree.export_mmdb(path, description = "test")
+
+			db = radix.MMDB(path)
+			meta = db.metadata()
+			self.assertEquals(meta["ip_version"], 6)
+			self.assertEquals(meta["description"], { "en": "test" })
+			self.assertEquals(db.lookup("10.2.3.4")["tags"], [ "a", "b" ])
+			self.assertEquals(db.lookup("10.1.2.3"), { "asn": -1 })
+			self.assertEquals(db.lookup("2001:db8::1"), { "ok": True })
+			self.assertEquals(db.lookup("3000::1"), { "default": 1.5 })
+			# ::/0 must not leak into the IPv4 space
+			self.assertEquals(db.lookup("11.0.0.1"), None)
+			db.close()
+			self.assertRaises(ValueError, db.lookup, "10.0.0.1")
+
+			tree2 = radix.Radix()
+			tree2.load_mmdb(path)
+			for addr in [ "10.2.3.4", "10.1.2.3", "2001:db8::1",
+			    "3000::1", "10.255.0.1" ]:
+				self.assertEquals(tree2.search_best(addr).data,
+				    tree.search_best(addr).data)
+			self.assertEquals(tree2.search_best("11.0.0.1"), None)
+			# A map key that is not a string is corruption
+			f = open(path, "rb")
+			buf = f.read()
+			f.close()
+			self.assertEquals(buf.count(b"\x42ok"), 1)
+			f = open(path, "wb")
+			f.write(buf.replace(b"\x42ok", b"\xe0\xe0\xe0"))
+			f.close()
+			db = radix.MMDB(path)
+			self.assertRaises(ValueError, db.lookup, "2001:db8::1")
+			db.close()
+			self.assertRaises(ValueError, radix.Radix().load_mmdb, path)
+			# IPv6 prefixes where the IPv4 space is are refused
+			tree.add("::/96")
+			self.assertRaises(ValueError, tree.export_mmdb, path)
+		finally:
+			os.unlink(path)
+
+	def test_28__columns(self):
+		tree = radix.Radix()
+		tree.add("10.0.0.0/8").data["a"] = 1
+		tree.add("10.0.0.0/16")
+		tree.add("dead:beef::/32").data["b"] = 2
+		cols = tree.to_columns()
+		self.assertEquals(len(cols["address"]), 48)
+		self.assertEquals(cols["address"][:16].tobytes(),
+		    b"\x00" * 10 + b"\xff\xff\x0a\x00\x00\x00")
+		self.assertEquals(list(cols["masklen"]), [ 8, 16, 32 ])
+		self.assertEquals(list(cols["family"]), [ 4, 4, 6 ])
+		self.assertEquals(cols["data"][0], { "a": 1 })
+		self.assertEquals(cols["data"][1], {})
+		cols4 = tree.to_columns(family = socket.AF_INET)
+		self.assertEquals(list(cols4["address"]), [ 0x0a000000 ] * 2)
+
+		tree2 = radix.Radix()
+		tree2.from_columns(cols)
+		self.assertEquals(tree2.prefixes(), tree.prefixes())
+		self.assert_(tree2.search_exact("10.0.0.0/8").data is
+		    tree.search_exact("10.0.0.0/8").data)
+		tree3 = radix.Radix()
+		tree3.from_columns(cols4["address"], cols4["masklen"])
+		self.assertEquals(tree3.prefixes(), [ "10.0.0.0/8", "10.0.0.0/16" ])
+		self.assertRaises(ValueError, tree3.from_columns,
+		    cols["address"], cols4["masklen"])
+
+	def test_29__contains_and_args(self):
+		tree = radix.Radix()
+		tree.add("10.0.0.0/8")
+		tree.add(network = "10.1.0.0", masklen = 16)
+		self.assert_("10.0.0.0/8" in tree)
+		self.assert_(b"10.1.0.0/16" in tree)
+		self.assert_("10.1.0.0/17" not in tree)
+		self.assert_("10.1.2.3" not in tree)
+		self.assertRaises(ValueError, tree.__contains__, "blah")
+		self.assertEquals(tree.search_best("10.1.2.3", 32).prefix,
+		    "10.1.0.0/16")
+		self.assertEquals(tree.search_exact(b"10.1.0.0/16").prefix,
+		    "10.1.0.0/16")
+		self.assertRaises(TypeError, tree.search_best, "10.1.2.3",
+		    network = "10.1.2.3")
+		self.assertRaises(TypeError, tree.search_best, "10.1.2.3", bad = 1)
+		self.assertRaises(TypeError, tree.search_best, "1", 2, b"3", 4)
+		self.assertRaises(TypeError, tree.search_best, None)
+
+	def test_30__address_objects(self):
+		tree = radix.Radix()
+		tree.add(ipaddress.ip_network("10.0.0.0/8"))
+		tree.add(0x0a010000, 16)
+		tree.add(1, family = socket.AF_INET6)
+		self.assertEquals(sorted(tree.prefixes()),
+		    [ "10.0.0.0/8", "10.1.0.0/16", "::1/128" ])
+		self.assertEquals(tree.search_best(
+		    ipaddress.ip_address("10.1.2.3")).prefix, "10.1.0.0/16")
+		self.assertEquals(tree.search_best(0x0a020304).prefix,
+		    "10.0.0.0/8")
+		self.assertEquals(tree.search_best(
+		    memoryview(b"\x0a\x01\x00\x01")).prefix, "10.1.0.0/16")
+		self.assertEquals(tree.search_exact(
+		    packed = bytearray(b"\x0a\x00\x00\x00"), masklen = 8).prefix,
+		    "10.0.0.0/8")
+		self.assert_(ipaddress.ip_network("10.1.0.0/16") in tree)
+		tree.delete(ipaddress.ip_network("10.1.0.0/16"))
+		self.assertEquals(tree.search_best(0x0a010203).prefix, "10.0.0.0/8")
+		self.assertRaises(ValueError, tree.add, -1)
+		self.assertRaises(ValueError, tree.add, 1 << 32,
+		    family = socket.AF_INET)
+		self.assertRaises(ValueError, tree.add, "10.0.0.0",
+		    family = socket.AF_INET6)
+		self.assertRaises(TypeError, tree.add, 1.5)
+
+	def test_31__node_reuse(self):
+		tree = radix.Radix()
+		node = tree.add("10.0.0.0/8")
+		node.data["a"] = 1
+		tree.delete("10.0.0.0/8")
+		# A detached node keeps its identity
+		self.assertEquals(node.prefix, "10.0.0.0/8")
+		self.assertEquals(node.packed, b"\x0a\x00\x00\x00")
+		self.assertEquals(node.data, { "a": 1 })
+		del node
+		for i in range(100):
+			node = tree.add("10.0.0.0/8")
+			self.assertEquals(node.data, {})
+			self.assertEquals(node.prefixlen, 8)
+			node.data["b"] = i
+			tree.delete("10.0.0.0/8")
+		self.assertEquals(node.data, { "b": 99 })
+		self.assertEquals(tree.prefixes(), [])
+
+	def test_32__items(self):
+		tree = radix.Radix()
+		for i in range(10):
+			tree.add("10.0.%d.0/24" % i).data["i"] = i
+		tree.add("dead:beef::/32")
+		chunks = list(tree.items(chunk = 4))
+		self.assertEquals([ len(c) for c in chunks ], [ 4, 4, 3 ])
+		self.assertEquals(chunks[0][1],
+		    (b"\x0a\x00\x01\x00", 24, { "i": 1 }))
+		self.assertEquals(chunks[2][2][2], {})
+		items = [ i for c in tree.items(fields = ("prefix", "family"))
+		    for i in c ]
+		self.assertEquals([ i[0] for i in items ],
+		    [ n.prefix for n in tree ])
+		self.assertEquals(items[-1][1], socket.AF_INET6)
+		records = b"".join(tree.items(chunk = 3, fields = None))
+		self.assertEquals(len(records), 10 * 6 + 18)
+		self.assertEquals(records[:6], b"\x04\x18\x0a\x00\x00\x00")
+		self.assertRaises(ValueError, tree.items, fields = ("bogus",))
+		self.assertRaises(ValueError, tree.items, chunk = 0)
+
+	def test_33__search_covered(self):
+		tree = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16",
+		    "10.1.2.0/24", "11.0.0.0/8", "0.0.0.0/0", "dead:beef::/32" ]:
+			tree.add(prefix)
+		self.assertEquals([ n.prefix for n in
+		    tree.search_covered("10.1.0.0/16") ],
+		    [ "10.1.0.0/16", "10.1.2.0/24" ])
+		self.assertEquals([ n.prefix for n in
+		    tree.search_covered("10.0.0.0", 8) ],
+		    [ "10.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16", "10.1.2.0/24" ])
+		self.assertEquals(tree.search_covered("10.2.0.0/16"), [])
+		self.assertEquals(tree.search_covered("12.0.0.0/8"), [])
+		self.assertEquals(tree.count_covered("0.0.0.0/0"), 6)
+		self.assertEquals(tree.count_covered("::/0"), 1)
+		self.assertEquals([ n.prefix for n in
+		    tree.iter_covered("10.0.0.0/15") ],
+		    [ "10.0.0.0/16", "10.1.0.0/16", "10.1.2.0/24" ])
+		self.assertEquals(list(tree.iter_covered("1.0.0.0/8")), [])
+
+	def test_34__search_covering(self):
+		tree = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16",
+		    "10.1.2.0/24", "0.0.0.0/0", "dead:beef::/32" ]:
+			tree.add(prefix)
+		self.assertEquals([ n.prefix for n in
+		    tree.search_covering("10.1.2.3") ],
+		    [ "10.1.2.0/24", "10.1.0.0/16", "10.0.0.0/8", "0.0.0.0/0" ])
+		self.assertEquals([ n.prefix for n in
+		    tree.search_covering("10.1.0.0/16") ],
+		    [ "10.1.0.0/16", "10.0.0.0/8", "0.0.0.0/0" ])
+		self.assertEquals(tree.search_covering("dead::1"), [])
+		self.assertEquals(tree.search_containing("10.1.0.0/16").prefix,
+		    "10.0.0.0/8")
+		self.assertEquals(tree.search_containing("10.1.2.3").prefix,
+		    "10.1.2.0/24")
+		self.assertEquals(tree.search_containing("0.0.0.0/0"), None)
+		self.assertEquals(tree.search_worst("10.1.2.3").prefix,
+		    "0.0.0.0/0")
+		self.assertEquals(tree.search_worst("dead:beef::1").prefix,
+		    "dead:beef::/32")
+		self.assertEquals(tree.search_worst("dead::1"), None)
+		addrs = [ "10.1.2.3", "11.0.0.1", "dead::1" ]
+		self.assertEquals(tree.search_best_many(addrs),
+		    [ tree.search_best(a) for a in addrs ])
+		self.assertEquals(tree.search_worst_many(addrs),
+		    [ tree.search_worst(a) for a in addrs ])
+		self.assertEquals(tree.search_covering_many(addrs),
+		    [ tree.search_covering(a) for a in addrs ])
+		self.assertRaises(ValueError, tree.search_worst_many, [ "bogus" ])
+
+	def test_35__cursor(self):
+		tree = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16",
+		    "10.1.2.0/24", "0.0.0.0/0", "dead:beef::/32" ]:
+			tree.add(prefix)
+		cursor = tree.cursor()
+		nodes, resume = cursor.next(2)
+		self.assertEquals([ n.prefix for n in nodes ],
+		    [ "0.0.0.0/0", "10.0.0.0/8" ])
+		nodes, end = cursor.next(10)
+		self.assertEquals([ n.prefix for n in nodes ],
+		    [ "10.0.0.0/16", "10.1.0.0/16", "10.1.2.0/24",
+		    "dead:beef::/32" ])
+		self.assertEquals(end, None)
+		# Resume keys survive modifications of the tree
+		tree.delete("10.0.0.0/8")
+		tree.add("10.0.0.0/12")
+		nodes, resume = tree.cursor(resume).next(2)
+		self.assertEquals([ n.prefix for n in nodes ],
+		    [ "10.0.0.0/12", "10.0.0.0/16" ])
+		cursor = tree.cursor()
+		cursor.seek("10.1.0.0/16")
+		self.assertEquals([ n.prefix for n in cursor.next(2)[0] ],
+		    [ "10.1.0.0/16", "10.1.2.0/24" ])
+		cursor.seek("10.1.0.0/17")
+		self.assertEquals([ n.prefix for n in cursor.next(2)[0] ],
+		    [ "10.1.2.0/24", "dead:beef::/32" ])
+		self.assertRaises(ValueError, tree.cursor, b"bogus")
+		# An empty page would give None, which restarts the walk
+		self.assertRaises(ValueError, cursor.next, 0)
+		self.assertRaises(ValueError, cursor.next, -1)
+
+	def test_36__next_prev_prefix(self):
+		tree = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16",
+		    "10.1.2.0/24", "dead:beef::/32" ]:
+			tree.add(prefix)
+		self.assertEquals(tree.next_prefix("10.0.0.0/8").prefix,
+		    "10.0.0.0/16")
+		self.assertEquals(tree.next_prefix("10.0.5.0/24").prefix,
+		    "10.1.0.0/16")
+		self.assertEquals(tree.next_prefix("10.1.2.0/24").prefix,
+		    "dead:beef::/32")
+		self.assertEquals(tree.next_prefix("dead:beef::/32"), None)
+		self.assertEquals(tree.prev_prefix("10.1.2.0/24").prefix,
+		    "10.1.0.0/16")
+		self.assertEquals(tree.prev_prefix("10.0.5.0/24").prefix,
+		    "10.0.0.0/16")
+		self.assertEquals(tree.prev_prefix("::/0").prefix,
+		    "10.1.2.0/24")
+		self.assertEquals(tree.prev_prefix("10.0.0.0/8"), None)
+		addrs = [ "9.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16", "10.1.0.1",
+		    "11.0.0.0/8", "dead:beef::1" ]
+		self.assertEquals(tree.next_prefix_many(addrs),
+		    [ tree.next_prefix(a) for a in addrs ])
+		self.assertEquals(tree.prev_prefix_many(addrs),
+		    [ tree.prev_prefix(a) for a in addrs ])
+		self.assertRaises(ValueError, tree.next_prefix_many,
+		    [ "11.0.0.0/8", "10.0.0.0/8" ])
+
+	def test_37__rank_select(self):
+		tree = radix.Radix()
+		self.assertEquals(len(tree), 0)
+		prefixes = [ "0.0.0.0/0", "10.0.0.0/8", "10.0.0.0/16",
+		    "10.1.0.0/16", "10.1.2.0/24", "dead:beef::/32" ]
+		for prefix in prefixes:
+			tree.add(prefix)
+		tree.add("10.0.0.0/16")
+		self.assertEquals(len(tree), 6)
+		self.assertEquals(tree.num_prefixes(), 6)
+		for i in range(len(prefixes)):
+			self.assertEquals(tree.select(i).prefix, prefixes[i])
+			self.assertEquals(tree.rank(prefixes[i]), i)
+		self.assertEquals(tree.select(-1).prefix, "dead:beef::/32")
+		self.assertRaises(IndexError, tree.select, 6)
+		self.assertEquals(tree.rank("10.0.5.0/24"), 3)
+		self.assertEquals(tree.rank("::/0"), 5)
+		tree.delete("10.0.0.0/8")
+		self.assertEquals(len(tree), 5)
+		self.assertEquals(tree.count_covered("10.0.0.0/8"), 3)
+		self.assertEquals(tree.select(1).prefix, "10.0.0.0/16")
+
+	def test_38__search_range(self):
+		tree = radix.Radix()
+		for prefix in [ "0.0.0.0/0", "10.0.0.0/8", "10.0.0.0/16",
+		    "10.1.0.0/16", "10.1.2.0/24", "11.0.0.0/8",
+		    "dead:beef::/32" ]:
+			tree.add(prefix)
+		self.assertEquals([ n.prefix for n in
+		    tree.search_range("10.0.255.7", "10.1.1.255") ],
+		    [ "0.0.0.0/0", "10.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16" ])
+		self.assertEquals([ n.prefix for n in
+		    tree.search_range("10.1.2.200", "11.0.0.0") ],
+		    [ "0.0.0.0/0", "10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24",
+		    "11.0.0.0/8" ])
+		self.assertEquals([ n.prefix for n in
+		    tree.search_range("10.0.0.0/8", "10.1.0.0/16") ],
+		    [ "0.0.0.0/0", "10.0.0.0/8", "10.0.0.0/16", "10.1.0.0/16",
+		    "10.1.2.0/24" ])
+		self.assertEquals(tree.search_range("dead::", "dead:bee0::"),
+		    [])
+		ranges = [ ("12.0.0.0", "12.0.0.9"), ("dead::", "dead:bef0::") ]
+		self.assertEquals(tree.search_range_many(ranges),
+		    [ tree.search_range(a, b) for a, b in ranges ])
+		self.assertRaises(ValueError, tree.search_range, "10.0.0.2",
+		    "10.0.0.1")
+		self.assertRaises(ValueError, tree.search_range, "10.0.0.2",
+		    "::1")
+
+	def test_39__set_algebra(self):
+		a = radix.Radix()
+		b = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.1.0.0/16", "0.0.0.0/1",
+		    "dead:beef::/32" ]:
+			a.add(prefix).data["tree"] = "a"
+		for prefix in [ "10.1.0.0/16", "10.2.0.0/16", "128.0.0.0/1" ]:
+			b.add(prefix).data["tree"] = "b"
+		union = a.union(b)
+		self.assertEquals([ n.prefix for n in union ],
+		    [ "0.0.0.0/1", "10.0.0.0/8", "10.1.0.0/16", "10.2.0.0/16",
+		    "128.0.0.0/1", "dead:beef::/32" ])
+		self.assertEquals(union.search_exact("10.1.0.0/16").data,
+		    { "tree": "a" })
+		self.assertEquals([ n.prefix for n in a.intersection(b) ],
+		    [ "10.1.0.0/16" ])
+		self.assertEquals([ n.prefix for n in a.difference(b) ],
+		    [ "0.0.0.0/1", "10.0.0.0/8", "dead:beef::/32" ])
+		self.assertEquals([ n.prefix for n in
+		    a.symmetric_difference(b) ],
+		    [ "0.0.0.0/1", "10.0.0.0/8", "10.2.0.0/16", "128.0.0.0/1",
+		    "dead:beef::/32" ])
+		self.assertEquals([ n.prefix for n in
+		    a.union(b, mode="address") ],
+		    [ "0.0.0.0/0", "dead:beef::/32" ])
+		self.assertEquals([ n.prefix for n in
+		    a.intersection(b, mode="address") ],
+		    [ "10.1.0.0/16", "10.2.0.0/16" ])
+		self.assertEquals([ n.prefix for n in
+		    b.difference(a, mode="address") ], [ "128.0.0.0/1" ])
+		self.assertEquals([ n.prefix for n in
+		    a.difference(b, mode="address") ],
+		    [ "0.0.0.0/5", "8.0.0.0/7", "10.0.0.0/16", "10.3.0.0/16",
+		    "10.4.0.0/14", "10.8.0.0/13", "10.16.0.0/12",
+		    "10.32.0.0/11", "10.64.0.0/10", "10.128.0.0/9",
+		    "11.0.0.0/8", "12.0.0.0/6", "16.0.0.0/4", "32.0.0.0/3",
+		    "64.0.0.0/2", "dead:beef::/32" ])
+		self.assertRaises(ValueError, a.union, b, mode="bogus")
+		self.assertRaises(TypeError, a.union, [])
+
+	def test_40__aggregate(self):
+		tree = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.1.0.0/16", "10.2.0.0/24",
+		    "10.2.1.0/24", "192.168.0.0/24", "192.168.1.0/24",
+		    "192.168.2.7/32", "dead:beef::/33", "dead:beef:8000::/33" ]:
+			tree.add(prefix)
+		tree.add("192.168.1.0/24").data["pop"] = "lhr"
+		self.assertEquals([ n.prefix for n in tree.aggregate() ],
+		    [ "10.0.0.0/8", "192.168.0.0/24", "192.168.1.0/24",
+		    "192.168.2.7/32", "dead:beef::/32" ])
+		agg = tree.aggregate(max_len=(24, 48))
+		self.assertEquals([ n.prefix for n in agg ],
+		    [ "10.0.0.0/8", "192.168.0.0/24", "192.168.1.0/24",
+		    "192.168.2.0/24", "dead:beef::/32" ])
+		self.assertEquals(agg.search_exact("192.168.1.0/24").data,
+		    { "pop": "lhr" })
+		self.assertEquals([ n.prefix for n in
+		    tree.aggregate(payload_equal=lambda a, b: True) ],
+		    [ "10.0.0.0/8", "192.168.0.0/23", "192.168.2.7/32",
+		    "dead:beef::/32" ])
+		# A data dict that was never used is an empty one
+		tree.search_exact("10.1.0.0/16").data
+		self.assertEquals(tree.aggregate().prefixes()[0], "10.0.0.0/8")
+		self.assertEquals(tree.aggregate(payload_equal=lambda a, b:
+		    a.get("pop") == b.get("pop")).prefixes(),
+		    tree.aggregate().prefixes())
+
+	def test_41__compress_fib(self):
+		tree = radix.Radix()
+		for prefix, nexthop in [ ("10.0.0.0/8", "a"),
+		    ("10.0.0.0/9", "b"), ("10.128.0.0/9", "b"),
+		    ("10.1.0.0/16", "a"), ("192.168.0.0/24", "a"),
+		    ("192.168.1.0/24", "b"), ("dead:beef::/32", "a") ]:
+			tree.add(prefix).data["nh"] = nexthop
+		fib = tree.compress_fib()
+		self.assertEquals([ (n.prefix, n.data["nh"]) for n in fib ],
+		    [ ("10.0.0.0/8", "b"), ("10.1.0.0/16", "a"),
+		    ("192.168.0.0/23", "a"), ("192.168.1.0/24", "b"),
+		    ("dead:beef::/32", "a") ])
+		for addr in [ "10.0.0.1", "10.1.2.3", "10.200.0.1",
+		    "192.168.1.1", "192.168.2.1", "dead:beef::1" ]:
+			a = tree.search_best(addr)
+			b = fib.search_best(addr)
+			self.assertEquals(a and a.data, b and b.data)
+		fib = tree.compress_fib(key=lambda data: 0)
+		self.assertEquals([ n.prefix for n in fib ],
+		    [ "10.0.0.0/8", "192.168.0.0/23", "dead:beef::/32" ])
+		tree.add("172.16.0.0/12")
+		fib = tree.compress_fib(key=lambda data: data.get("nh"))
+		self.assertEquals(fib.search_exact("172.16.0.0/12").data, {})
+
+	def test_42__diff(self):
+		old = radix.Radix()
+		new = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.1.0.0/16", "192.168.0.0/24",
+		    "dead:beef::/32" ]:
+			old.add(prefix).data["nh"] = "a"
+		for prefix in [ "10.0.0.0/8", "10.2.0.0/16", "192.168.0.0/24",
+		    "dead:beef::/32" ]:
+			new.add(prefix).data["nh"] = "a"
+		new.search_exact("192.168.0.0/24").data["nh"] = "b"
+		new.add("172.16.0.0/12")
+		old.add("172.16.0.0/12").data
+		self.assertEquals(old.diff(new), ([ "10.2.0.0/16" ],
+		    [ "10.1.0.0/16" ], [ "192.168.0.0/24" ]))
+		self.assertEquals(old.diff(new, compare_payload=False),
+		    ([ "10.2.0.0/16" ], [ "10.1.0.0/16" ], []))
+		self.assertEquals(old.diff(new,
+		    compare_payload=lambda a, b: True)[2], [])
+		self.assertEquals(new.diff(new), ([], [], []))
+
+	def test_43__merkle_hash(self):
+		a = radix.Radix()
+		b = radix.Radix()
+		prefixes = [ "10.0.0.0/8", "10.1.0.0/16", "10.2.0.0/16",
+		    "192.168.0.0/24", "dead:beef::/32" ]
+		for prefix in prefixes:
+			a.add(prefix).data["nh"] = prefix
+		for prefix in reversed(prefixes):
+			b.add(prefix).data["nh"] = prefix
+		self.assertEquals(radix.Radix().root_hash(), 0)
+		self.assertEquals(a.root_hash(), b.root_hash())
+		b.search_exact("10.2.0.0/16").data["nh"] = "x"
+		self.assertNotEquals(a.root_hash(), b.root_hash())
+		self.assertEquals(a.subtree_hash("192.168.0.0/16"),
+		    b.subtree_hash("192.168.0.0/16"))
+		self.assertNotEquals(a.subtree_hash("10.2.0.0/15"),
+		    b.subtree_hash("10.2.0.0/15"))
+		self.assertEquals(a.subtree_hash("172.16.0.0/12"), 0)
+		self.assertEquals(a.diff(b), ([], [], [ "10.2.0.0/16" ]))
+		b.search_exact("10.2.0.0/16").data["nh"] = "10.2.0.0/16"
+		b.delete("dead:beef::/32")
+		b.add("dead:beef::/32").data["nh"] = "dead:beef::/32"
+		self.assertEquals(a.root_hash(), b.root_hash())
+		self.assertNotEquals(a.root_hash(digest=lambda d: ""),
+		    b.root_hash())
+
+	def test_44__complement(self):
+		tree = radix.Radix()
+		for prefix in [ "10.0.0.0/9", "10.192.0.0/10", "10.200.0.0/16",
+		    "172.16.0.0/12", "dead:beef::/32" ]:
+			tree.add(prefix)
+		self.assertEquals([ n.prefix for n in
+		    tree.complement("10.0.0.0/8") ], [ "10.128.0.0/10" ])
+		self.assertEquals([ n.prefix for n in
+		    tree.complement("10.192.0.0/16") ], [])
+		self.assertEquals([ n.prefix for n in
+		    tree.complement("172.0.0.0/10") ], [ "172.0.0.0/12",
+		    "172.32.0.0/11" ])
+		self.assertEquals([ n.prefix for n in
+		    tree.complement("192.168.0.0/16") ], [ "192.168.0.0/16" ])
+		self.assertEquals(tree.complement("dead:beee::/31", packed=True),
+		    b"\x06\x20\xde\xad\xbe\xee" + b"\x00" * 12)
+
+	def test_45__allocate(self):
+		tree = radix.Radix()
+		tree.add("10.0.0.0/16")
+		tree.add("10.0.0.0/24")
+		tree.add("10.0.2.0/23")
+		tree.add("10.0.4.0/24")
+		self.assertEquals(tree.allocate("10.0.0.0/16", 24).prefix,
+		    "10.0.1.0/24")
+		self.assertEquals(tree.allocate("10.0.0.0/16", 23).prefix,
+		    "10.0.6.0/23")
+		tree.delete("10.0.4.0/24")
+		self.assertEquals(tree.allocate("10.0.0.0/16", 25,
+		    strategy="best_fit").prefix, "10.0.4.0/25")
+		self.assertEquals(tree.allocate("10.0.0.0/16", 25).prefix,
+		    "10.0.4.128/25")
+		self.assertEquals(tree.allocate("10.0.1.0/24", 24), None)
+		self.assertEquals(tree.allocate("dead:beef::/32", 48).prefix,
+		    "dead:beef::/48")
+		self.assertEquals(radix.Radix().allocate("::/0", 1).prefix,
+		    "::/1")
+		self.assertRaises(ValueError, tree.allocate, "10.0.0.0/16", 8)
+
+	def test_46__coverage(self):
+		tree = radix.Radix()
+		self.assertEquals(tree.coverage(socket.AF_INET), 0)
+		for prefix in [ "10.0.0.0/8", "10.1.0.0/16", "10.0.0.0/9",
+		    "192.168.0.0/24", "192.168.1.0/25", "::/1", "8000::/1" ]:
+			tree.add(prefix)
+		self.assertEquals(tree.coverage(socket.AF_INET),
+		    2 ** 24 + 256 + 128)
+		self.assertEquals(tree.coverage(within="10.1.2.0/24"), 256)
+		self.assertEquals(tree.coverage(within="192.168.0.0/16"),
+		    256 + 128)
+		self.assertEquals(tree.coverage(within="172.16.0.0/12"), 0)
+		self.assertEquals(tree.coverage(socket.AF_INET6), 2 ** 128)
+		tree.delete("10.0.0.0/8")
+		self.assertEquals(tree.coverage(within="10.0.0.0/8"),
+		    2 ** 23)
+		self.assertRaises(TypeError, tree.coverage)
+
+	def test_47__add_range(self):
+		tree = radix.Radix()
+		self.assertEquals(tree.add_range("10.0.0.1", "10.0.0.10",
+		    { "cc": "nz" }), 5)
+		self.assertEquals([ (n.prefix, n.data) for n in tree ],
+		    [ ("10.0.0.1/32", { "cc": "nz" }),
+		    ("10.0.0.2/31", { "cc": "nz" }),
+		    ("10.0.0.4/30", { "cc": "nz" }),
+		    ("10.0.0.8/31", { "cc": "nz" }),
+		    ("10.0.0.10/32", { "cc": "nz" }) ])
+		self.assertEquals(tree.add_range("10.0.0.11", "10.0.0.0/24"), 6)
+		self.assertEquals(tree.add_range("::", "ffff:ffff:ffff:ffff:"
+		    "ffff:ffff:ffff:ffff"), 1)
+		tree.add("192.168.0.0/24")
+		self.assertEquals(tree.ranges(), [ ("10.0.0.1", "10.0.0.255"),
+		    ("192.168.0.0", "192.168.0.255"),
+		    ("::", "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff") ])
+		self.assertEquals(tree.ranges(socket.AF_INET6),
+		    [ ("::", "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff") ])
+		self.assertRaises(ValueError, tree.add_range, "10.0.0.2",
+		    "10.0.0.1")
+
+	def test_48__delete_covered_prune(self):
+		tree = radix.Radix()
+		for prefix in [ "10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24",
+		    "10.2.0.0/16", "11.0.0.0/8", "dead:beef::/32" ]:
+			tree.add(prefix)
+		node = tree.search_exact("10.1.2.0/24")
+		self.assertEquals(tree.delete_covered("10.1.0.0/16"), 2)
+		self.assertEquals(tree.delete_covered("10.1.0.0/16"), 0)
+		self.assertEquals(tree.prefixes(), [ "10.0.0.0/8", "10.2.0.0/16",
+		    "11.0.0.0/8", "dead:beef::/32" ])
+		self.assertEquals(node.prefix, "10.1.2.0/24")
+		tree.search_exact("10.2.0.0/16").data["stale"] = 1
+		tree.search_exact("dead:beef::/32").data["stale"] = 1
+		self.assertEquals(tree.prune("stale"), 2)
+		self.assertEquals(tree.prefixes(), [ "10.0.0.0/8", "11.0.0.0/8" ])
+		self.assertEquals(tree.prune(lambda n: n.prefixlen == 8), 2)
+		self.assertEquals(tree.num_prefixes(), 0)
+		tree.add("10.0.0.0/8")
+		self.assertRaises(RuntimeWarning, tree.prune,
+		    lambda n: tree.add("11.0.0.0/8"))
+
+	def test_49__journal_write_failure(self):
+		try:
+			import resource
+		except ImportError:
+			self.skipTest("no resource module")
+		fd, path = tempfile.mkstemp()
+		os.close(fd)
+		os.unlink(path)
+		limits = resource.getrlimit(resource.RLIMIT_FSIZE)
+		try:
+			tree = radix.Radix()
+			tree.journal(path, batch = 2)
+			tree.add("10.0.0.0/8")
+			tree.add("10.1.0.0/16")
+			# Let the file grow no further, so the next batch fails
+			resource.setrlimit(resource.RLIMIT_FSIZE,
+			    (os.path.getsize(path), limits[1]))
+			tree.add("10.2.0.0/16")
+			self.assertRaises(IOError, tree.add, "10.3.0.0/16")
+			for i in range(10):
+				self.assertRaises(IOError, tree.add,
+				    "11.%d.0.0/16" % i)
+			self.assertRaises(IOError, tree.delete, "10.0.0.0/8")
+			self.assertRaises(IOError, tree.delete_covered,
+			    "10.0.0.0/8")
+			self.assertRaises(IOError, tree.prune, lambda n: True)
+			self.assertRaises(IOError, tree.sync)
+			self.assertEquals(tree.prefixes(), [ "10.0.0.0/8",
+			    "10.1.0.0/16", "10.2.0.0/16" ])
+			resource.setrlimit(resource.RLIMIT_FSIZE, limits)
+			self.assertRaises(IOError, tree.journal, None)
+			tree2 = radix.Radix()
+			tree2.replay(path)
+			self.assertEquals(tree2.prefixes(),
+			    [ "10.0.0.0/8", "10.1.0.0/16" ])
+		finally:
+			resource.setrlimit(resource.RLIMIT_FSIZE, limits)
+			os.unlink(path)
+
+	def test_50__disk_radix_grow_failure(self):
+		try:
+			import resource
+		except ImportError:
+			self.skipTest("no resource module")
+		try:
+			f = open("/proc/self/status")
+			vmsize = [ int(l.split()[1]) * 1024 for l in f
+			    if l.startswith("VmSize:") ][0]
+			f.close()
+		except (IOError, IndexError):
+			self.skipTest("no /proc/self/status")
+		fd, path = tempfile.mkstemp()
+		os.close(fd)
+		os.unlink(path)
+		limits = resource.getrlimit(resource.RLIMIT_AS)
+		try:
+			tree = radix.DiskRadix(path)
+			# Leave room for a few remappings, then let one fail
+			resource.setrlimit(resource.RLIMIT_AS,
+			    (vmsize + 16 * 1024 * 1024, limits[1]))
+			n = 0
+			try:
+				while n < 1000000:
+					tree.add("%d.%d.%d.0/24" % (n >> 16,
+					    (n >> 8) & 0xff, n & 0xff), value = n)
+					n += 1
+			except (IOError, OSError):
+				pass
+			resource.setrlimit(resource.RLIMIT_AS, limits)
+			self.assertTrue(n < 1000000)
+			self.assertEquals(len(tree), n)
+			self.assertEquals(tree.search_exact("0.0.1.0/24"),
+			    ("0.0.1.0/24", 1))
+			tree.add("255.0.0.0/8", value = 2)
+			self.assertEquals(len(tree), n + 1)
+			tree.close()
+		finally:
+			resource.setrlimit(resource.RLIMIT_AS, limits)
+			os.unlink(path)
+
+	def test_51__disk_radix_corrupt(self):
+		fd, path = tempfile.mkstemp()
+		os.close(fd)
+		os.unlink(path)
+		try:
+			tree = radix.DiskRadix(path)
+			tree.add("10.0.0.0/8", value = 1)
+			tree.add("10.0.0.0/16", value = 2)
+			tree.close()
+			f = open(path, "r+b")
+			f.seek(24)
+			head = f.read(4)
+			# A tree head beyond the end of the file
+			f.seek(24)
+			f.write(struct.pack("=I", 1000000))
+			f.flush()
+			self.assertRaises(IOError, radix.DiskRadix, path)
+			# A node linking back to itself
+			f.seek(24)
+			f.write(head)
+			node = struct.unpack("=I", head)[0]
+			f.seek(node // 102 * 4096 + node % 102 * 40)
+			f.write(struct.pack("=II", node, node))
+			f.close()
+			tree = radix.DiskRadix(path)
+			self.assertEquals(len(tree), 2)
+			self.assertRaises(IOError, tree.search_best, "10.0.0.1")
+			self.assertRaises(IOError, tree.prefixes)
+			self.assertRaises(IOError, len, tree)
+			tree.close()
+		finally:
+			os.unlink(path)
+
 def main():
 	unittest.main()
 